@@ -0,0 +1,193 @@
+/**
+ * acceptbench.c - mide cuántas vueltas da el selector de socks5d por cada
+ * conexión que acepta durante una avalancha de conexiones
+ *
+ * Abre `-n' conexiones al proxy en ráfagas de `-b': cada una se conecta y
+ * manda el hello SOCKS5 de una, así la ráfaga entera queda en la cola del
+ * socket pasivo, y recién después se esperan las respuestas y se cierran.
+ * Antes y después se consulta por el protocolo de monitoreo cuántas vueltas
+ * dieron los selectores, y se informa la diferencia por conexión. Comparar
+ * con distintos --accept-batch muestra cuántas vueltas ahorra aceptar de a
+ * varias por evento.
+ *
+ *   MONITOR_ROOT_TOKEN=abcdefghijklmnop ./socks5d -p 1080 --accept-batch=1 &
+ *   ./bench/acceptbench -p 1080 -k abcdefghijklmnop -n 20000 -b 256
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TOKEN_SIZE  16
+#define MAX_BURST   4096
+
+static struct {
+    const char *proxy;
+    uint16_t    port;
+    uint16_t    monitor_port;
+    const char *token;
+    unsigned    conns;
+    unsigned    burst;
+} opts = {
+    .proxy        = "127.0.0.1",
+    .port         = 1080,
+    .monitor_port = 8080,
+    .conns        = 20000,
+    .burst        = 256,
+};
+
+static void
+die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+send_all(const int fd, const uint8_t *p, size_t n) {
+    while(n > 0) {
+        const ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if(w <= 0) {
+            die("send");
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+static void
+recv_all(const int fd, uint8_t *p, size_t n) {
+    while(n > 0) {
+        const ssize_t r = recv(fd, p, n, 0);
+        if(r <= 0) {
+            fprintf(stderr, "server closed the connection before replying\n");
+            exit(1);
+        }
+        p += r;
+        n -= r;
+    }
+}
+
+/** conecta de forma bloqueante a `opts.proxy':`port' */
+static int
+tcp_connect(const uint16_t port) {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(port),
+    };
+    if(inet_pton(AF_INET, opts.proxy, &addr.sin_addr) != 1) {
+        fprintf(stderr, "invalid proxy address %s\n", opts.proxy);
+        exit(1);
+    }
+    const int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(fd == -1) {
+        die("socket");
+    }
+    if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        die("connect");
+    }
+    return fd;
+}
+
+/** vueltas de los selectores del proxy, según el protocolo de monitoreo */
+static uint32_t
+iterations(void) {
+    // VER | TOKEN | MÉTODO (GET) | TARGET (vueltas) | DLEN | DATA
+    uint8_t req[1 + TOKEN_SIZE + 1 + 1 + 2 + 1] = { 0x01 };
+    memcpy(req + 1, opts.token, TOKEN_SIZE);
+    req[1 + TOKEN_SIZE]     = 0x00;
+    req[1 + TOKEN_SIZE + 1] = 0x09;
+    req[1 + TOKEN_SIZE + 3] = 0x01;
+
+    // STATUS | DLEN | DATA
+    uint8_t res[1 + 2 + 4];
+    const int fd = tcp_connect(opts.monitor_port);
+    send_all(fd, req, sizeof(req));
+    recv_all(fd, res, sizeof(res));
+    close(fd);
+    if(res[0] != 0x00) {
+        fprintf(stderr, "monitor replied status %d\n", res[0]);
+        exit(1);
+    }
+    return (uint32_t) res[3] << 24 | (uint32_t) res[4] << 16 | (uint32_t) res[5] << 8 | res[6];
+}
+
+static void
+usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s -k token [-a proxy-addr] [-p proxy-port] [-P monitor-port]\n"
+        "          [-n connections] [-b burst]\n", prog);
+    exit(1);
+}
+
+static void
+parse_args(int argc, char **argv) {
+    int c;
+    while((c = getopt(argc, argv, "a:p:P:k:n:b:")) != -1) {
+        switch(c) {
+            case 'a': opts.proxy        = optarg;                   break;
+            case 'p': opts.port         = (uint16_t) atoi(optarg);  break;
+            case 'P': opts.monitor_port = (uint16_t) atoi(optarg);  break;
+            case 'k': opts.token        = optarg;                   break;
+            case 'n': opts.conns        = (unsigned) atoi(optarg);  break;
+            case 'b': opts.burst        = (unsigned) atoi(optarg);  break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(opts.token == NULL || strlen(opts.token) != TOKEN_SIZE || opts.conns == 0
+       || opts.burst == 0 || opts.burst > MAX_BURST) {
+        usage(argv[0]);
+    }
+}
+
+int
+main(int argc, char **argv) {
+    static int fds[MAX_BURST];
+    static const uint8_t hello[] = { 0x05, 0x01, 0x00 };
+    uint8_t reply[2];
+
+    parse_args(argc, argv);
+
+    const uint32_t before = iterations();
+    const double   start  = now();
+    for(unsigned done = 0; done < opts.conns; ) {
+        const unsigned n = opts.conns - done < opts.burst ? opts.conns - done : opts.burst;
+        for(unsigned i = 0; i < n; i++) {
+            fds[i] = tcp_connect(opts.port);
+            send_all(fds[i], hello, sizeof(hello));
+        }
+        for(unsigned i = 0; i < n; i++) {
+            recv_all(fds[i], reply, sizeof(reply));
+            if(reply[1] != 0x00) {
+                fprintf(stderr, "proxy requires authentication\n");
+                return 1;
+            }
+            close(fds[i]);
+        }
+        done += n;
+    }
+    const double   elapsed = now() - start;
+    // la consulta del final cuenta como una vuelta más, no hace diferencia
+    const uint32_t after   = iterations();
+
+    printf("connections           %u\n", opts.conns);
+    printf("burst                 %u\n", opts.burst);
+    printf("connections/s         %.0f\n", opts.conns / elapsed);
+    printf("selector iterations   %u\n", after - before);
+    printf("iterations/connection %.2f\n", (double) (after - before) / opts.conns);
+    return 0;
+}
@@ -0,0 +1,317 @@
+/**
+ * allocbench.c - cuenta cuánta memoria se aloca por cada CONNECT a un dominio
+ *
+ * Corre socks5d en un hilo de este mismo proceso (server.c se compila con su
+ * main renombrado a socks5d_main) y reemplaza malloc, calloc, realloc y
+ * aligned_alloc por versiones que cuentan las llamadas antes de pasarlas a
+ * las de glibc. Como el ejecutable las define, también se cuentan las que
+ * hace la propia libc (p.e. getaddrinfo). Se llevan dos cuentas: la del hilo
+ * del selector, que atiende las conexiones, y la de todo el proceso, que
+ * suma la de los hilos del pool de resolvers.
+ *
+ * Los CONNECT se piden de a uno hacia un origin propio, con --dns=system:
+ * primero a nombres que no están en el cache (127.2.x.y, que getaddrinfo
+ * resuelve sin consultar a ningún nameserver) y después siempre al mismo.
+ * Antes se hace una pasada de calentamiento para que los slabs y las
+ * entradas y consultas para reusar ya estén alocados. Cada nombre nuevo
+ * ocupa una entrada nueva del cache, que se aloca hasta que la tabla se
+ * llena y empieza a reusar las que desaloja.
+ *
+ *   ./bench/allocbench [-n connects] [-w warmup]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/** el main de server.c */
+int socks5d_main(const int argc, char **argv);
+
+////////////////////////////////////////////////////////////////////////////////
+// CUENTA DE ALOCACIONES
+////////////////////////////////////////////////////////////////////////////////
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+static atomic_ulong loop_allocs;
+static atomic_ulong all_allocs;
+
+/** prendido en el hilo que corre el selector de socks5d */
+static _Thread_local bool in_loop;
+
+static void
+count(void) {
+    atomic_fetch_add_explicit(&all_allocs, 1, memory_order_relaxed);
+    if(in_loop) {
+        atomic_fetch_add_explicit(&loop_allocs, 1, memory_order_relaxed);
+    }
+}
+
+void *
+malloc(size_t size) {
+    count();
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size) {
+    count();
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size) {
+    count();
+    return __libc_realloc(ptr, size);
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size) {
+    count();
+    return __libc_memalign(alignment, size);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CLIENTE
+////////////////////////////////////////////////////////////////////////////////
+
+static struct {
+    unsigned connects;
+    unsigned warmup;
+} opts = {
+    .connects = 2000,
+    .warmup   = 500,
+};
+
+static uint16_t proxy_port;
+static int      origin;
+
+static void
+die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static void
+send_all(const int fd, const uint8_t *p, size_t n) {
+    while(n > 0) {
+        const ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if(w <= 0) {
+            die("send");
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+static void
+recv_all(const int fd, uint8_t *p, size_t n) {
+    while(n > 0) {
+        const ssize_t r = recv(fd, p, n, 0);
+        if(r <= 0) {
+            fprintf(stderr, "proxy closed the connection during the handshake\n");
+            exit(1);
+        }
+        p += r;
+        n -= r;
+    }
+}
+
+/** socket TCP en loopback ligado a un puerto efímero; retorna el puerto */
+static uint16_t
+ephemeral_port(int *fd, const bool any) {
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_addr.s_addr = htonl(any ? INADDR_ANY : INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+    *fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(*fd == -1
+       || bind(*fd, (struct sockaddr *) &addr, sizeof(addr)) == -1
+       || getsockname(*fd, (struct sockaddr *) &addr, &addr_len) == -1) {
+        die("bind");
+    }
+    return ntohs(addr.sin_port);
+}
+
+static int
+proxy_connect(void) {
+    const struct sockaddr_in proxy = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(proxy_port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    const int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(fd == -1) {
+        die("socket");
+    }
+    if(connect(fd, (const struct sockaddr *) &proxy, sizeof(proxy)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** CONNECT a `name' hasta tener la respuesta y la conexión en el origin */
+static void
+socks_connect(const char *name, const uint16_t port) {
+    const int fd = proxy_connect();
+    if(fd == -1) {
+        die("connect");
+    }
+    uint8_t msg[4 + 1 + 0xFF + 2];
+    const uint8_t hello[] = { 0x05, 0x01, 0x00 };
+    send_all(fd, hello, sizeof(hello));
+    recv_all(fd, msg, 2);
+    if(msg[1] != 0x00) {
+        fprintf(stderr, "proxy rejected the authentication method\n");
+        exit(1);
+    }
+    const size_t len = strlen(name);
+    msg[0] = 0x05;
+    msg[1] = 0x01;
+    msg[2] = 0x00;
+    msg[3] = 0x03;
+    msg[4] = (uint8_t) len;
+    memcpy(msg + 5, name, len);
+    msg[5 + len] = port >> 8;
+    msg[6 + len] = port & 0xFF;
+    send_all(fd, msg, 7 + len);
+    // respuesta con la dirección IPv4 o IPv6 con la que se conectó
+    recv_all(fd, msg, 4);
+    if(msg[1] != 0x00) {
+        fprintf(stderr, "proxy replied %d to CONNECT %s\n", msg[1], name);
+        exit(1);
+    }
+    recv_all(fd, msg + 4, (msg[3] == 0x04 ? 16 : 4) + 2);
+
+    const int peer = accept(origin, NULL, NULL);
+    if(peer == -1) {
+        die("accept");
+    }
+    close(peer);
+    close(fd);
+}
+
+static void *
+server_run(void *data) {
+    char **argv = data;
+    int argc = 0;
+    while(argv[argc] != NULL) {
+        argc++;
+    }
+    in_loop = true;
+    optind  = 1;
+    exit(socks5d_main(argc, argv));
+}
+
+static void
+usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-n connects] [-w warmup]\n", prog);
+    exit(1);
+}
+
+static void
+parse_args(int argc, char **argv) {
+    int c;
+    while((c = getopt(argc, argv, "n:w:")) != -1) {
+        switch(c) {
+            case 'n': opts.connects = (unsigned) atoi(optarg); break;
+            case 'w': opts.warmup   = (unsigned) atoi(optarg); break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(opts.connects == 0 || opts.connects > 0x10000 || opts.warmup > 0x10000) {
+        usage(argv[0]);
+    }
+}
+
+/** pide `n' CONNECT, a nombres distintos de 127.`net'.x.y o siempre al mismo */
+static void
+run(const unsigned n, const unsigned net, const bool same, const uint16_t port,
+    unsigned long *loop, unsigned long *all) {
+    char name[32];
+    const unsigned long loop0 = atomic_load(&loop_allocs);
+    const unsigned long all0  = atomic_load(&all_allocs);
+    for(unsigned i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "127.%u.%u.%u", net, same ? 0 : i >> 8, same ? 1 : i & 0xFF);
+        socks_connect(name, port);
+    }
+    *loop = atomic_load(&loop_allocs) - loop0;
+    *all  = atomic_load(&all_allocs) - all0;
+}
+
+int
+main(int argc, char **argv) {
+    parse_args(argc, argv);
+
+    // el origin escucha en todas las direcciones para atender 127.x.y.z
+    const uint16_t port = ephemeral_port(&origin, true);
+    if(listen(origin, SOMAXCONN) == -1) {
+        die("listen");
+    }
+    int fd;
+    char proxy[8], monitor[8];
+    proxy_port = ephemeral_port(&fd, false);
+    snprintf(proxy, sizeof(proxy), "%u", proxy_port);
+    close(fd);
+    snprintf(monitor, sizeof(monitor), "%u", ephemeral_port(&fd, false));
+    close(fd);
+
+    // el registro de accesos de socks5d va a stdout: se descarta
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if(report == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        die("stdout");
+    }
+    setenv("MONITOR_ROOT_TOKEN", "allocbenchtoken0", 1);
+    static char *server_argv[] = {
+        "socks5d", "-l", "127.0.0.1", "-p", NULL, "-L", "127.0.0.1", "-P", NULL,
+        "-N", "--dns=system", "--workers=1", NULL,
+    };
+    server_argv[4] = proxy;
+    server_argv[8] = monitor;
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, server_run, server_argv) != 0) {
+        die("pthread_create");
+    }
+    for(unsigned tries = 0; (fd = proxy_connect()) == -1; tries++) {
+        if(tries == 500) {
+            fprintf(stderr, "socks5d did not start\n");
+            return 1;
+        }
+        nanosleep(&(struct timespec) { .tv_nsec = 10000000 }, NULL);
+    }
+    close(fd);
+
+    unsigned long loop, all;
+    run(opts.warmup, 1, false, port, &loop, &all);
+    run(opts.warmup, 1, true, port, &loop, &all);
+
+    unsigned long miss_loop, miss_all, hit_loop, hit_all;
+    run(opts.connects, 2, false, port, &miss_loop, &miss_all);
+    run(opts.connects, 2, true, port, &hit_loop, &hit_all);
+
+    fprintf(report, "connects         %u\n", opts.connects);
+    fprintf(report, "allocations per CONNECT   event loop   whole process\n");
+    fprintf(report, "cache miss                %10.2f   %13.2f\n",
+            (double) miss_loop / opts.connects, (double) miss_all / opts.connects);
+    fprintf(report, "cache hit                 %10.2f   %13.2f\n",
+            (double) hit_loop / opts.connects, (double) hit_all / opts.connects);
+    fflush(report);
+    // socks5d sigue corriendo en su hilo: se termina el proceso entero
+    _exit(0);
+}
@@ -0,0 +1,371 @@
+/**
+ * authverifierd.c - verificador de credenciales de prueba para --auth-verifier
+ *
+ * Atiende el protocolo de authverify.h en un socket Unix: lee pedidos
+ * ID | ULEN | UNAME | PLEN | PASSWD y contesta ID | STATUS. Acepta las
+ * credenciales dadas con `-u' (o todas con `-a') y rechaza el resto.
+ *
+ * Para ejercitar al proxy:
+ *   -d ms   demora cada respuesta; los pedidos siguientes llegan sin esperar
+ *           las anteriores (pipelining).
+ *   -j ms   suma una demora al azar de hasta `ms', así las respuestas salen
+ *           en otro orden que los pedidos.
+ *   -x N    contesta N pedidos y termina al recibir el siguiente, sin
+ *           contestarlo, como un verificador que se cae; al volver a
+ *           lanzarlo el proxy se reconecta con un pedido posterior.
+ *
+ * Al terminar (o con SIGINT) informa cuántos pedidos leyó y en cuántas
+ * lecturas, lo que muestra cuántos manda juntos el proxy.
+ *
+ *   ./bench/authverifierd -s /tmp/verifier.sock -u alice:secret -d 50 &
+ *   MONITOR_ROOT_TOKEN=x ./socks5d --auth-verifier=/tmp/verifier.sock
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+
+#define MAX_USERS   64
+#define MAX_EVENTS  64
+/** un pedido ocupa como mucho 4 + 1 + 255 + 1 + 255 bytes */
+#define MAX_REQUEST (4 + 1 + 0xFF + 1 + 0xFF)
+#define IN_SIZE     (64 * MAX_REQUEST)
+#define OUT_SIZE    (64 * 1024)
+
+/** una conexión del proxy (una por selector) */
+struct conn {
+    int         fd;
+    uint8_t     in[IN_SIZE];
+    size_t      in_len;
+    uint8_t     out[OUT_SIZE];
+    size_t      out_len;
+    struct conn *next;
+};
+
+/** respuesta demorada hasta `due' */
+struct reply {
+    struct conn  *conn;
+    uint8_t       msg[5];
+    double        due;
+    struct reply *next;
+};
+
+static struct {
+    const char *path;
+    const char *users[MAX_USERS];
+    unsigned    nusers;
+    bool        accept_all;
+    unsigned    delay;
+    unsigned    jitter;
+    unsigned long exit_after;
+} opts = {
+    .path = "/tmp/authverifierd.sock",
+};
+
+static struct conn  *conns;
+static struct reply *replies;
+static unsigned long requests, reads, max_per_read;
+static volatile sig_atomic_t done;
+
+static void
+die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+set_nio(const int fd) {
+    const int flags = fcntl(fd, F_GETFL, 0);
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        die("fcntl");
+    }
+}
+
+static void
+on_signal(int signum) {
+    done = 1;
+}
+
+/** si `uname':`passwd' está entre las credenciales aceptadas */
+static bool
+granted(const uint8_t *uname, const uint8_t ulen, const uint8_t *passwd, const uint8_t plen) {
+    if(opts.accept_all) {
+        return true;
+    }
+    for(unsigned i = 0; i < opts.nusers; i++) {
+        const char *u = opts.users[i], *colon = strchr(u, ':');
+        if((size_t) (colon - u) == ulen && memcmp(u, uname, ulen) == 0
+           && strlen(colon + 1) == plen && memcmp(colon + 1, passwd, plen) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void
+conn_close(const int ep, struct conn *c) {
+    for(struct conn **p = &conns; *p != NULL; p = &(*p)->next) {
+        if(*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    // las respuestas demoradas de la conexión se descartan
+    for(struct reply **p = &replies; *p != NULL; ) {
+        if((*p)->conn == c) {
+            struct reply *r = *p;
+            *p = r->next;
+            free(r);
+        } else {
+            p = &(*p)->next;
+        }
+    }
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c);
+}
+
+/** manda lo que se pueda de la salida; false si la conexión se cerró */
+static bool
+conn_flush(const int ep, struct conn *c) {
+    while(c->out_len > 0) {
+        const ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if(n <= 0) {
+            conn_close(ep, c);
+            return false;
+        }
+        c->out_len -= n;
+        memmove(c->out, c->out + n, c->out_len);
+    }
+    struct epoll_event ev = {
+        .events  = EPOLLIN | (c->out_len > 0 ? EPOLLOUT : 0),
+        .data.ptr = c,
+    };
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+    return true;
+}
+
+static void
+reply_queue(struct conn *c, const uint8_t *id, const bool ok) {
+    struct reply *r = malloc(sizeof(*r));
+    if(r == NULL) {
+        die("malloc");
+    }
+    r->conn   = c;
+    memcpy(r->msg, id, 4);
+    r->msg[4] = ok ? 0x00 : 0x01;
+    r->due    = now() + (opts.delay + (opts.jitter > 0 ? rand() % (opts.jitter + 1) : 0)) / 1000.0;
+    r->next   = replies;
+    replies   = r;
+}
+
+/** pasa a la salida de su conexión las respuestas vencidas */
+static void
+replies_due(const int ep) {
+    const double t = now();
+    for(struct reply **p = &replies; *p != NULL; ) {
+        struct reply *r = *p;
+        if(r->due > t || r->conn->out_len + sizeof(r->msg) > OUT_SIZE) {
+            p = &r->next;
+            continue;
+        }
+        memcpy(r->conn->out + r->conn->out_len, r->msg, sizeof(r->msg));
+        r->conn->out_len += sizeof(r->msg);
+        *p = r->next;
+        free(r);
+    }
+    for(struct conn *c = conns, *next; c != NULL; c = next) {
+        next = c->next;
+        if(c->out_len > 0) {
+            conn_flush(ep, c);
+        }
+    }
+}
+
+/** milisegundos hasta la próxima respuesta demorada, -1 si no hay */
+static int
+replies_wait(void) {
+    if(replies == NULL) {
+        return -1;
+    }
+    double first = replies->due;
+    for(const struct reply *r = replies->next; r != NULL; r = r->next) {
+        if(r->due < first) {
+            first = r->due;
+        }
+    }
+    const double ms = (first - now()) * 1000;
+    return ms <= 0 ? 0 : (int) ms + 1;
+}
+
+/** lee y procesa los pedidos completos que haya */
+static void
+conn_read(const int ep, struct conn *c) {
+    const ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if(n <= 0) {
+        conn_close(ep, c);
+        return;
+    }
+    c->in_len += n;
+    reads++;
+
+    unsigned long got = 0;
+    size_t off = 0;
+    while(c->in_len - off >= 5) {
+        const uint8_t *p   = c->in + off;
+        const uint8_t ulen = p[4];
+        if(c->in_len - off < 4 + 1 + (size_t) ulen + 1) {
+            break;
+        }
+        const uint8_t plen = p[5 + ulen];
+        const size_t  len  = 4 + 1 + ulen + 1 + plen;
+        if(c->in_len - off < len) {
+            break;
+        }
+        if(opts.exit_after > 0 && requests == opts.exit_after) {
+            fprintf(stderr, "exiting after %lu requests, without answering the next one\n", requests);
+            done = 1;
+            return;
+        }
+        requests++;
+        got++;
+        reply_queue(c, p, granted(p + 5, ulen, p + 6 + ulen, plen));
+        off += len;
+    }
+    c->in_len -= off;
+    memmove(c->in, c->in + off, c->in_len);
+    if(got > max_per_read) {
+        max_per_read = got;
+    }
+}
+
+static void
+usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-s socket-path] [-u user:pass]... [-a] [-d delay-ms] [-j jitter-ms]\n"
+        "          [-x exit-after-requests]\n", prog);
+    exit(1);
+}
+
+static void
+parse_args(int argc, char **argv) {
+    int c;
+    while((c = getopt(argc, argv, "s:u:ad:j:x:")) != -1) {
+        switch(c) {
+            case 's': opts.path       = optarg;                         break;
+            case 'a': opts.accept_all = true;                           break;
+            case 'd': opts.delay      = (unsigned) atoi(optarg);        break;
+            case 'j': opts.jitter     = (unsigned) atoi(optarg);        break;
+            case 'x': opts.exit_after = strtoul(optarg, NULL, 10);      break;
+            case 'u':
+                if(strchr(optarg, ':') == NULL || opts.nusers == MAX_USERS) {
+                    usage(argv[0]);
+                }
+                opts.users[opts.nusers++] = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+}
+
+int
+main(int argc, char **argv) {
+    parse_args(argc, argv);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if(strlen(opts.path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, opts.path);
+    // el socket de una ejecución anterior que se cayó
+    unlink(opts.path);
+
+    const int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(server == -1
+       || bind(server, (struct sockaddr *) &addr, sizeof(addr)) == -1
+       || listen(server, SOMAXCONN) == -1) {
+        die("verifier socket");
+    }
+    set_nio(server);
+
+    const int ep = epoll_create1(0);
+    if(ep == -1) {
+        die("epoll_create1");
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if(epoll_ctl(ep, EPOLL_CTL_ADD, server, &ev) == -1) {
+        die("epoll_ctl");
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    srand((unsigned) time(NULL));
+
+    struct epoll_event events[MAX_EVENTS];
+    while(!done) {
+        const int n = epoll_wait(ep, events, MAX_EVENTS, replies_wait());
+        if(n == -1 && errno != EINTR) {
+            die("epoll_wait");
+        }
+        for(int i = 0; i < n && !done; i++) {
+            struct conn *c = events[i].data.ptr;
+            if(c == NULL) {
+                int fd;
+                while((fd = accept(server, NULL, NULL)) != -1) {
+                    set_nio(fd);
+                    struct conn *nc = calloc(1, sizeof(*nc));
+                    if(nc == NULL) {
+                        die("calloc");
+                    }
+                    nc->fd   = fd;
+                    nc->next = conns;
+                    conns    = nc;
+                    struct epoll_event cev = { .events = EPOLLIN, .data.ptr = nc };
+                    if(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &cev) == -1) {
+                        die("epoll_ctl");
+                    }
+                }
+            } else if(events[i].events & EPOLLOUT) {
+                if(conn_flush(ep, c) && (events[i].events & EPOLLIN)) {
+                    conn_read(ep, c);
+                }
+            } else {
+                conn_read(ep, c);
+            }
+        }
+        if(!done) {
+            replies_due(ep);
+        }
+    }
+
+    printf("requests         %lu\n", requests);
+    printf("reads            %lu\n", reads);
+    printf("requests/read    %.2f\n", reads == 0 ? 0.0 : (double) requests / reads);
+    printf("max per read     %lu\n", max_per_read);
+    unlink(opts.path);
+    return 0;
+}
@@ -0,0 +1,330 @@
+/**
+ * parsebench.c - compara y mide los parsers del handshake SOCKS5
+ *
+ * hello_consume(), auth_consume() y request_consume() parsean de una pasada
+ * los mensajes que llegaron enteros y byte a byte los que llegaron de a
+ * partes. Primero se verifica que ambos caminos dejen el mismo resultado
+ * (estado, métodos ofrecidos, struct auth, struct request y bytes sin
+ * consumir) para mensajes enteros, fragmentados en todos los cortes posibles
+ * y seguidos del mensaje siguiente. Después se mide cuántos handshakes
+ * (hello + auth + request) por segundo parsea cada camino.
+ *
+ *   ./bench/parsebench [iteraciones]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../src/include/buffer.h"
+#include "../src/include/hello.h"
+#include "../src/include/auth.h"
+#include "../src/include/request.h"
+
+#define N(x) (sizeof(x)/sizeof((x)[0]))
+
+#define MAX_MSG 1024
+
+/** mensaje de prueba, tal como lo manda el cliente */
+struct msg {
+    uint8_t data[MAX_MSG];
+    size_t  len;
+};
+
+/** lo que deja un parser luego de consumir un mensaje */
+struct outcome {
+    int            state;
+    bool           errored;
+    size_t         left;
+    uint8_t        methods[0xFF];
+    unsigned       nmethods;
+    struct auth    auth;
+    struct request request;
+};
+
+static unsigned failures;
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** agrega `n' bytes a `m' */
+static void
+put(struct msg *m, const void *data, const size_t n) {
+    memcpy(m->data + m->len, data, n);
+    m->len += n;
+}
+
+static void
+put8(struct msg *m, const uint8_t c) {
+    put(m, &c, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// PARSERS
+////////////////////////////////////////////////////////////////////////////////
+
+enum kind { HELLO, AUTH, REQUEST };
+
+static void
+on_method(struct hello_parser *p, const uint8_t method) {
+    struct outcome *o = p->data;
+    o->methods[o->nmethods++] = method;
+}
+
+/**
+ * entrega `m' a un parser nuevo como si llegara en varios recv(): primero
+ * `first' bytes y después pedazos de `chunk' bytes (0: todo lo que queda).
+ */
+static void
+parse(const enum kind kind, const struct msg *m, const size_t first, const size_t chunk,
+      struct outcome *o) {
+    uint8_t raw[MAX_MSG];
+    buffer b;
+    struct hello_parser   hp = { .on_authentication_method = on_method, .data = o };
+    struct auth_parser    ap = { .auth = &o->auth };
+    struct request_parser rp = { .request = &o->request };
+
+    o->nmethods = 0;
+    o->errored  = false;
+    buffer_init(&b, sizeof(raw), raw);
+    switch(kind) {
+        case HELLO:   hello_parser_init(&hp);   break;
+        case AUTH:    auth_parser_init(&ap);    break;
+        case REQUEST: request_parser_init(&rp); break;
+    }
+
+    size_t off = 0;
+    bool done  = false;
+    while(!done && off < m->len) {
+        const size_t want = off == 0 ? first : chunk;
+        const size_t n    = want == 0 || m->len - off < want ? m->len - off : want;
+        size_t room;
+        memcpy(buffer_write_ptr(&b, &room), m->data + off, n);
+        buffer_write_adv(&b, n);
+        off += n;
+        switch(kind) {
+            case HELLO:
+                o->state = hello_consume(&b, &hp, &o->errored);
+                done     = hello_is_done(o->state, NULL);
+                break;
+            case AUTH:
+                o->state = auth_consume(&b, &ap, &o->errored);
+                done     = auth_is_done(o->state, NULL);
+                break;
+            case REQUEST:
+                o->state = request_consume(&b, &rp, &o->errored);
+                done     = request_is_done(o->state, NULL);
+                break;
+        }
+    }
+    buffer_read_ptr(&b, &o->left);
+    o->left += m->len - off;
+}
+
+static bool
+outcome_equal(const enum kind kind, const struct outcome *a, const struct outcome *b) {
+    if(a->state != b->state || a->errored != b->errored || a->left != b->left) {
+        return false;
+    }
+    switch(kind) {
+        case HELLO:
+            return a->nmethods == b->nmethods
+                && memcmp(a->methods, b->methods, a->nmethods) == 0;
+        case AUTH:
+            return memcmp(&a->auth, &b->auth, sizeof(a->auth)) == 0;
+        case REQUEST:
+            return memcmp(&a->request, &b->request, sizeof(a->request)) == 0;
+    }
+    return false;
+}
+
+/** compara el mensaje entero contra todos sus cortes posibles */
+static void
+check(const enum kind kind, const char *name, const struct msg *m) {
+    struct outcome whole, frag;
+    // los campos que ningún parser toca tienen que quedar iguales en los dos
+    memset(&whole, 0xA5, sizeof(whole));
+    parse(kind, m, 0, 0, &whole);
+    for(size_t chunk = 1; chunk < m->len; chunk++) {
+        memset(&frag, 0xA5, sizeof(frag));
+        parse(kind, m, chunk, chunk, &frag);
+        if(!outcome_equal(kind, &whole, &frag)) {
+            fprintf(stderr, "FAIL %s: whole and %zu-byte chunks differ\n", name, chunk);
+            failures++;
+            return;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MENSAJES
+////////////////////////////////////////////////////////////////////////////////
+
+static struct msg
+hello_msg(const uint8_t nmethods) {
+    struct msg m = { .len = 0 };
+    put8(&m, 0x05);
+    put8(&m, nmethods);
+    for(unsigned i = 0; i < nmethods; i++) {
+        put8(&m, (uint8_t) (i * 7));
+    }
+    return m;
+}
+
+static struct msg
+auth_msg(const uint8_t ulen, const uint8_t plen) {
+    struct msg m = { .len = 0 };
+    put8(&m, 0x01);
+    put8(&m, ulen);
+    for(unsigned i = 0; i < ulen; i++) {
+        put8(&m, 'a' + i % 26);
+    }
+    put8(&m, plen);
+    for(unsigned i = 0; i < plen; i++) {
+        put8(&m, 'A' + i % 26);
+    }
+    return m;
+}
+
+static struct msg
+request_msg(const uint8_t atyp, const uint8_t fqdn_len) {
+    static const uint8_t v4[] = { 192, 168, 0, 1 };
+    static const uint8_t v6[] = { 0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1 };
+    static const uint8_t port[] = { 0x1f, 0x90 };
+    struct msg m = { .len = 0 };
+
+    put8(&m, 0x05);
+    put8(&m, socks_req_cmd_connect);
+    put8(&m, 0x00);
+    put8(&m, atyp);
+    switch(atyp) {
+        case socks_req_addrtype_ipv4:
+            put(&m, v4, sizeof(v4));
+            break;
+        case socks_req_addrtype_ipv6:
+            put(&m, v6, sizeof(v6));
+            break;
+        case socks_req_addrtype_domain:
+            put8(&m, fqdn_len);
+            for(unsigned i = 0; i < fqdn_len; i++) {
+                put8(&m, i % 10 == 9 ? '.' : 'a' + i % 26);
+            }
+            break;
+    }
+    put(&m, port, sizeof(port));
+    return m;
+}
+
+/** el mensaje seguido de lo que el cliente ya mandó del siguiente */
+static struct msg
+pipelined(struct msg m) {
+    static const uint8_t next[] = { 0x05, 0x01, 0x00, 0x03, 0x0b };
+    put(&m, next, sizeof(next));
+    return m;
+}
+
+static void
+check_all(void) {
+    char name[64];
+    static const uint8_t nmethods[] = { 0, 1, 2, 3, 17, 255 };
+    for(unsigned i = 0; i < N(nmethods); i++) {
+        snprintf(name, sizeof(name), "hello nmethods=%u", nmethods[i]);
+        struct msg m = hello_msg(nmethods[i]);
+        check(HELLO, name, &m);
+        m = pipelined(m);
+        check(HELLO, name, &m);
+    }
+    struct msg bad = hello_msg(3);
+    bad.data[0] = 0x04;
+    check(HELLO, "hello bad version", &bad);
+
+    static const uint8_t lens[] = { 0, 1, 5, 64, 255 };
+    for(unsigned i = 0; i < N(lens); i++) {
+        for(unsigned j = 0; j < N(lens); j++) {
+            snprintf(name, sizeof(name), "auth ulen=%u plen=%u", lens[i], lens[j]);
+            struct msg m = auth_msg(lens[i], lens[j]);
+            check(AUTH, name, &m);
+            m = pipelined(m);
+            check(AUTH, name, &m);
+        }
+    }
+    bad = auth_msg(3, 3);
+    bad.data[0] = 0x05;
+    check(AUTH, "auth bad version", &bad);
+
+    static const uint8_t fqdn[] = { 0, 1, 11, 64, 255 };
+    for(unsigned i = 0; i < N(fqdn); i++) {
+        snprintf(name, sizeof(name), "request fqdn len=%u", fqdn[i]);
+        struct msg m = request_msg(socks_req_addrtype_domain, fqdn[i]);
+        check(REQUEST, name, &m);
+        m = pipelined(m);
+        check(REQUEST, name, &m);
+    }
+    struct msg m = request_msg(socks_req_addrtype_ipv4, 0);
+    check(REQUEST, "request ipv4", &m);
+    m = pipelined(m);
+    check(REQUEST, "request ipv4 pipelined", &m);
+    m = request_msg(socks_req_addrtype_ipv6, 0);
+    check(REQUEST, "request ipv6", &m);
+    m = pipelined(m);
+    check(REQUEST, "request ipv6 pipelined", &m);
+    m = request_msg(0x07, 0);
+    check(REQUEST, "request bad atyp", &m);
+    m = request_msg(socks_req_addrtype_ipv4, 0);
+    m.data[0] = 0x04;
+    check(REQUEST, "request bad version", &m);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// BENCHMARK
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * parsea `iterations' handshakes típicos. Con `split' el primer byte de cada
+ * mensaje llega solo, así que el resto lo procesa el parser byte a byte como
+ * antes de que existiera el camino de una pasada.
+ */
+static double
+bench(const unsigned long iterations, const bool split) {
+    const struct msg msgs[] = {
+        hello_msg(2),
+        auth_msg(8, 12),
+        request_msg(socks_req_addrtype_domain, 15),
+    };
+    struct outcome o;
+    volatile unsigned sink = 0;
+
+    const double start = now();
+    for(unsigned long i = 0; i < iterations; i++) {
+        for(unsigned k = 0; k < N(msgs); k++) {
+            parse((enum kind) k, msgs + k, split ? 1 : 0, 0, &o);
+            sink += o.state;
+        }
+    }
+    (void) sink;
+    return iterations / (now() - start);
+}
+
+int
+main(int argc, char **argv) {
+    const unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 10) : 2000000;
+
+    check_all();
+    if(failures > 0) {
+        fprintf(stderr, "%u checks failed\n", failures);
+        return 1;
+    }
+    printf("whole and fragmented parses agree\n");
+
+    if(iterations > 0) {
+        printf("byte by byte     %.0f handshakes/s\n", bench(iterations, true));
+        printf("whole message    %.0f handshakes/s\n", bench(iterations, false));
+    }
+    return 0;
+}
@@ -0,0 +1,292 @@
+/**
+ * relaybench.c - mide cuántos mensajes por segundo releva un socks5d
+ *
+ * Abre `-c' conexiones CONNECT a través del proxy hacia un servidor de eco
+ * propio y en cada una hace ping-pong de mensajes de `-s' bytes durante
+ * `-t' segundos. Cada ida y vuelta son dos eventos de lectura del proxy (uno
+ * del cliente y otro del origin), así que el resultado refleja cuántos
+ * eventos por segundo despacha su selector con muchas conexiones vivas.
+ *
+ * El eco y los clientes corren en un solo hilo para no competir con el proxy
+ * por los procesadores más de lo necesario.
+ *
+ *   MONITOR_ROOT_TOKEN=x ./socks5d -p 1080 &
+ *   ./bench/relaybench -p 1080 -c 2000 -t 10
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_MSG     4096
+#define MAX_EVENTS  256
+
+/** una conexión cliente -> proxy, con el mensaje que está esperando de vuelta */
+struct conn {
+    int    fd;
+    size_t got;
+};
+
+static struct {
+    const char *proxy;
+    uint16_t    port;
+    unsigned    conns;
+    unsigned    seconds;
+    size_t      size;
+    const char *user;
+} opts = {
+    .proxy   = "127.0.0.1",
+    .port    = 1080,
+    .conns   = 1000,
+    .seconds = 10,
+    .size    = 64,
+};
+
+static void
+die(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+static double
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+set_nio(const int fd) {
+    const int flags = fcntl(fd, F_GETFL, 0);
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        die("fcntl");
+    }
+}
+
+static void
+send_all(const int fd, const uint8_t *p, size_t n) {
+    while(n > 0) {
+        const ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+        if(w <= 0) {
+            die("send");
+        }
+        p += w;
+        n -= w;
+    }
+}
+
+static void
+recv_all(const int fd, uint8_t *p, size_t n) {
+    while(n > 0) {
+        const ssize_t r = recv(fd, p, n, 0);
+        if(r <= 0) {
+            fprintf(stderr, "proxy closed the connection during the handshake\n");
+            exit(1);
+        }
+        p += r;
+        n -= r;
+    }
+}
+
+/** conecta al proxy y pide un CONNECT a 127.0.0.1:`port', de forma bloqueante */
+static int
+socks_connect(const uint16_t port) {
+    struct sockaddr_in proxy = {
+        .sin_family = AF_INET,
+        .sin_port   = htons(opts.port),
+    };
+    if(inet_pton(AF_INET, opts.proxy, &proxy.sin_addr) != 1) {
+        fprintf(stderr, "invalid proxy address %s\n", opts.proxy);
+        exit(1);
+    }
+    const int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(fd == -1) {
+        die("socket");
+    }
+    if(connect(fd, (struct sockaddr *) &proxy, sizeof(proxy)) == -1) {
+        die("connect");
+    }
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    uint8_t msg[3 + 2 * 0xFF];
+    const uint8_t hello[] = { 0x05, 0x01, opts.user == NULL ? 0x00 : 0x02 };
+    send_all(fd, hello, sizeof(hello));
+    recv_all(fd, msg, 2);
+    if(msg[1] != hello[2]) {
+        fprintf(stderr, "proxy rejected the authentication method\n");
+        exit(1);
+    }
+    if(opts.user != NULL) {
+        const char *colon = strchr(opts.user, ':');
+        const size_t ulen = colon - opts.user, plen = strlen(colon + 1);
+        msg[0] = 0x01;
+        msg[1] = ulen;
+        memcpy(msg + 2, opts.user, ulen);
+        msg[2 + ulen] = plen;
+        memcpy(msg + 3 + ulen, colon + 1, plen);
+        send_all(fd, msg, 3 + ulen + plen);
+        recv_all(fd, msg, 2);
+        if(msg[1] != 0x00) {
+            fprintf(stderr, "proxy rejected the credentials\n");
+            exit(1);
+        }
+    }
+    const uint8_t request[] = {
+        0x05, 0x01, 0x00, 0x01, 127, 0, 0, 1, port >> 8, port & 0xFF,
+    };
+    send_all(fd, request, sizeof(request));
+    recv_all(fd, msg, 10);
+    if(msg[1] != 0x00) {
+        fprintf(stderr, "proxy replied %d to CONNECT\n", msg[1]);
+        exit(1);
+    }
+    return fd;
+}
+
+static void
+usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-a proxy-addr] [-p proxy-port] [-c connections] [-t seconds]\n"
+        "          [-s message-size] [-u user:pass]\n", prog);
+    exit(1);
+}
+
+static void
+parse_args(int argc, char **argv) {
+    int c;
+    while((c = getopt(argc, argv, "a:p:c:t:s:u:")) != -1) {
+        switch(c) {
+            case 'a': opts.proxy   = optarg;                    break;
+            case 'p': opts.port    = (uint16_t) atoi(optarg);   break;
+            case 'c': opts.conns   = (unsigned) atoi(optarg);   break;
+            case 't': opts.seconds = (unsigned) atoi(optarg);   break;
+            case 's': opts.size    = (size_t) atol(optarg);     break;
+            case 'u':
+                opts.user = optarg;
+                if(strchr(optarg, ':') == NULL) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(opts.conns == 0 || opts.seconds == 0 || opts.size == 0 || opts.size > MAX_MSG) {
+        usage(argv[0]);
+    }
+}
+
+int
+main(int argc, char **argv) {
+    parse_args(argc, argv);
+
+    // servidor de eco en un puerto efímero de loopback
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+    const int server = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(server == -1
+       || bind(server, (struct sockaddr *) &addr, sizeof(addr)) == -1
+       || listen(server, SOMAXCONN) == -1
+       || getsockname(server, (struct sockaddr *) &addr, &addr_len) == -1) {
+        die("echo server");
+    }
+    set_nio(server);
+
+    const int ep = epoll_create1(0);
+    if(ep == -1) {
+        die("epoll_create1");
+    }
+    // los datos del evento distinguen clientes (índice >= 0) de ecos (-fd - 1)
+    struct conn *conns = calloc(opts.conns, sizeof(*conns));
+    if(conns == NULL) {
+        die("calloc");
+    }
+    for(unsigned i = 0; i < opts.conns; i++) {
+        conns[i].fd = socks_connect(ntohs(addr.sin_port));
+        set_nio(conns[i].fd);
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = i };
+        if(epoll_ctl(ep, EPOLL_CTL_ADD, conns[i].fd, &ev) == -1) {
+            die("epoll_ctl");
+        }
+        int fd;
+        while((fd = accept(server, NULL, NULL)) != -1) {
+            set_nio(fd);
+            struct epoll_event eev = { .events = EPOLLIN, .data.u64 = UINT64_MAX - fd };
+            if(epoll_ctl(ep, EPOLL_CTL_ADD, fd, &eev) == -1) {
+                die("epoll_ctl");
+            }
+        }
+    }
+
+    uint8_t msg[MAX_MSG], buf[MAX_MSG];
+    memset(msg, 'x', sizeof(msg));
+    for(unsigned i = 0; i < opts.conns; i++) {
+        send_all(conns[i].fd, msg, opts.size);
+    }
+
+    unsigned long long rounds = 0;
+    struct epoll_event events[MAX_EVENTS];
+    const double start = now();
+    const double end   = start + opts.seconds;
+    double t = start;
+    while(t < end) {
+        const int n = epoll_wait(ep, events, MAX_EVENTS, 100);
+        if(n == -1 && errno != EINTR) {
+            die("epoll_wait");
+        }
+        for(int i = 0; i < n; i++) {
+            const uint64_t data = events[i].data.u64;
+            if(data >= UINT64_MAX - 0x7fffffffULL) {
+                // eco: devolvemos lo que haya llegado
+                const int fd = (int) (UINT64_MAX - data);
+                const ssize_t r = recv(fd, buf, sizeof(buf), 0);
+                if(r > 0) {
+                    send_all(fd, buf, r);
+                } else if(r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    close(fd);
+                }
+                continue;
+            }
+            struct conn *c = conns + data;
+            const ssize_t r = recv(c->fd, buf, opts.size - c->got, 0);
+            if(r == 0 || (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                fprintf(stderr, "proxy closed a relayed connection\n");
+                return 1;
+            }
+            if(r > 0 && (c->got += r) == opts.size) {
+                c->got = 0;
+                rounds++;
+                send_all(c->fd, msg, opts.size);
+            }
+        }
+        t = now();
+    }
+    const double elapsed = t - start;
+
+    printf("connections      %u\n", opts.conns);
+    printf("message size     %zu\n", opts.size);
+    printf("round trips/s    %.0f\n", rounds / elapsed);
+    printf("proxy reads/s    %.0f\n", 2 * rounds / elapsed);
+
+    for(unsigned i = 0; i < opts.conns; i++) {
+        close(conns[i].fd);
+    }
+    free(conns);
+    close(ep);
+    close(server);
+    return 0;
+}
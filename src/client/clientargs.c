@@ -138,12 +138,18 @@ usage(const char *progname) {
         "-b                  imprime la cantidad de bytes transferidos del server.\n"
         "-a                  imprime una lista con los usuarios del proxy.\n"
         "-A                  imprime una lista con los usuarios administradores.\n"
+        "-q                  imprime la cantidad de resoluciones DNS encoladas en el server.\n"
+        "-w                  imprime la espera promedio (en microsegundos) de las resoluciones DNS encoladas.\n"
+        "-s                  imprime la cantidad de estados de conexión en uso en el server.\n"
+        "-S                  imprime la cantidad de estados de conexión reservados en el server.\n"
+        "-i                  imprime la cantidad de vueltas de los selectores del server.\n"
         "-n                  enciende el password disector en el server.\n"
         "-N                  apaga el password disector en el server.\n"
         "-u <user:pass>      agrega un usuario del proxy con el nombre y contraseña indicados.\n"
         "-U <user:token>     agrega un usuario administrador con el nombre y token indicados.\n"
         "-d <user>           borra el usuario del proxy con el nombre indicado.\n"
         "-D <user>           borra el usuario administrador con el nombre indicado.\n"
+        "-r                  recarga el archivo de usuarios del proxy en el server.\n"
         "-v                  imprime la versión del programa y termina.\n"
         "\n",
         progname);
@@ -171,7 +177,7 @@ parse_args(const int argc, char **argv, struct client_request_args *args, char *
     *ip_version = ipv4;
 
     for(req_idx = 0 ; req_idx < MAX_CLIENT_REQUESTS ; req_idx++){
-        int c = getopt(argc, argv, ":hcCbaAnNu:U:d:D:hv");
+        int c = getopt(argc, argv, ":hcCbaAqwsSinNu:U:d:D:rhv");
         if (c == -1){
             break;
         }
@@ -208,6 +214,31 @@ parse_args(const int argc, char **argv, struct client_request_args *args, char *
                 args[req_idx].target.get_target = admin_users_list;
                 // TODO: Show list of admin users
                 break;
+            case 'q':
+                // Get DNS resolutions waiting in queue
+                set_get_data(&args[req_idx]);
+                args[req_idx].target.get_target = dns_queue_depth;
+                break;
+            case 'w':
+                // Get average DNS queue wait
+                set_get_data(&args[req_idx]);
+                args[req_idx].target.get_target = dns_queue_wait;
+                break;
+            case 's':
+                // Get connection states in use
+                set_get_data(&args[req_idx]);
+                args[req_idx].target.get_target = connection_slots_used;
+                break;
+            case 'S':
+                // Get connection states allocated
+                set_get_data(&args[req_idx]);
+                args[req_idx].target.get_target = connection_slots_allocated;
+                break;
+            case 'i':
+                // Get selector iterations
+                set_get_data(&args[req_idx]);
+                args[req_idx].target.get_target = selector_iterations;
+                break;
             case 'n':
                 // Turns on password disector
                 args[req_idx].method = config;
@@ -246,6 +277,13 @@ parse_args(const int argc, char **argv, struct client_request_args *args, char *
                 args[req_idx].target.config_target = del_admin_user;
                 args[req_idx].dlen = string_check(optarg, args[req_idx].data.user, "username", USERNAME_SIZE, argv[0]);
                 break;
+            case 'r':
+                // Reloads the proxy users file
+                args[req_idx].method = config;
+                args[req_idx].target.config_target = reload_users;
+                args[req_idx].dlen = 1;
+                args[req_idx].data.optional_data = 0;
+                break;
             case 'v':
                 // Prints program version
                 version();
@@ -67,5 +67,8 @@ serialize_config_data(struct client_request_args *args, char *buffer){
         case del_admin_user:
             memcpy(FIELD_DATA(buffer), args->data.user, args->dlen);
             break;
+        case reload_users:
+            memcpy(FIELD_DATA(buffer), &args->data.optional_data, sizeof(uint8_t));
+            break;
     }
 }
@@ -8,12 +8,27 @@ void handle_get_ok_status(struct client_request_args arg, uint8_t *buf, uint8_t
         case historic_connections:      // recibe uint32 (4 bytes)
         case concurrent_connections:    // recibe uint32 (4 bytes)
         case transferred_bytes:         // recibe uint32 (4 bytes)
+        case dns_queue_depth:           // recibe uint32 (4 bytes)
+        case dns_queue_wait:            // recibe uint32 (4 bytes)
+        case connection_slots_used:     // recibe uint32 (4 bytes)
+        case connection_slots_allocated: // recibe uint32 (4 bytes)
+        case selector_iterations:       // recibe uint32 (4 bytes)
             for (int k = 0, j = 3; k < 4; k++) {
                 numeric_data_array[k] = buf[j++];
             }
             *numeric_response = ntohl(*(uint32_t*)numeric_data_array);
             if(arg.target.get_target == historic_connections) {
                 printf("The amount of historic connections is: %u\n", *numeric_response);
+            } else if(arg.target.get_target == dns_queue_depth) {
+                printf("The amount of queued DNS resolutions is: %u\n", *numeric_response);
+            } else if(arg.target.get_target == dns_queue_wait) {
+                printf("The average DNS queue wait is: %u us\n", *numeric_response);
+            } else if(arg.target.get_target == connection_slots_used) {
+                printf("The amount of connection states in use is: %u\n", *numeric_response);
+            } else if(arg.target.get_target == connection_slots_allocated) {
+                printf("The amount of allocated connection states is: %u\n", *numeric_response);
+            } else if(arg.target.get_target == selector_iterations) {
+                printf("The amount of selector iterations is: %u\n", *numeric_response);
             } else {
                 printf("The amount of %s is: %u\n",  arg.target.get_target == concurrent_connections ? "concurrent connections" : "transferred bytes", *numeric_response);
             }
@@ -52,6 +67,9 @@ void handle_config_ok_status(struct client_request_args arg) {
         case del_admin_user:
             printf("The admin: '%s' is now deleted in the server\n", arg.data.add_proxy_user_params.user);
             break;
+        case reload_users:
+            printf("The proxy users file is being reloaded in the server\n");
+            break;
     }      
 }
 
@@ -83,6 +101,9 @@ void handle_error_response (struct client_request_args *args, enum monitor_resp_
                 case del_admin_user:
                     printf("Error deleting the admin, admin name should be alphanumeric, admin does not exist or is default admin!\n");
                     break;
+                case reload_users:
+                    printf("Error reloading the proxy users, the server has no users file!\n");
+                    break;
                 default:
                     printf("The data of the request you have sent is incorrect!\n");
                     break;
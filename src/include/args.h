@@ -3,6 +3,12 @@
 
 #include <stdbool.h>
 
+#include "selector.h"
+#include "resolver.h"
+#include "dnscache.h"
+#include "bufpool.h"
+#include "socks5nio.h"
+
 #define DEFAULT_SOCKS_ADDR          "0.0.0.0"
 #define DEFAULT_SOCKS_ADDR_V6       "::0"
 #define DEFAULT_SOCKS_PORT          1080
@@ -12,8 +18,31 @@
 #define DEFAULT_CONF_PORT           8080
 
 #define DEFAULT_DISECTORS_ENABLED   true
+#define DEFAULT_SPLICE_ENABLED      true
+#define DEFAULT_DNS_NATIVE          true
+
+#define DEFAULT_SELECTOR_BACKEND    SELECTOR_BACKEND_EPOLL
+
+#define DEFAULT_WORKERS             1
+#define MAX_WORKERS                 64
+
+#define MAX_RESOLVER_THREADS        256
+#define MAX_RESOLVER_QUEUE          65536
+
+#define MAX_DNS_TTL                 86400
 
-#define MAX_USERS           10
+#define DEFAULT_MAX_CONNECTIONS     16384
+#define DEFAULT_PREALLOC_CONNECTIONS 256
+#define MAX_CONNECTIONS             1048576
+
+#define MAX_ACCEPT_BATCH            4096
+
+#define DEFAULT_DEFER_ACCEPT        10
+
+#define MAX_TIMEOUT                 86400
+
+/** usuarios que se pueden pasar con -u */
+#define MAX_ARGS_USERS      10
 
 struct users {
     char            *name;
@@ -30,8 +59,28 @@ struct socks5args {
     unsigned short  mng_port;
 
     bool            disectors_enabled;
+    bool            splice_enabled;
+
+    selector_backend selector_backend;
+    unsigned        workers;
+    unsigned        resolver_threads;
+    unsigned        resolver_queue;
+    unsigned        dns_ttl;
+    unsigned        dns_negative_ttl;
+    bool            dns_native;
+    unsigned        relay_buffer_min;
+    unsigned        relay_buffer_max;
+    unsigned        max_connections;
+    unsigned        prealloc_connections;
+    unsigned        accept_batch;
+    unsigned        defer_accept;
+    struct socks5_timeouts timeouts;
+    /** archivo de usuarios del proxy, NULL si no hay */
+    const char     *users_file;
+    /** socket Unix del verificador externo de credenciales, NULL si no hay */
+    const char     *auth_verifier;
 
-    struct users    users[MAX_USERS];
+    struct users    users[MAX_ARGS_USERS];
 };
 
 /**
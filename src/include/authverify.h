@@ -0,0 +1,111 @@
+#ifndef AUTHVERIFY_H_Vt3Kq8Rm1XwP6zLc9NbJ4sYe
+#define AUTHVERIFY_H_Vt3Kq8Rm1XwP6zLc9NbJ4sYe
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "selector.h"
+
+/**
+ * authverify.c - verificación de credenciales en un proceso externo
+ *
+ * Las credenciales RFC 1929 que no están entre los usuarios locales se
+ * consultan a un verificador que escucha en un socket Unix (SOCK_STREAM).
+ * Cada selector tiene su propia conexión al verificador, registrada en él:
+ * las respuestas se procesan en el mismo hilo que atiende las conexiones y
+ * un verificador lento no bloquea a nadie.
+ *
+ * Los pedidos se encolan en un buffer que se manda cuando el socket se puede
+ * escribir, así que los de una misma vuelta del selector salen juntos y sin
+ * esperar las respuestas de los anteriores. Protocolo, con enteros en orden
+ * de red:
+ *
+ *   pedido:    ID (4) | ULEN (1) | UNAME | PLEN (1) | PASSWD
+ *   respuesta: ID (4) | STATUS (1)
+ *
+ * STATUS X'00' acepta las credenciales y cualquier otro valor las rechaza.
+ * Las respuestas pueden llegar en cualquier orden.
+ *
+ * Delante del verificador hay un cache por selector de los últimos
+ * resultados. Si el verificador no está o se cae, los pedidos en curso se
+ * rechazan, el cache se descarta (el verificador que vuelva puede tener otras
+ * credenciales) y se vuelve a conectar con un pedido posterior.
+ */
+
+/** segundos que se recuerda una respuesta positiva y una negativa */
+#define AUTHVERIFY_CACHE_TTL            30
+#define AUTHVERIFY_CACHE_NEGATIVE_TTL   5
+
+/** avisa a la conexión que llegó la respuesta del verificador */
+typedef void (*authverify_callback)(struct selector_key *key);
+
+/**
+ * espera de una conexión por la respuesta del verificador. Se embebe en el
+ * estado de la conexión, que debe seguir vivo hasta la respuesta o hasta
+ * authverify_cancel().
+ */
+struct authverify_waiter {
+    /** a quien notificar cuando llega la respuesta */
+    fd_selector                s;
+    int                        fd;
+    void                      *data;
+    authverify_callback        on_verified;
+
+    uint32_t                   id;
+    /** el pedido está en curso */
+    bool                       pending;
+    /** llegó la respuesta (o se dio por rechazado) */
+    bool                       done;
+    bool                       granted;
+
+    /** las credenciales, para guardar el resultado en el cache */
+    const char                *uname;
+    const char                *passwd;
+    uint8_t                    ulen;
+    uint8_t                    plen;
+
+    struct authverify_waiter  *next;
+};
+
+enum authverify_status {
+    /** el resultado ya está disponible (del cache o por error) */
+    authverify_done,
+    /** se notificará a la llave cuando esté disponible */
+    authverify_pending,
+};
+
+/**
+ * configura el socket del verificador. Con NULL (o sin llamarla) no se
+ * verifican credenciales externamente.
+ */
+void
+authverify_init(const char *path);
+
+/** si hay un verificador configurado */
+bool
+authverify_enabled(void);
+
+/**
+ * consulta las credenciales desde la conexión al verificador del selector de
+ * `key' (que debe ser el del hilo que llama). `uname' y `passwd' deben
+ * seguir siendo válidos mientras el pedido esté en curso.
+ *
+ * Con authverify_done el resultado queda en `w->granted'; con
+ * authverify_pending se invocará `on_verified' con `key' al llegar la
+ * respuesta, nunca antes de que authverify_check() retorne.
+ */
+enum authverify_status
+authverify_check(struct authverify_waiter *w,
+                 const char *uname, uint8_t ulen,
+                 const char *passwd, uint8_t plen,
+                 const struct selector_key *key, authverify_callback on_verified);
+
+/** si el pedido por el que espera `w' ya tiene resultado */
+bool
+authverify_ready(const struct authverify_waiter *w);
+
+/** deja de esperar la respuesta, si el pedido estaba en curso */
+void
+authverify_cancel(struct authverify_waiter *w);
+
+#endif
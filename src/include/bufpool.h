@@ -0,0 +1,66 @@
+#ifndef BUFPOOL_H_m3Vq8LxT1cRw6Ks0Np4YhZe9
+#define BUFPOOL_H_m3Vq8LxT1cRw6Ks0Np4YhZe9
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * bufpool.c - pool compartido de bloques para los buffers del COPY
+ *
+ * Los bloques tienen tamaños potencia de 2 entre un mínimo y un máximo
+ * configurables. Cada tamaño tiene su propia lista de bloques libres, que se
+ * reutilizan entre conexiones (y entre workers) en lugar de volver a
+ * pedirlos al heap. Cada lista retiene a lo sumo BUFPOOL_CACHED_BYTES, y
+ * además cada hilo guarda unos pocos bloques propios para no tomar el mutex
+ * en cada pedido.
+ */
+
+#define DEFAULT_RELAY_BUFFER_MIN    (4 * 1024)
+#define DEFAULT_RELAY_BUFFER_MAX    (256 * 1024)
+/** límites aceptados para los tamaños configurables */
+#define RELAY_BUFFER_MIN_LIMIT      1024
+#define RELAY_BUFFER_MAX_LIMIT      (4 * 1024 * 1024)
+
+/** memoria libre que retiene cada tamaño de bloque */
+#define BUFPOOL_CACHED_BYTES        (4 * 1024 * 1024)
+/** memoria libre que retiene cada hilo por tamaño de bloque (al menos uno) */
+#define BUFPOOL_THREAD_CACHED_BYTES (256 * 1024)
+
+/**
+ * configura los tamaños mínimo y máximo de bloque (potencias de 2, con
+ * min <= max). Debe llamarse antes de usar el pool.
+ */
+void
+bufpool_init(size_t min, size_t max);
+
+/**
+ * libera los bloques retenidos. Los hilos que usaron el pool deben haber
+ * llamado antes a bufpool_thread_flush().
+ */
+void
+bufpool_destroy(void);
+
+/** devuelve a las listas compartidas los bloques propios del hilo que llama */
+void
+bufpool_thread_flush(void);
+
+/** tamaño mínimo de bloque */
+size_t
+bufpool_min(void);
+
+/** tamaño máximo de bloque */
+size_t
+bufpool_max(void);
+
+/**
+ * obtiene un bloque de `size' bytes (potencia de 2 entre el mínimo y el
+ * máximo). Retorna NULL si no hay memoria.
+ */
+uint8_t *
+bufpool_get(size_t size);
+
+/** devuelve un bloque obtenido con bufpool_get() del mismo tamaño */
+void
+bufpool_put(uint8_t *block, size_t size);
+
+#endif
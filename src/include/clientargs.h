@@ -28,7 +28,12 @@ enum get_target {
     concurrent_connections  = 1,
     transferred_bytes       = 2,
     proxy_users_list        = 3,
-    admin_users_list        = 4
+    admin_users_list        = 4,
+    dns_queue_depth         = 5,
+    dns_queue_wait          = 6,
+    connection_slots_used   = 7,
+    connection_slots_allocated = 8,
+    selector_iterations     = 9
 };
 
 enum config_target {
@@ -36,7 +41,8 @@ enum config_target {
     add_proxy_user      = 1,
     del_proxy_user      = 2,
     add_admin_user      = 3,
-    del_admin_user      = 4
+    del_admin_user      = 4,
+    reload_users        = 5
 };
 
 union target {
@@ -45,12 +45,12 @@ extern void
 disector_parser_reset(struct disector_parser *p);
 
 /**
- * por cada elemento del buffer llama a "disector_parser_feed" hasta que
+ * entrega al parser los n bytes a partir de la direccion ptr dada, hasta que
  * el parseo se encuentra completo o se requieren mas bytes.
- * Lee hasta n bytes a partir de la direccion ptr dada.
- * 
- * param errored parametro de salida. si es diferente de NULL se deja dicho valor
- * si el parsing se debio a una condicion de error
+ * Mientras se espera USER saltea de a bloques los bytes que no pueden
+ * empezarlo, y los argumentos de USER y PASS se copian de a lineas; el resto
+ * se procesa byte a byte. Los nombres y passwords mas largos que los campos
+ * de struct disector se truncan.
  */
 enum disector_state
 disector_consume(struct disector_parser *p, uint8_t *ptr, size_t n);
@@ -0,0 +1,93 @@
+#ifndef DNS_H_Zq4Tn7Lw2YbR9xVe1KsMc6Hd
+#define DNS_H_Zq4Tn7Lw2YbR9xVe1KsMc6Hd
+
+#include <stdint.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "selector.h"
+
+/**
+ * dns.c - resolver DNS stub no bloqueante
+ *
+ * Consulta los registros A y AAAA de un nombre directamente a los
+ * nameservers de /etc/resolv.conf, por UDP y, si la respuesta llega truncada,
+ * por TCP. Cada ronda de envíos usa un socket UDP nuevo, con un puerto de
+ * origen al azar. Cada selector tiene su propio cliente cuyos sockets se
+ * registran en él, de forma que las respuestas se procesan en el mismo hilo que
+ * atiende las conexiones: no hay un hilo bloqueado por consulta ni señales
+ * para avisar que terminó.
+ *
+ * No implementa los dominios de búsqueda de resolv.conf: los nombres sin
+ * puntos que no estén en /etc/hosts se dejan para getaddrinfo().
+ */
+
+#define DNS_RESOLV_CONF     "/etc/resolv.conf"
+#define DNS_HOSTS           "/etc/hosts"
+
+/** direcciones que se guardan por nombre */
+#define DNS_MAX_ADDRS       8
+
+/**
+ * direcciones de un nombre, listas para connect(): primero las IPv6 y luego
+ * las IPv4, o en el orden de getaddrinfo(). No usa memoria dinámica, así que
+ * se embebe en quien la guarda y se copia por valor.
+ */
+struct dns_result {
+    unsigned n;
+    struct dns_result_addr {
+        socklen_t len;
+        union {
+            struct sockaddr     sa;
+            struct sockaddr_in  in;
+            struct sockaddr_in6 in6;
+        } u;
+    } addrs[DNS_MAX_ADDRS];
+};
+
+/**
+ * resultado de una consulta, invocado desde el selector `s'.
+ *
+ * `err' es 0, EAI_NONAME si el nombre no existe o no tiene direcciones, o
+ * EAI_AGAIN si los nameservers no respondieron. Ante éxito `res' tiene al
+ * menos una dirección y es válido solo durante el callback; `ttl' es el menor
+ * TTL de los registros de la respuesta.
+ */
+typedef void (*dns_callback)(fd_selector s, void *data, int err,
+                             const struct dns_result *res, unsigned ttl);
+
+/**
+ * lee la configuración de resolv.conf y hosts. Debe llamarse antes de
+ * instanciar los workers.
+ *
+ * @return la cantidad de nameservers configurados; con 0 no se puede
+ *         resolver con dns_lookup().
+ */
+unsigned
+dns_init(void);
+
+/** libera la configuración leída por dns_init() */
+void
+dns_destroy(void);
+
+/**
+ * busca `name' en /etc/hosts.
+ *
+ * @return 0 y el resultado en `res' si el nombre está, -1 si no.
+ */
+int
+dns_hosts_lookup(const char *name, uint16_t port, struct dns_result *res);
+
+/**
+ * consulta `name' a los nameservers desde el cliente del selector `s' (que
+ * debe ser el del hilo que llama). `cb' se invoca una única vez, nunca antes
+ * de que dns_lookup() retorne.
+ *
+ * @return 0 si la consulta quedó en curso, -1 si el nombre no se puede
+ *         resolver de esta forma.
+ */
+int
+dns_lookup(fd_selector s, const char *name, uint16_t port,
+           dns_callback cb, void *data);
+
+#endif
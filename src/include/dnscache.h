@@ -0,0 +1,106 @@
+#ifndef DNSCACHE_H_p8Rw3Kc1LzX6vNq0YtJm5sEa
+#define DNSCACHE_H_p8Rw3Kc1LzX6vNq0YtJm5sEa
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <netdb.h>
+
+#include "selector.h"
+#include "dns.h"
+
+/**
+ * dnscache.c - cache de resoluciones de nombres
+ *
+ * Guarda las direcciones de cada nombre y puerto durante un TTL configurable,
+ * copiadas en la propia entrada (hasta DNS_MAX_ADDRS). Los nombres
+ * inexistentes (EAI_NONAME) también se guardan, con un TTL propio (cache
+ * negativo). Las entradas descartadas se reusan, así que en régimen resolver
+ * un nombre no aloca memoria desde el selector.
+ *
+ * Si llegan varios pedidos por un nombre que se está resolviendo, se
+ * encolan como espera de esa única resolución.
+ *
+ * Con el resolver nativo (dns.c) los nombres de /etc/hosts se resuelven en
+ * el acto y el resto se consulta desde el selector de quien lo pidió; al
+ * llegar la respuesta se invoca directamente el callback de las esperas de
+ * ese mismo selector. Las esperas de otros selectores, y las resoluciones que
+ * se ejecutan en el pool de resolver.c con getaddrinfo(), se notifican con
+ * selector_notify_block().
+ */
+
+#define DEFAULT_DNSCACHE_TTL            60
+#define DEFAULT_DNSCACHE_NEGATIVE_TTL   5
+/** cantidad máxima de nombres guardados */
+#define DNSCACHE_MAX_ENTRIES            4096
+
+struct dnscache_entry;
+
+/** avisa a la conexión que su resolución terminó */
+typedef void (*dnscache_callback)(struct selector_key *key);
+
+/**
+ * espera de una conexión por una resolución. Se embebe en el estado de la
+ * conexión y referencia la entrada del cache mientras se use el resultado.
+ */
+struct dnscache_waiter {
+    /** a quien notificar cuando la resolución termina */
+    fd_selector             s;
+    int                     fd;
+    void                   *data;
+    dnscache_callback       on_resolved;
+
+    struct dnscache_entry  *entry;
+    struct dnscache_waiter *next;
+};
+
+enum dnscache_status {
+    /** el resultado ya está disponible */
+    dnscache_hit,
+    /** se notificará a la llave cuando esté disponible */
+    dnscache_pending,
+    /** no se pudo encolar la resolución */
+    dnscache_error,
+};
+
+/**
+ * configura los TTL (en segundos) del cache y si las resoluciones usan el
+ * resolver nativo (ver dns_init()) o getaddrinfo().
+ */
+void
+dnscache_init(unsigned ttl, unsigned negative_ttl, bool native);
+
+/** libera todas las entradas. Debe llamarse con el pool de resolvers detenido */
+void
+dnscache_destroy(void);
+
+/**
+ * busca `name':`port' (puerto en orden de host) en el cache. Si no está, encola su resolución (o se
+ * suma a la que esté en curso) y al terminar invocará `on_resolved' con `key'
+ * (o con selector_notify_block() desde otro hilo llegará al handle_block).
+ *
+ * Salvo en caso de error, `w' queda referenciando la entrada hasta que se
+ * llame a dnscache_release().
+ */
+enum dnscache_status
+dnscache_resolve(struct dnscache_waiter *w, const char *name, uint16_t port,
+                 const struct selector_key *key, dnscache_callback on_resolved);
+
+/**
+ * resultado de la resolución, o NULL si el nombre no se pudo resolver.
+ * Solo válido luego de un hit o de la notificación, y hasta dnscache_release().
+ */
+const struct dns_result *
+dnscache_result(const struct dnscache_waiter *w);
+
+/**
+ * si la resolución por la que espera `w' ya terminó. Permite descartar una
+ * notificación dirigida a una espera anterior que usaba el mismo fd.
+ */
+bool
+dnscache_ready(const struct dnscache_waiter *w);
+
+/** libera la referencia a la entrada, si la hubiera */
+void
+dnscache_release(struct dnscache_waiter *w);
+
+#endif
@@ -35,12 +35,18 @@ GET
     X'02'  cantidad de bytes transferidos
     X'03'  listado de usuarios del proxy
     X'04'  listado de administradores
+    X'05'  cantidad de resoluciones DNS esperando un hilo libre
+    X'06'  espera promedio (en microsegundos) de las resoluciones DNS en la cola
+    X'07'  cantidad de estados de conexión en uso
+    X'08'  cantidad de estados de conexión reservados
+    X'09'  cantidad de vueltas de los selectores de los workers
 CONFIG
     X'00'  ON/OFF password disector POP3
     X'01'  agregar usuario del proxy
     X'02'  borrar usuarios del proxy
     X'03'  agregar usuario admin
     X'04'  borrar usuarios admin
+    X'05'  recargar el archivo de usuarios del proxy
 
 DLEN: cantidad de bytes presentes en la sección DATA. Para el método GET, este campo DEBERÍA ser X'01' .
 
@@ -59,6 +65,9 @@ DATA:
             <usuario>X'00'<token>
         Borrar usuario admin
             <usuario>
+        Recargar archivo de usuarios
+            X'00' (no se lee). La recarga termina después de la respuesta; si
+            el servidor no tiene archivo de usuarios se responde X'04'.
 */
 
 enum monitor_state {            
@@ -104,6 +113,11 @@ enum monitor_target_get {
     monitor_target_get_transfered = 0x02,
     monitor_target_get_proxyusers = 0x03,
     monitor_target_get_adminusers = 0x04,
+    monitor_target_get_dns_queue  = 0x05,
+    monitor_target_get_dns_wait   = 0x06,
+    monitor_target_get_slots_used = 0x07,
+    monitor_target_get_slots_allocated = 0x08,
+    monitor_target_get_iterations = 0x09,
 };
 
 enum monitor_target_config {
@@ -112,6 +126,7 @@ enum monitor_target_config {
     monitor_target_config_delete_proxyuser  = 0x02,
     monitor_target_config_add_admin         = 0x03,
     monitor_target_config_delete_admin      = 0x04,
+    monitor_target_config_reload_users      = 0x05,
 };
 
 
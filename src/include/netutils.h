@@ -2,6 +2,7 @@
 #define NETUTILS_H_CTCyWGhkVt1pazNytqIRptmAi5U
 
 #include <netinet/in.h>
+#include <sys/socket.h>
 
 #include "buffer.h"
 
@@ -23,6 +24,15 @@ sockaddr_to_human(char *buff, const size_t buffsize,
 
 
 
+/**
+ * acepta una conexión del socket pasivo `fd' con accept4(2), ya no
+ * bloqueante y con close-on-exec, sin llamadas extra a fcntl(2).
+ *
+ * Retorna el fd aceptado o -1 dejando detalles en errno.
+ */
+int
+accept_nio(const int fd, struct sockaddr *addr, socklen_t *addr_len);
+
 /**
  * Escribe n bytes de buff en fd de forma bloqueante
  *
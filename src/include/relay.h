@@ -0,0 +1,71 @@
+#ifndef RELAY_H_Q3mZ8vXo1fKp7tLw2cNs9bYr4
+#define RELAY_H_Q3mZ8vXo1fKp7tLw2cNs9bYr4
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * relay.c - copia entre sockets sin pasar por espacio de usuario
+ *
+ * Los bytes se mueven de un socket a un pipe y del pipe al otro socket
+ * utilizando splice(2). El pipe cumple el rol del buffer intermedio, por lo
+ * que se lleva la cuenta de cuántos bytes quedan en él por enviar.
+ */
+struct relay_pipe {
+    /** extremos del pipe ([0] lectura, [1] escritura), -1 si no está abierto */
+    int    fds[2];
+    /** bytes dentro del pipe que todavía no se enviaron */
+    size_t len;
+    /** capacidad del pipe */
+    size_t size;
+};
+
+/** inicializa el pipe como cerrado */
+void
+relay_pipe_init(struct relay_pipe *p);
+
+/**
+ * abre el pipe (no bloqueante). Retorna 0 si se pudo abrir o ya estaba
+ * abierto, -1 en caso de error (ej: se agotaron los descriptores).
+ */
+int
+relay_pipe_open(struct relay_pipe *p);
+
+/** cierra el pipe, descartando los bytes que pudiera tener */
+void
+relay_pipe_close(struct relay_pipe *p);
+
+static inline bool
+relay_pipe_is_open(const struct relay_pipe *p) {
+    return p->fds[0] != -1;
+}
+
+/** hay espacio en el pipe para leer más bytes del socket */
+static inline bool
+relay_pipe_can_fill(const struct relay_pipe *p) {
+    return relay_pipe_is_open(p) && p->len < p->size;
+}
+
+/** hay bytes en el pipe para enviar al socket */
+static inline bool
+relay_pipe_can_drain(const struct relay_pipe *p) {
+    return p->len > 0;
+}
+
+/**
+ * mueve bytes disponibles en el socket `fd' al pipe. Mismos retornos que
+ * recv(2): 0 si el otro extremo cerró y -1 con errno ante un error
+ * (EAGAIN si no había nada para leer).
+ */
+ssize_t
+relay_pipe_fill(struct relay_pipe *p, int fd);
+
+/**
+ * mueve bytes del pipe al socket `fd'. Mismos retornos que send(2).
+ * splice(2) no admite MSG_NOSIGNAL: quien lo use debe ignorar SIGPIPE.
+ */
+ssize_t
+relay_pipe_drain(struct relay_pipe *p, int fd);
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef RESOLVER_H_Vb7nK2qXe9LmP4sTz1wRy6cHd
+#define RESOLVER_H_Vb7nK2qXe9LmP4sTz1wRy6cHd
+
+#include <stdint.h>
+
+/**
+ * resolver.c - pool acotado de hilos para resoluciones de nombres
+ *
+ * Las resoluciones (getaddrinfo) son bloqueantes, así que se ejecutan en un
+ * conjunto fijo de hilos que toman trabajos de una cola de tamaño acotado.
+ * Cada tarea es responsable de avisar a quien la espera al terminar, en
+ * general con selector_notify_block().
+ */
+
+#define DEFAULT_RESOLVER_THREADS    8
+#define DEFAULT_RESOLVER_QUEUE      256
+
+/** tarea bloqueante a ejecutar en un hilo del pool */
+typedef void (*resolver_task)(void *data);
+
+/** crea los hilos del pool. Retorna 0 si pudo, -1 en caso contrario */
+int
+resolver_init(unsigned threads, unsigned queue_size);
+
+/**
+ * detiene el pool: descarta los trabajos encolados y espera a los que se
+ * están ejecutando. Debe llamarse antes de destruir los selectores.
+ */
+void
+resolver_destroy(void);
+
+/**
+ * encola `task' para ser ejecutada con `data'. Retorna 0 si se encoló o -1
+ * si la cola está llena.
+ */
+int
+resolver_submit(resolver_task task, void *data);
+
+/** cantidad de trabajos esperando un hilo libre */
+uint32_t
+resolver_queue_depth(void);
+
+/** tiempo promedio (en microsegundos) que esperaron los trabajos en la cola */
+uint32_t
+resolver_wait_time(void);
+
+#endif
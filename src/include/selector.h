@@ -28,8 +28,10 @@
  * la iteración normal. Los handlers no se tienen que preocupar por la
  * concurrencia.
  *
- * Dicha señalización se realiza mediante señales, y es por eso que al
- * iniciar la librería `selector_init' se debe configurar una señal a utilizar.
+ * Dicha señalización se realiza mediante un eventfd(2) que cada selector
+ * registra como un descriptor más: el hilo que notifica lo escribe y el
+ * selector se despierta. Varias notificaciones seguidas comparten un único
+ * despertar.
  *
  * Todos métodos retornan su estado (éxito / error) de forma uniforme.
  * Puede utilizar `selector_error' para obtener una representación human
@@ -65,13 +67,29 @@ typedef enum {
 const char *
 selector_error(const selector_status status);
 
+/**
+ * implementación del multiplexor a utilizar.
+ *
+ * pselect(2) está limitado a FD_SETSIZE descriptores y su costo por
+ * iteración depende del fd máximo registrado; epoll(7) no tiene dicho límite
+ * y su costo depende de la cantidad de descriptores listos.
+ */
+typedef enum {
+    SELECTOR_BACKEND_SELECT = 0,
+    SELECTOR_BACKEND_EPOLL  = 1,
+} selector_backend;
+
+/** retorna una descripción humana del backend */
+const char *
+selector_backend_name(const selector_backend backend);
+
 /** opciones de inicialización del selector */
 struct selector_init {
-    /** señal a utilizar para notificaciones internas */
-    const int signal;
-
     /** tiempo máximo de bloqueo durante `selector_iteratate' */
     struct timespec select_timeout;
+
+    /** multiplexor utilizado por los selectores que se instancien */
+    selector_backend backend;
 };
 
 /** inicializa la librería */
@@ -129,6 +147,9 @@ typedef struct fd_handler {
   void (*handle_write)     (struct selector_key *key);
   void (*handle_block)     (struct selector_key *key);
 
+  /** llamado cuando vence el timeout programado con selector_set_timeout */
+  void (*handle_timeout)   (struct selector_key *key);
+
   /**
    * llamado cuando se se desregistra el fd
    * Seguramente deba liberar los recusos alocados en data.
@@ -170,6 +191,25 @@ selector_set_interest(fd_selector s, int fd, fd_interest i);
 selector_status
 selector_set_interest_key(struct selector_key *key, fd_interest i);
 
+/**
+ * reemplaza el handler y el adjunto de un fd ya registrado, sin tocar sus
+ * intereses ni su timeout. No llama al handle_close del handler anterior.
+ */
+selector_status
+selector_set_handler(fd_selector s, int fd, const fd_handler *handler, void *data);
+
+
+/**
+ * programa que dentro de `ms' milisegundos se invoque el handle_timeout del
+ * fd. Reemplaza al timeout previo que tuviera; con `ms' en 0 lo cancela.
+ * El timeout se dispara una única vez y se cancela al desregistrar el fd.
+ *
+ * Los plazos se cuentan desde que el selector despertó en la iteración
+ * actual y se redondean hacia arriba a ticks de 10ms. Programar, reprogramar
+ * y cancelar cuestan O(1), por lo que puede hacerse con cada evento.
+ */
+selector_status
+selector_set_timeout(fd_selector s, int fd, unsigned ms);
 
 /**
  * se bloquea hasta que hay eventos disponible y los despacha.
@@ -186,6 +226,14 @@ selector_select(fd_selector s);
 int
 selector_fd_set_nio(const int fd);
 
+/**
+ * despierta al selector si está bloqueado esperando eventos, para que
+ * despache las notificaciones pendientes y revise su estado. Puede llamarse
+ * desde cualquier hilo.
+ */
+selector_status
+selector_wakeup(fd_selector s);
+
 /** notifica que un trabajo bloqueante terminó */
 selector_status
 selector_notify_block(fd_selector s,
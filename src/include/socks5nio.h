@@ -4,30 +4,96 @@
 #include <netdb.h>
 #include "selector.h"
 
-#define MAX_USERS 10
+#define MAX_WORKERS 64
 
-/** handler del socket pasivo que atiende conexiones socksv5 */
+/** plazos por defecto (segundos) de cada etapa de una conexión */
+#define DEFAULT_HELLO_TIMEOUT   10
+#define DEFAULT_AUTH_TIMEOUT    10
+#define DEFAULT_REQUEST_TIMEOUT 10
+#define DEFAULT_RESOLVE_TIMEOUT 10
+#define DEFAULT_CONNECT_TIMEOUT 10
+#define DEFAULT_IDLE_TIMEOUT    600
+
+/**
+ * segundos que una conexión puede permanecer en cada etapa, 0 si no tiene
+ * límite. Vencido el plazo se cierra la conexión; durante el request se
+ * responde antes "TTL expired".
+ */
+struct socks5_timeouts {
+    /** hasta recibir cada mensaje del handshake y mandar su respuesta */
+    unsigned hello;
+    unsigned auth;
+    unsigned request;
+    /** resolución del nombre pedido */
+    unsigned resolve;
+    /** conexión con el origin */
+    unsigned connect;
+    /** túnel sin tráfico en ningún sentido */
+    unsigned idle;
+};
+
+/** conexiones que se aceptan como máximo por cada evento del socket pasivo */
+#define DEFAULT_ACCEPT_BATCH    64
+
+/**
+ * handler del socket pasivo que atiende conexiones socksv5. Acepta hasta
+ * vaciar la cola o hasta el batch configurado, y deja de aceptar (sin
+ * interés de lectura) mientras el worker está en su tope de conexiones o
+ * sin descriptores ni memoria.
+ */
 void socksv5_passive_accept(struct selector_key *key);
 
-/** especifica la lista de users que pueden usar el servidor proxy
- * retorna 0 si anduvo todo bien
- * retorna -1 si el usuario ya esta registrado
- * retorna 1 si se alcanzo el limite de usuarios
+/**
+ * handle_timeout del socket pasivo: reintenta aceptar luego de que se
+ * pausara por falta de descriptores o memoria.
  */
-int socksv5_register_user(char *uname, char *passwd);
+void socksv5_passive_retry(struct selector_key *key);
 
-int socksv5_unregister_user(char *uname);
+/** configura cuántas conexiones se aceptan por evento del socket pasivo */
+void socksv5_set_accept_batch(unsigned n);
 
 /** prende/apaga el disector de passwords pop3 */
 void socksv5_toggle_disector(bool to);
 
-/** libera pools internos */
+/**
+ * prende/apaga la copia con splice() entre cliente y origin. Aún prendida,
+ * se usa el buffer mientras el disector necesite ver los bytes.
+ */
+void socksv5_toggle_splice(bool to);
+
+/** configura los plazos de las conexiones. Debe llamarse antes de aceptarlas */
+void socksv5_set_timeouts(const struct socks5_timeouts *t);
+
+/**
+ * asocia el hilo que lo invoca al worker `id' (menor a MAX_WORKERS), cuyas
+ * estadisticas se acumulan aparte. Sin invocarla se usa el worker 0.
+ */
+void socksv5_worker_init(unsigned id);
+
+/**
+ * prepara los slabs de structs de conexión de `workers' workers: cada uno
+ * preasigna su parte de `prealloc' y nunca tiene más de su parte de `max'
+ * conexiones a la vez. Debe llamarse antes de aceptar conexiones.
+ *
+ * @return 0 si pudo preasignar, -1 si no hay memoria.
+ */
+int socksv5_pool_init(unsigned workers, unsigned prealloc, unsigned max);
+
+/**
+ * libera los slabs de todos los workers. Debe llamarse cuando ya no corre
+ * ningún worker y se destruyeron sus selectores.
+ */
 void socksv5_pool_destroy(void);
 
 /** consultar estadisticas del servidor */
 uint32_t socksv5_historic_connections();
 uint32_t socksv5_current_connections();
 uint32_t socksv5_bytes_transferred();
-uint16_t socksv5_get_users(char unames[MAX_USERS * 0xff]);
+uint32_t socksv5_slots_used();
+uint32_t socksv5_slots_allocated();
+uint32_t socksv5_selector_iterations();
+
+/** cuenta una vuelta del selector del worker de este hilo */
+void socksv5_selector_iteration(void);
 
 #endif
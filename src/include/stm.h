@@ -54,6 +54,8 @@ struct state_definition {
     unsigned (*on_write_ready)(struct selector_key *key);
     /** ejecutado cuando hay una resolución de nombres lista */
     unsigned (*on_block_ready)(struct selector_key *key);
+    /** ejecutado cuando vence un timeout programado con selector_set_timeout */
+    unsigned (*on_timeout)    (struct selector_key *key);
 };
 
 
@@ -77,6 +79,13 @@ stm_handler_write(struct state_machine *stm, struct selector_key *key);
 unsigned
 stm_handler_block(struct state_machine *stm, struct selector_key *key);
 
+/**
+ * indica que venció un timeout. retorna nuevo id de nuevo estado. Los estados
+ * que no esperan timeouts lo ignoran.
+ */
+unsigned
+stm_handler_timeout(struct state_machine *stm, struct selector_key *key);
+
 /** indica que ocurrió el evento close. retorna nuevo id de nuevo estado. */
 void
 stm_handler_close(struct state_machine *stm, struct selector_key *key);
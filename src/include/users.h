@@ -0,0 +1,90 @@
+#ifndef USERS_H_Hs4Wq9Lb2NcT7xKe0RvMz5Pd
+#define USERS_H_Hs4Wq9Lb2NcT7xKe0RvMz5Pd
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * users.c - usuarios habilitados a usar el proxy
+ *
+ * Los usuarios se guardan en una tabla de hash por nombre, encadenada, que
+ * se duplica cuando tiene en promedio más de un usuario por lista: buscar,
+ * agregar y borrar son O(1) aunque haya decenas de miles. Las contraseñas se
+ * comparan en tiempo constante, y también se compara contra una contraseña
+ * vacía si el usuario no existe, para no revelar cuáles existen.
+ *
+ * Hay dos tablas: la de los usuarios agregados con -u y desde el monitor,
+ * y la de los usuarios de un archivo (--users-file). La del archivo no se
+ * modifica una vez publicada: para recargarla un hilo aparte lee el archivo
+ * en una tabla nueva y después reemplaza el puntero, así que las
+ * autenticaciones solo esperan ese intercambio y no la lectura.
+ *
+ * Las tablas se consultan desde todos los workers y se modifican desde el
+ * monitor, por lo que están protegidas con un rwlock.
+ */
+
+/** longitud máxima de nombres y contraseñas (RFC 1929) */
+#define USERS_MAX_LEN   0xff
+/** cantidad máxima de usuarios */
+#define MAX_USERS       (1 << 20)
+
+/**
+ * agrega un usuario. Los nombres y contraseñas más largos que USERS_MAX_LEN
+ * se truncan.
+ *
+ * @return 0 si se agregó, -1 si el usuario ya existe, 1 si se alcanzó el
+ *         límite de usuarios (o no hay memoria).
+ */
+int
+users_add(const char *uname, const char *passwd);
+
+/**
+ * borra un usuario agregado con -u o desde el monitor. Los del archivo solo
+ * se borran editándolo y recargándolo.
+ *
+ * @return 0 si se borró el usuario, -1 si no existe
+ */
+int
+users_remove(const char *uname);
+
+/** si `uname' existe y su contraseña es `passwd' */
+bool
+users_check(const char *uname, const char *passwd);
+
+/** cantidad de usuarios registrados */
+size_t
+users_count(void);
+
+/**
+ * copia en `buf' los nombres de usuario con formato <usuario>\0<usuario>,
+ * tantos como entren en `size' bytes.
+ *
+ * @return la cantidad de bytes escritos, sin el último \0.
+ */
+size_t
+users_list(char *buf, size_t size);
+
+/**
+ * carga los usuarios de `path', un <usuario>:<contraseña> por línea (las
+ * vacías y las que empiezan con # se ignoran), y arranca el hilo que lo
+ * recarga con users_file_reload(). `path' tiene que seguir siendo válido.
+ *
+ * @return 0 si se pudo leer el archivo, -1 si no.
+ */
+int
+users_file_init(const char *path);
+
+/**
+ * pide recargar el archivo de usuarios; la recarga termina después. Se
+ * puede llamar desde un manejador de señales.
+ *
+ * @return 0 si se pidió, -1 si no hay archivo de usuarios.
+ */
+int
+users_file_reload(void);
+
+/** detiene la recarga, borra todos los usuarios y libera las tablas */
+void
+users_destroy(void);
+
+#endif
@@ -4,20 +4,28 @@
  * Interpreta los argumentos de línea de comandos, y monta un socket
  * pasivo.
  *
- * Todas las conexiones entrantes se manejarán en éste hilo.
+ * Las conexiones entrantes se manejan en uno o más workers (--workers). Cada
+ * worker es un hilo con su propio selector y su propio socket pasivo socks
+ * (ligados con SO_REUSEPORT para que el kernel reparta las conexiones). El
+ * primer worker corre en éste hilo y además atiende el monitoreo.
  *
- * Se descargará en otro hilos las operaciones bloqueantes (resolución de
- * DNS utilizando getaddrinfo), pero toda esa complejidad está oculta en
- * el selector.
+ * Los nombres se resuelven con un resolver DNS stub que consulta a los
+ * nameservers desde el selector de cada worker (--dns=native). Lo que éste no
+ * puede resolver, o todo con --dns=system, se descarga en un pool acotado de
+ * hilos que usa getaddrinfo y notifica al selector cuando termina.
  */
+#define _GNU_SOURCE  // SO_REUSEPORT, TCP_DEFER_ACCEPT
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <errno.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #include <unistd.h>
+#include <sys/resource.h>
 #include <sys/types.h>   // socket
 #include <sys/socket.h>  // socket
 #include <netinet/in.h>
@@ -28,13 +36,17 @@
 #include "include/socks5nio.h"
 #include "include/monitornio.h"
 #include "include/args.h"
-
-#define MAX_CONNECTIONS 512
+#include "include/resolver.h"
+#include "include/dnscache.h"
+#include "include/dns.h"
+#include "include/bufpool.h"
+#include "include/users.h"
+#include "include/authverify.h"
 
 static const int FD_UNUSED = -1;
 #define IS_FD_USED(fd) ((FD_UNUSED != fd))
 
-static bool done = false;
+static atomic_bool done = false;
 
 static void
 sigterm_handler(const int signal) {
@@ -42,8 +54,35 @@ sigterm_handler(const int signal) {
     done = true;
 }
 
-static int bind_ipv4_socket(struct in_addr bind_address, unsigned port);
-static int bind_ipv6_socket(struct in6_addr bind_address, unsigned port);
+/** SIGHUP vuelve a leer el archivo de usuarios, si hay */
+static void
+sighup_handler(const int signal) {
+    users_file_reload();
+}
+
+/** un reactor: hilo con su propio selector y sus sockets pasivos socks */
+struct worker {
+    unsigned        id;
+    pthread_t       thread;
+    bool            running;
+    fd_selector     selector;
+    int             socks_v4;
+    int             socks_v6;
+
+    /** resultado del worker, para reportarlo desde el hilo principal */
+    selector_status ss;
+    int             ss_errno;
+};
+
+static struct worker workers[MAX_WORKERS];
+static unsigned      nworkers = 0;
+
+static int bind_ipv4_socket(struct in_addr bind_address, unsigned port, bool reuseport);
+static int bind_ipv6_socket(struct in6_addr bind_address, unsigned port, bool reuseport);
+static void defer_accept(int server, unsigned secs);
+static void raise_nofile_limit(void);
+static void *worker_run(void *data);
+static void workers_stop(void);
 
 int
 main(const int argc, char **argv) {
@@ -57,26 +96,62 @@ main(const int argc, char **argv) {
     const char       *err_msg = NULL;
     selector_status   ss      = SELECTOR_SUCCESS;
     fd_selector selector      = NULL;
+    int ret                   = 0;
 
     struct in_addr server_ipv4_addr, monitor_ipv4_addr;
-    int server_v4 = FD_UNUSED, monitor_v4 = FD_UNUSED;
+    int monitor_v4 = FD_UNUSED;
 
     struct in6_addr server_ipv6_addr, monitor_ipv6_addr;
-    int server_v6 = FD_UNUSED, monitor_v6 = FD_UNUSED;
+    int monitor_v6 = FD_UNUSED;
+
+    // con más de un worker cada uno liga su propio socket pasivo al mismo puerto
+    const bool reuseport = args.workers > 1;
+
+    for(nworkers = 0; nworkers < args.workers; nworkers++) {
+        struct worker *w = workers + nworkers;
+        w->id       = nworkers;
+        w->socks_v4 = FD_UNUSED;
+        w->socks_v6 = FD_UNUSED;
+    }
+
+    for(unsigned i = 0; i < nworkers; i++) {
+        struct worker *w = workers + i;
+
+        // socket pasivo socks IPv4
+        if(inet_pton(AF_INET, args.socks_addr, &server_ipv4_addr) == 1){       // if parsing to ipv4 succeded
+            w->socks_v4 = bind_ipv4_socket(server_ipv4_addr, args.socks_port, reuseport);
+            if (w->socks_v4 < 0) {
+                err_msg = "unable to create IPv4 socks socket";
+                goto finally;
+            }
+            defer_accept(w->socks_v4, args.defer_accept);
+        }
+
+        // socket pasivo socks IPv6
+        char* ipv6_addr_text = args.is_default_socks_addr ? DEFAULT_SOCKS_ADDR_V6 : args.socks_addr;
+
+        if((!IS_FD_USED(w->socks_v4) || args.is_default_socks_addr) && (inet_pton(AF_INET6, ipv6_addr_text, &server_ipv6_addr) == 1)){
+            w->socks_v6 = bind_ipv6_socket(server_ipv6_addr, args.socks_port, reuseport);
+            if (w->socks_v6 < 0) {
+                err_msg = "unable to create IPv6 socket";
+                goto finally;
+            }
+            defer_accept(w->socks_v6, args.defer_accept);
+        }
 
-    // socket pasivo socks IPv4
-    if(inet_pton(AF_INET, args.socks_addr, &server_ipv4_addr) == 1){       // if parsing to ipv4 succeded
-        server_v4 = bind_ipv4_socket(server_ipv4_addr, args.socks_port);
-        if (server_v4 < 0) {
-            err_msg = "unable to create IPv4 socks socket";
+        if(!IS_FD_USED(w->socks_v4) && !IS_FD_USED(w->socks_v6)) {
+            fprintf(stderr, "unable to parse socks server ip\n");
             goto finally;
         }
-        fprintf(stdout, "Socks: listening on IPv4 TCP port %d\n", args.socks_port);
     }
+    if(IS_FD_USED(workers[0].socks_v4))
+        fprintf(stdout, "Socks: listening on IPv4 TCP port %d\n", args.socks_port);
+    if(IS_FD_USED(workers[0].socks_v6))
+        fprintf(stdout, "Socks: listening on IPv6 TCP port %d\n", args.socks_port);
 
     // socket pasivo monitoreo IPv4
     if(inet_pton(AF_INET, args.mng_addr, &monitor_ipv4_addr) == 1) {
-        monitor_v4 = bind_ipv4_socket(monitor_ipv4_addr, args.mng_port);
+        monitor_v4 = bind_ipv4_socket(monitor_ipv4_addr, args.mng_port, false);
         if (monitor_v4 < 0) {
             err_msg = "unable to create IPv4 monitor socket";
             goto finally;
@@ -84,34 +159,17 @@ main(const int argc, char **argv) {
         fprintf(stdout, "Monitor: listening on IPv4 TCP port %d\n", args.mng_port);
     }
 
-     // socket pasivo socks IPv6
-    char* ipv6_addr_text = args.is_default_socks_addr ? DEFAULT_SOCKS_ADDR_V6 : args.socks_addr;
-
-    if((!IS_FD_USED(server_v4) || args.is_default_socks_addr) && (inet_pton(AF_INET6, ipv6_addr_text, &server_ipv6_addr) == 1)){
-        server_v6 = bind_ipv6_socket(server_ipv6_addr, args.socks_port);
-        if (server_v6 < 0) {
-            err_msg = "unable to create IPv6 socket";
-            goto finally;
-        }
-        fprintf(stdout, "Socks: listening on IPv6 TCP port %d\n", args.socks_port);
-    }
-
      // socket pasivo monitoreo IPv6
-     ipv6_addr_text = args.is_default_mng_addr ? DEFAULT_CONF_ADDR_V6 : args.mng_addr;
+    char* ipv6_addr_text = args.is_default_mng_addr ? DEFAULT_CONF_ADDR_V6 : args.mng_addr;
 
     if((!IS_FD_USED(monitor_v4) || args.is_default_mng_addr) && (inet_pton(AF_INET6, ipv6_addr_text, &monitor_ipv6_addr) == 1)){
-        monitor_v6 = bind_ipv6_socket(monitor_ipv6_addr, args.mng_port);
+        monitor_v6 = bind_ipv6_socket(monitor_ipv6_addr, args.mng_port, false);
         if (monitor_v6 < 0) {
             err_msg = "unable to create IPv6 socket";
             goto finally;
         }
         fprintf(stdout, "Monitor: listening on IPv6 TCP port %d\n", args.mng_port);
     }
-    
-    if(!IS_FD_USED(server_v4) && !IS_FD_USED(server_v6)) {
-        fprintf(stderr, "unable to parse socks server ip\n");
-        goto finally;
-    }
 
     if(!IS_FD_USED(monitor_v4) && !IS_FD_USED(monitor_v6)) {
         fprintf(stderr, "unable to parse monitor server ip\n");
@@ -122,16 +180,21 @@ main(const int argc, char **argv) {
     // esto ayuda mucho en herramientas como valgrind.
     signal(SIGTERM, sigterm_handler);
     signal(SIGINT,  sigterm_handler);
+    signal(SIGHUP,  sighup_handler);
+    // splice() no tiene MSG_NOSIGNAL, un origin o cliente que cierra no debe matarnos
+    signal(SIGPIPE, SIG_IGN);
 
     // seteamos los sockets pasivos como no bloqueantes
-    if(IS_FD_USED(server_v4) && (selector_fd_set_nio(server_v4) == -1)){
-        err_msg = "getting socks server ipv4 socket flags";
-        goto finally;
-    }
+    for(unsigned i = 0; i < nworkers; i++) {
+        if(IS_FD_USED(workers[i].socks_v4) && (selector_fd_set_nio(workers[i].socks_v4) == -1)){
+            err_msg = "getting socks server ipv4 socket flags";
+            goto finally;
+        }
 
-    if(IS_FD_USED(server_v6) && (selector_fd_set_nio(server_v6) == -1)) {
-        err_msg = "getting socks server ipv6 socket flags";
-        goto finally;
+        if(IS_FD_USED(workers[i].socks_v6) && (selector_fd_set_nio(workers[i].socks_v6) == -1)) {
+            err_msg = "getting socks server ipv6 socket flags";
+            goto finally;
+        }
     }
 
     if(IS_FD_USED(monitor_v4) && (selector_fd_set_nio(monitor_v4) == -1)){
@@ -144,21 +207,32 @@ main(const int argc, char **argv) {
         goto finally;
     }
 
+    // con epoll el límite de conexiones lo da la cantidad de fds que podemos abrir
+    if(args.selector_backend == SELECTOR_BACKEND_EPOLL)
+        raise_nofile_limit();
+
     const struct selector_init conf = {
-        .signal = SIGALRM, // señal para las notificaciones internas del selector
         .select_timeout = { // tiempo maximo de bloqueo, es una estructura de timespec
             .tv_sec  = 10,
             .tv_nsec = 0,
         },
+        .backend = args.selector_backend,
     };
     if(0 != selector_init(&conf)) {
         err_msg = "initializing selector";
         goto finally;
     }
 
-    selector = selector_new(1024); // initial elements
-    if(selector == NULL) {
-        err_msg = "unable to create selector";
+    if(0 != resolver_init(args.resolver_threads, args.resolver_queue)) {
+        err_msg = "starting resolvers";
+        goto finally;
+    }
+    // sin nameservers en resolv.conf todo lo resuelve getaddrinfo
+    const bool dns_native = args.dns_native && dns_init() > 0;
+    dnscache_init(args.dns_ttl, args.dns_negative_ttl, dns_native);
+    bufpool_init(args.relay_buffer_min, args.relay_buffer_max);
+    if(0 != socksv5_pool_init(nworkers, args.prealloc_connections, args.max_connections)) {
+        err_msg = "preallocating connections";
         goto finally;
     }
 
@@ -167,23 +241,37 @@ main(const int argc, char **argv) {
         .handle_read       = socksv5_passive_accept,
         .handle_write      = NULL,
         .handle_close      = NULL, // nada que liberar
+        .handle_timeout    = socksv5_passive_retry,
     };
 
-    if(IS_FD_USED(server_v4)){
-        ss = selector_register(selector, server_v4, &socksv5, OP_READ, NULL);
-        if(ss != SELECTOR_SUCCESS) {
-            err_msg = "registering IPv4 socks fd";
+    for(unsigned i = 0; i < nworkers; i++) {
+        struct worker *w = workers + i;
+
+        w->selector = selector_new(1024); // initial elements
+        if(w->selector == NULL) {
+            err_msg = "unable to create selector";
             goto finally;
         }
-    }
-    if(IS_FD_USED(server_v6)){
-        ss = selector_register(selector, server_v6, &socksv5, OP_READ, NULL);
-        if(ss != SELECTOR_SUCCESS) {
-            err_msg = "registering IPv6 socks fd";
-            goto finally;
+
+        if(IS_FD_USED(w->socks_v4)){
+            ss = selector_register(w->selector, w->socks_v4, &socksv5, OP_READ, NULL);
+            if(ss != SELECTOR_SUCCESS) {
+                err_msg = "registering IPv4 socks fd";
+                goto finally;
+            }
+        }
+        if(IS_FD_USED(w->socks_v6)){
+            ss = selector_register(w->selector, w->socks_v6, &socksv5, OP_READ, NULL);
+            if(ss != SELECTOR_SUCCESS) {
+                err_msg = "registering IPv6 socks fd";
+                goto finally;
+            }
         }
     }
 
+    // el monitoreo lo atiende el primer worker, que corre en este hilo
+    selector = workers[0].selector;
+
     const struct fd_handler monitor = {
         .handle_read       = monitor_passive_accept,
         .handle_write      = NULL,
@@ -214,36 +302,69 @@ main(const int argc, char **argv) {
 
     monitor_register_admin("root", token);
 
+    // los usuarios del archivo primero: los de -u que ya estén en él se rechazan
+    if (args.users_file != NULL && users_file_init(args.users_file) == -1) {
+        err_msg = "unable to load users file";
+        goto finally;
+    }
+
     // register proxy users
-    for (int i = 0; i < MAX_USERS && args.users[i].name != NULL; i++) {
-        int register_status = socksv5_register_user(args.users[i].name, args.users[i].pass);
+    for (int i = 0; i < MAX_ARGS_USERS && args.users[i].name != NULL; i++) {
+        int register_status = users_add(args.users[i].name, args.users[i].pass);
         if (register_status == -1)
             fprintf(stderr, "User already exists: %s\n", args.users[i].name);
         else if (register_status == 1)
             fprintf(stderr, "Maximum number of users reached\n");
     }
 
+    authverify_init(args.auth_verifier);
+
     if (!args.disectors_enabled)
         socksv5_toggle_disector(false);
 
+    socksv5_toggle_splice(args.splice_enabled);
+    socksv5_set_timeouts(&args.timeouts);
+    socksv5_set_accept_batch(args.accept_batch);
+
+    fprintf(stdout, "Selector: using %s\n", selector_backend_name(args.selector_backend));
+    fprintf(stdout, "Workers: %u\n", nworkers);
+    fprintf(stdout, "DNS: %s\n", dns_native ? "native" : "system");
+    fprintf(stdout, "Connections: %u max, %u preallocated\n", args.max_connections, args.prealloc_connections);
+    if (args.auth_verifier != NULL)
+        fprintf(stdout, "Auth verifier: %s\n", args.auth_verifier);
+
     printf("\n----------------------- LOGS -----------------------\n\n");
+
+    workers[0].thread  = pthread_self();
+    workers[0].running = true;
+    socksv5_worker_init(0);
+    for(unsigned i = 1; i < nworkers; i++) {
+        if(0 != pthread_create(&workers[i].thread, NULL, worker_run, workers + i)) {
+            err_msg = "starting worker";
+            workers_stop();
+            goto finally;
+        }
+        workers[i].running = true;
+    }
+
     // termina con un ctrl + C pero dejando un mensajito
     while(!done) {
         err_msg = NULL;
         // se bloquea hasta que haya eventos disponible y los despacha.
         ss = selector_select(selector);
+        socksv5_selector_iteration();
         if(ss != SELECTOR_SUCCESS) {
             err_msg = "serving";
+            workers_stop();
             goto finally;
         }
     }
+    workers_stop();
 
     if(err_msg == NULL) {
         err_msg = "closing";
     }
 
-    int ret = 0;
-
 finally:
     if(ss != SELECTOR_SUCCESS) {
         fprintf(stderr, "%s: %s\n", (err_msg == NULL) ? "": err_msg,
@@ -255,18 +376,43 @@ finally:
         ret = 1;
     }
 
-    if(selector != NULL)
-        selector_destroy(selector);
+    for(unsigned i = 1; i < nworkers; i++) {
+        if(workers[i].running) {
+            pthread_join(workers[i].thread, NULL);
+            workers[i].running = false;
+            if(workers[i].ss != SELECTOR_SUCCESS) {
+                fprintf(stderr, "worker %u: serving: %s\n", i,
+                    workers[i].ss == SELECTOR_IO ? strerror(workers[i].ss_errno)
+                                                 : selector_error(workers[i].ss));
+                ret = 2;
+            }
+        }
+    }
+
+    // las resoluciones en curso escriben sobre las conexiones y notifican a
+    // los selectores, así que el pool se detiene antes de destruirlos
+    resolver_destroy();
+
+    for(unsigned i = 0; i < nworkers; i++) {
+        if(workers[i].selector != NULL)
+            selector_destroy(workers[i].selector);
+    }
+    dnscache_destroy();
+    dns_destroy();
 
     selector_close();
 
     socksv5_pool_destroy();
     connection_pool_destroy();
-
-    if (server_v4 >= 0)
-        close(server_v4);
-    if(server_v6 >= 0)
-        close(server_v6);
+    bufpool_destroy();
+    users_destroy();
+
+    for(unsigned i = 0; i < nworkers; i++) {
+        if (workers[i].socks_v4 >= 0)
+            close(workers[i].socks_v4);
+        if (workers[i].socks_v6 >= 0)
+            close(workers[i].socks_v6);
+    }
     if (monitor_v4 >= 0)
         close(monitor_v4);
     if(monitor_v6 >= 0)
@@ -275,8 +421,45 @@ finally:
     return ret;
 }
 
+/** atiende las conexiones de un worker adicional hasta que el servidor termine */
+static void *
+worker_run(void *data) {
+    struct worker *w = data;
+
+    socksv5_worker_init(w->id);
+    while(!done) {
+        w->ss = selector_select(w->selector);
+        socksv5_selector_iteration();
+        if(w->ss != SELECTOR_SUCCESS) {
+            w->ss_errno = errno;
+            break;
+        }
+    }
+    // ya sea por un error o porque la señal la atendió este hilo, terminan todos
+    workers_stop();
+
+    // el selector (y con él las conexiones, que viven en el slab del worker)
+    // lo destruye el hilo principal, una vez detenidos los resolvers
+    bufpool_thread_flush();
+    return NULL;
+}
+
+/**
+ * marca que el servidor debe terminar y despierta a todos los workers, que
+ * pueden estar bloqueados en su selector hasta el timeout.
+ */
+static void
+workers_stop(void) {
+    done = true;
+    for(unsigned i = 0; i < nworkers; i++) {
+        if(workers[i].running && !pthread_equal(workers[i].thread, pthread_self())) {
+            selector_wakeup(workers[i].selector);
+        }
+    }
+}
+
 static int
-create_socket(sa_family_t family) {
+create_socket(sa_family_t family, bool reuseport) {
     const int s = socket(family, SOCK_STREAM, IPPROTO_TCP);
     if (s < 0) {
         fprintf(stderr, "unable to create socket\n");
@@ -287,6 +470,13 @@ create_socket(sa_family_t family) {
     socklen_t sock_optlen = sizeof(int);
     // man 7 ip. no importa reportar nada si falla.
     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const void*)sock_optval, sock_optlen);
+
+    // varios workers escuchan en el mismo puerto y el kernel reparte las conexiones
+    if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (const void*)sock_optval, sock_optlen) < 0) {
+        fprintf(stderr, "unable to set SO_REUSEPORT\n");
+        close(s);
+        return -1;
+    }
     return s;
 }
 
@@ -297,7 +487,8 @@ bind_socket(int server, struct sockaddr *address, socklen_t address_len) {
         return -1;
     }
 
-    if (listen(server, 5) < 0) {
+    // las conexiones que llegan en ráfaga esperan acá a que las acepte un worker
+    if (listen(server, SOMAXCONN) < 0) {
         fprintf(stderr, "unable to listen on socket\n");
         return -1;
     }
@@ -307,8 +498,10 @@ bind_socket(int server, struct sockaddr *address, socklen_t address_len) {
 
 /** creates and binds an IPv4 socket */
 static int
-bind_ipv4_socket(struct in_addr bind_address, unsigned port) {
-    const int server = create_socket(AF_INET);
+bind_ipv4_socket(struct in_addr bind_address, unsigned port, bool reuseport) {
+    const int server = create_socket(AF_INET, reuseport);
+    if (server < 0)
+        return -1;
 
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
@@ -324,8 +517,10 @@ bind_ipv4_socket(struct in_addr bind_address, unsigned port) {
 
 /** creates and binds an IPv6 socket */
 static int
-bind_ipv6_socket(struct in6_addr bind_address, unsigned port) {
-    const int server = create_socket(AF_INET6);
+bind_ipv6_socket(struct in6_addr bind_address, unsigned port, bool reuseport) {
+    const int server = create_socket(AF_INET6, reuseport);
+    if (server < 0)
+        return -1;
     setsockopt(server, IPPROTO_IPV6, IPV6_V6ONLY, &(int){1}, sizeof(int)); // man ipv6, si falla fallara el bind
 
     struct sockaddr_in6 addr;
@@ -339,3 +534,26 @@ bind_ipv6_socket(struct in6_addr bind_address, unsigned port) {
 
     return server;
 }
+
+/**
+ * el kernel retiene las conexiones nuevas del socket pasivo socks hasta que el
+ * cliente manda algo (o pasan `secs' segundos), así las que no mandan nada no
+ * despiertan al worker. No es fatal si no se puede.
+ */
+static void
+defer_accept(int server, unsigned secs) {
+    const int optval = secs;
+    if (secs > 0 && setsockopt(server, IPPROTO_TCP, TCP_DEFER_ACCEPT, &optval, sizeof(optval)) < 0)
+        fprintf(stderr, "unable to set TCP_DEFER_ACCEPT\n");
+}
+
+/** lleva el límite blando de descriptores abiertos hasta el límite duro */
+static void
+raise_nofile_limit(void) {
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        // no es fatal, seguimos con el límite que tengamos
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
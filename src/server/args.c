@@ -4,6 +4,7 @@
 #include <string.h>    /* memset */
 #include <errno.h>
 #include <getopt.h>
+#include <sys/un.h>    /* sockaddr_un */
 
 #include "../include/args.h"
 
@@ -41,6 +42,74 @@ user(char *s, struct users *user, char* progname) {
 
 }
 
+static selector_backend
+backend(const char *s, char *progname) {
+    selector_backend ret;
+    if(strcmp(s, "epoll") == 0) {
+        ret = SELECTOR_BACKEND_EPOLL;
+    } else if(strcmp(s, "select") == 0) {
+        ret = SELECTOR_BACKEND_SELECT;
+    } else {
+        fprintf(stderr, "%s: invalid selector %s, should be one of epoll or select.\n", progname, s);
+        exit(1);
+    }
+    return ret;
+}
+
+static bool
+relay(const char *s, char *progname) {
+    bool ret = false;
+    if(strcmp(s, "splice") == 0) {
+        ret = true;
+    } else if(strcmp(s, "copy") == 0) {
+        ret = false;
+    } else {
+        fprintf(stderr, "%s: invalid relay %s, should be one of splice or copy.\n", progname, s);
+        exit(1);
+    }
+    return ret;
+}
+
+static bool
+dns(const char *s, char *progname) {
+    bool ret = false;
+    if(strcmp(s, "native") == 0) {
+        ret = true;
+    } else if(strcmp(s, "system") == 0) {
+        ret = false;
+    } else {
+        fprintf(stderr, "%s: invalid dns %s, should be one of native or system.\n", progname, s);
+        exit(1);
+    }
+    return ret;
+}
+
+/** interpreta un entero en el rango [min, max] para la opción `name' */
+static unsigned
+number(const char *s, const long min, const long max, const char *name, char *progname) {
+    char *end     = 0;
+    errno         = 0;
+    const long sl = strtol(s, &end, 10);
+
+    if (end == s || '\0' != *end || ERANGE == errno
+        || sl < min || sl > max) {
+        fprintf(stderr, "%s: invalid %s %s, should be an integer in the range of %ld-%ld.\n", progname, name, s, min, max);
+        exit(1);
+    }
+    return (unsigned)sl;
+}
+
+/** interpreta un tamaño de buffer: una potencia de 2 entre los límites */
+static unsigned
+buffer_size(const char *s, const char *name, char *progname) {
+    const unsigned n = number(s, RELAY_BUFFER_MIN_LIMIT, RELAY_BUFFER_MAX_LIMIT, name, progname);
+    if((n & (n - 1)) != 0) {
+        fprintf(stderr, "%s: invalid %s %s, should be a power of 2.\n", progname, name, s);
+        exit(1);
+    }
+    return n;
+}
+
 static void
 version(void) {
     fprintf(stderr, "socks5v version 1.0\n"
@@ -61,6 +130,65 @@ usage(const char *progname) {
         "   -v              Imprime información sobre la versión y termina.\n"
         "\n",
         progname);
+    fprintf(stderr,
+        "   --selector=<epoll|select>\n"
+        "                   Multiplexor de entrada/salida a utilizar. Por defecto es epoll.\n"
+        "   --relay=<splice|copy>\n"
+        "                   Forma de copiar los datos de un túnel. splice los copia sin pasar por\n"
+        "                   espacio de usuario (salvo mientras el disector POP3 necesite verlos). Por\n"
+        "                   defecto es splice.\n"
+        "   --workers=<N>   Cantidad de hilos que atienden conexiones SOCKS, cada uno con su\n"
+        "                   propio selector y socket pasivo (SO_REUSEPORT). Por defecto es 1.\n"
+        "   --resolver-threads=<N>\n"
+        "                   Cantidad de hilos que resuelven nombres DNS. Por defecto es 8.\n"
+        "   --resolver-queue=<N>\n"
+        "                   Resoluciones DNS que pueden esperar un hilo libre. Las que no entran\n"
+        "                   se rechazan con \"general SOCKS server failure\". Por defecto es 256.\n"
+        "   --dns-ttl=<s>   Segundos que se guarda una resolución DNS. 0 deshabilita el cache.\n"
+        "                   Por defecto es 60.\n"
+        "   --dns-negative-ttl=<s>\n"
+        "                   Segundos que se recuerda que un nombre no existe. Por defecto es 5.\n"
+        "   --dns=<native|system>\n"
+        "                   Forma de resolver nombres. native consulta a los nameservers de\n"
+        "                   /etc/resolv.conf desde el selector; system usa getaddrinfo en el pool\n"
+        "                   de resolvers. Por defecto es native.\n"
+        "   --relay-buffer-min=<bytes>\n"
+        "   --relay-buffer-max=<bytes>\n"
+        "                   Tamaño inicial y máximo de los buffers con los que se copian los datos de\n"
+        "                   un túnel que no usa splice. Un túnel que llena su buffer lo duplica hasta\n"
+        "                   el máximo, y lo achica cuando su tráfico baja. Deben ser potencias de 2.\n"
+        "                   Por defecto son 4096 y 262144.\n"
+        "   --max-connections=<N>\n"
+        "                   Conexiones SOCKS simultáneas como máximo, repartidas entre los workers.\n"
+        "                   Al llegar al tope se dejan de aceptar conexiones hasta que termine\n"
+        "                   alguna. Por defecto es 16384.\n"
+        "   --prealloc-connections=<N>\n"
+        "                   Estados de conexión que se reservan al iniciar. Por defecto es 256.\n"
+        "   --accept-batch=<N>\n"
+        "                   Conexiones que se aceptan como máximo cada vez que el socket pasivo\n"
+        "                   tiene conexiones esperando. Por defecto es 64.\n"
+        "   --defer-accept=<s>\n"
+        "                   Segundos que el kernel retiene una conexión nueva hasta que el cliente\n"
+        "                   manda algo (TCP_DEFER_ACCEPT). 0 lo deshabilita. Por defecto es 10.\n"
+        "   --hello-timeout=<s>\n"
+        "   --auth-timeout=<s>\n"
+        "   --request-timeout=<s>\n"
+        "                   Segundos que se espera cada mensaje del handshake SOCKS, incluyendo\n"
+        "                   mandar su respuesta. Por defecto son 10.\n"
+        "   --resolve-timeout=<s>\n"
+        "   --connect-timeout=<s>\n"
+        "                   Segundos que puede tardar la resolución del nombre pedido y la conexión\n"
+        "                   con el origin. Vencidos se responde \"TTL expired\". Por defecto son 10.\n"
+        "   --idle-timeout=<s>\n"
+        "                   Segundos que un túnel puede estar sin tráfico. Por defecto es 600.\n"
+        "                   En todos los plazos 0 significa sin límite.\n"
+        "   --users-file=<path>\n"
+        "                   Archivo con usuarios del proxy, un <user>:<pass> por línea. Se vuelve\n"
+        "                   a leer al recibir SIGHUP o desde el monitor, sin frenar las conexiones.\n"
+        "   --auth-verifier=<path>\n"
+        "                   Socket Unix de un verificador externo al que se consultan las\n"
+        "                   credenciales que no son de usuarios locales.\n"
+        "\n");
     exit(1);
 }
 
@@ -77,9 +205,81 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
     args->is_default_mng_addr = true;
 
     args->disectors_enabled = true;
+    args->splice_enabled    = DEFAULT_SPLICE_ENABLED;
+
+    args->selector_backend = DEFAULT_SELECTOR_BACKEND;
+    args->workers          = DEFAULT_WORKERS;
+    args->resolver_threads = DEFAULT_RESOLVER_THREADS;
+    args->resolver_queue   = DEFAULT_RESOLVER_QUEUE;
+    args->dns_ttl          = DEFAULT_DNSCACHE_TTL;
+    args->dns_negative_ttl = DEFAULT_DNSCACHE_NEGATIVE_TTL;
+    args->dns_native       = DEFAULT_DNS_NATIVE;
+    args->relay_buffer_min = DEFAULT_RELAY_BUFFER_MIN;
+    args->relay_buffer_max = DEFAULT_RELAY_BUFFER_MAX;
+    args->max_connections      = DEFAULT_MAX_CONNECTIONS;
+    args->prealloc_connections = DEFAULT_PREALLOC_CONNECTIONS;
+    args->accept_batch         = DEFAULT_ACCEPT_BATCH;
+    args->defer_accept         = DEFAULT_DEFER_ACCEPT;
+    args->timeouts.hello   = DEFAULT_HELLO_TIMEOUT;
+    args->timeouts.auth    = DEFAULT_AUTH_TIMEOUT;
+    args->timeouts.request = DEFAULT_REQUEST_TIMEOUT;
+    args->timeouts.resolve = DEFAULT_RESOLVE_TIMEOUT;
+    args->timeouts.connect = DEFAULT_CONNECT_TIMEOUT;
+    args->timeouts.idle    = DEFAULT_IDLE_TIMEOUT;
 
     int nusers = 0;
 
+    // opciones largas para los parámetros de tuning, no tienen una versión corta
+    enum {
+        OPT_SELECTOR = 0x100,
+        OPT_WORKERS,
+        OPT_RELAY,
+        OPT_RESOLVER_THREADS,
+        OPT_RESOLVER_QUEUE,
+        OPT_DNS_TTL,
+        OPT_DNS_NEGATIVE_TTL,
+        OPT_DNS,
+        OPT_RELAY_BUFFER_MIN,
+        OPT_RELAY_BUFFER_MAX,
+        OPT_MAX_CONNECTIONS,
+        OPT_PREALLOC_CONNECTIONS,
+        OPT_ACCEPT_BATCH,
+        OPT_DEFER_ACCEPT,
+        OPT_HELLO_TIMEOUT,
+        OPT_AUTH_TIMEOUT,
+        OPT_REQUEST_TIMEOUT,
+        OPT_RESOLVE_TIMEOUT,
+        OPT_CONNECT_TIMEOUT,
+        OPT_IDLE_TIMEOUT,
+        OPT_USERS_FILE,
+        OPT_AUTH_VERIFIER,
+    };
+    static const struct option long_options[] = {
+        { "selector",   required_argument,  0,  OPT_SELECTOR },
+        { "workers",    required_argument,  0,  OPT_WORKERS },
+        { "relay",      required_argument,  0,  OPT_RELAY },
+        { "resolver-threads", required_argument, 0, OPT_RESOLVER_THREADS },
+        { "resolver-queue",   required_argument, 0, OPT_RESOLVER_QUEUE },
+        { "dns-ttl",          required_argument, 0, OPT_DNS_TTL },
+        { "dns-negative-ttl", required_argument, 0, OPT_DNS_NEGATIVE_TTL },
+        { "dns",              required_argument, 0, OPT_DNS },
+        { "relay-buffer-min", required_argument, 0, OPT_RELAY_BUFFER_MIN },
+        { "relay-buffer-max", required_argument, 0, OPT_RELAY_BUFFER_MAX },
+        { "max-connections",  required_argument, 0, OPT_MAX_CONNECTIONS },
+        { "prealloc-connections", required_argument, 0, OPT_PREALLOC_CONNECTIONS },
+        { "accept-batch",     required_argument, 0, OPT_ACCEPT_BATCH },
+        { "defer-accept",     required_argument, 0, OPT_DEFER_ACCEPT },
+        { "hello-timeout",    required_argument, 0, OPT_HELLO_TIMEOUT },
+        { "auth-timeout",     required_argument, 0, OPT_AUTH_TIMEOUT },
+        { "request-timeout",  required_argument, 0, OPT_REQUEST_TIMEOUT },
+        { "resolve-timeout",  required_argument, 0, OPT_RESOLVE_TIMEOUT },
+        { "connect-timeout",  required_argument, 0, OPT_CONNECT_TIMEOUT },
+        { "idle-timeout",     required_argument, 0, OPT_IDLE_TIMEOUT },
+        { "users-file",       required_argument, 0, OPT_USERS_FILE },
+        { "auth-verifier",    required_argument, 0, OPT_AUTH_VERIFIER },
+        { 0,            0,                  0,  0 },
+    };
+
     while (true) {
         /*
             Uso: getopt(argc, argv, optstring)
@@ -95,7 +295,7 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
             pero falta su valor (getopt retorna '!'). En ambos retornos, el argumento procesado se guarda en 'optopt' y se
             puede usar en los mensajes de error custom.
         */
-        int c = getopt(argc, argv, ":hl:L:Np:P:u:v");
+        int c = getopt_long(argc, argv, ":hl:L:Np:P:u:v", long_options, NULL);
         if (c == -1)
             break;
 
@@ -121,8 +321,8 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
                 args->mng_port   = port(optarg, argv[0]);
                 break;
             case 'u':
-                if(nusers >= MAX_USERS) {
-                    fprintf(stderr, "%s: sent too many users, maximum allowed is %d\n", argv[0], MAX_USERS);
+                if(nusers >= MAX_ARGS_USERS) {
+                    fprintf(stderr, "%s: sent too many users, maximum allowed is %d\n", argv[0], MAX_ARGS_USERS);
                     exit(1);
                 } else {
                     user(optarg, args->users + nusers, argv[0]);
@@ -133,13 +333,89 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
                 version();
                 exit(0);
                 break;
+            case OPT_SELECTOR:
+                args->selector_backend = backend(optarg, argv[0]);
+                break;
+            case OPT_WORKERS:
+                args->workers = number(optarg, 1, MAX_WORKERS, "workers", argv[0]);
+                break;
+            case OPT_RELAY:
+                args->splice_enabled = relay(optarg, argv[0]);
+                break;
+            case OPT_RESOLVER_THREADS:
+                args->resolver_threads = number(optarg, 1, MAX_RESOLVER_THREADS, "resolver-threads", argv[0]);
+                break;
+            case OPT_RESOLVER_QUEUE:
+                args->resolver_queue = number(optarg, 1, MAX_RESOLVER_QUEUE, "resolver-queue", argv[0]);
+                break;
+            case OPT_DNS_TTL:
+                args->dns_ttl = number(optarg, 0, MAX_DNS_TTL, "dns-ttl", argv[0]);
+                break;
+            case OPT_DNS_NEGATIVE_TTL:
+                args->dns_negative_ttl = number(optarg, 0, MAX_DNS_TTL, "dns-negative-ttl", argv[0]);
+                break;
+            case OPT_DNS:
+                args->dns_native = dns(optarg, argv[0]);
+                break;
+            case OPT_RELAY_BUFFER_MIN:
+                args->relay_buffer_min = buffer_size(optarg, "relay-buffer-min", argv[0]);
+                break;
+            case OPT_RELAY_BUFFER_MAX:
+                args->relay_buffer_max = buffer_size(optarg, "relay-buffer-max", argv[0]);
+                break;
+            case OPT_MAX_CONNECTIONS:
+                args->max_connections = number(optarg, 1, MAX_CONNECTIONS, "max-connections", argv[0]);
+                break;
+            case OPT_PREALLOC_CONNECTIONS:
+                args->prealloc_connections = number(optarg, 0, MAX_CONNECTIONS, "prealloc-connections", argv[0]);
+                break;
+            case OPT_ACCEPT_BATCH:
+                args->accept_batch = number(optarg, 1, MAX_ACCEPT_BATCH, "accept-batch", argv[0]);
+                break;
+            case OPT_DEFER_ACCEPT:
+                args->defer_accept = number(optarg, 0, MAX_TIMEOUT, "defer-accept", argv[0]);
+                break;
+            case OPT_HELLO_TIMEOUT:
+                args->timeouts.hello = number(optarg, 0, MAX_TIMEOUT, "hello-timeout", argv[0]);
+                break;
+            case OPT_AUTH_TIMEOUT:
+                args->timeouts.auth = number(optarg, 0, MAX_TIMEOUT, "auth-timeout", argv[0]);
+                break;
+            case OPT_REQUEST_TIMEOUT:
+                args->timeouts.request = number(optarg, 0, MAX_TIMEOUT, "request-timeout", argv[0]);
+                break;
+            case OPT_RESOLVE_TIMEOUT:
+                args->timeouts.resolve = number(optarg, 0, MAX_TIMEOUT, "resolve-timeout", argv[0]);
+                break;
+            case OPT_CONNECT_TIMEOUT:
+                args->timeouts.connect = number(optarg, 0, MAX_TIMEOUT, "connect-timeout", argv[0]);
+                break;
+            case OPT_IDLE_TIMEOUT:
+                args->timeouts.idle = number(optarg, 0, MAX_TIMEOUT, "idle-timeout", argv[0]);
+                break;
+            case OPT_USERS_FILE:
+                args->users_file = optarg;
+                break;
+            case OPT_AUTH_VERIFIER:
+                if(strlen(optarg) >= sizeof(((struct sockaddr_un *) 0)->sun_path)) {
+                    fprintf(stderr, "%s: auth verifier path too long: %s\n", argv[0], optarg);
+                    exit(1);
+                }
+                args->auth_verifier = optarg;
+                break;
             case ':':
-                fprintf(stderr, "%s: missing value for option -%c.\n", argv[0], optopt);
+                if(optopt >= OPT_SELECTOR)
+                    fprintf(stderr, "%s: missing value for option %s.\n", argv[0], argv[optind - 1]);
+                else
+                    fprintf(stderr, "%s: missing value for option -%c.\n", argv[0], optopt);
                 usage(argv[0]);
                 exit(1);
                 break;
             case '?':
-                fprintf(stderr, "%s: invalid option -%c.\n", argv[0], optopt);
+                if(optopt == 0)
+                    fprintf(stderr, "%s: invalid option %s.\n", argv[0], argv[optind - 1]);
+                else
+                    fprintf(stderr, "%s: invalid option -%c.\n", argv[0], optopt);
                 usage(argv[0]);
                 exit(1);
             default:
@@ -155,4 +431,11 @@ parse_args(const int argc, char **argv, struct socks5args *args) {
         fprintf(stderr, "\n");
         exit(1);
     }
+    if (args->relay_buffer_min > args->relay_buffer_max) {
+        fprintf(stderr, "%s: relay-buffer-min should not be greater than relay-buffer-max.\n", argv[0]);
+        exit(1);
+    }
+    if (args->prealloc_connections > args->max_connections) {
+        args->prealloc_connections = args->max_connections;
+    }
 }
@@ -37,7 +37,7 @@ version(const uint8_t c, struct auth_parser *p) {
 static enum auth_state
 ulen(const uint8_t c, struct auth_parser *p) {
     remaining_set(p, c);
-    return auth_uname;
+    return c == 0 ? auth_plen : auth_uname;
 }
 
 static enum auth_state
@@ -51,7 +51,7 @@ uname(const uint8_t c, struct auth_parser *p) {
 static enum auth_state
 plen(const uint8_t c, struct auth_parser *p) {
     remaining_set(p, c);
-    return auth_passwd;
+    return c == 0 ? auth_done : auth_passwd;
 }
 
 static enum auth_state
@@ -97,10 +97,43 @@ auth_parser_feed(struct auth_parser *p, const uint8_t c) {
     return p->state = next;
 }
 
+/**
+ * si el mensaje llegó entero lo parsea de una pasada, copiando usuario y
+ * contraseña directamente. Retorna false (sin consumir nada) si falta algo
+ * o la versión no es la de RFC 1929, para que lo resuelva el parser
+ * incremental.
+ */
+static bool
+auth_parse_whole(buffer *b, struct auth_parser *p) {
+    size_t n;
+    const uint8_t *ptr = buffer_read_ptr(b, &n);
+
+    if (n < 3 || ptr[0] != 0x01) {
+        return false;
+    }
+    const uint8_t ulen = ptr[1];
+    if (n < 3 + (size_t) ulen) {
+        return false;
+    }
+    const uint8_t plen = ptr[2 + ulen];
+    if (n < 3 + (size_t) ulen + plen) {
+        return false;
+    }
+    // el parser se inicializa en cero: los campos cortos quedan terminados
+    memcpy(p->auth->uname, ptr + 2, ulen);
+    memcpy(p->auth->passwd, ptr + 3 + ulen, plen);
+    p->state = auth_done;
+    buffer_read_adv(b, 3 + ulen + plen);
+    return true;
+}
+
 extern enum auth_state
 auth_consume(buffer *b, struct auth_parser *p, bool *errored) {
     enum auth_state st = p->state;
 
+    if (auth_version == st && auth_parse_whole(b, p)) {
+        return p->state;
+    }
     while (buffer_can_read(b)) {
         const uint8_t c = buffer_read(b);
         st = auth_parser_feed(p, c); // cargamos 1 solo byte
@@ -0,0 +1,379 @@
+/**
+ * authverify.c - verificación de credenciales en un proceso externo, integrada al selector
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../include/authverify.h"
+
+#define N(x) (sizeof(x)/sizeof((x)[0]))
+
+/** pedidos en curso por lista de la tabla por id, potencia de 2 */
+#define AUTHVERIFY_BUCKETS      256
+/** resultados que recuerda cada selector, potencia de 2 */
+#define AUTHVERIFY_CACHE_SIZE   256
+/** máximo de un pedido: ID, ULEN, UNAME, PLEN y PASSWD */
+#define AUTHVERIFY_MAX_REQUEST  (4 + 1 + 0xff + 1 + 0xff)
+#define AUTHVERIFY_RESPONSE     (4 + 1)
+/** pedidos sin mandar que se aceptan, cuando el verificador no los lee */
+#define AUTHVERIFY_OUT_SIZE     (64 * 1024)
+#define AUTHVERIFY_IN_SIZE      (AUTHVERIFY_RESPONSE * 256)
+/** segundos que se espera para volver a conectar luego de un fallo */
+#define AUTHVERIFY_RETRY        1
+
+static struct sockaddr_un verifier;
+static bool               enabled;
+
+struct cache_entry {
+    bool     used;
+    bool     granted;
+    time_t   expires;
+    uint32_t hash;
+    uint8_t  ulen;
+    uint8_t  plen;
+    char     uname[0xff];
+    char     passwd[0xff];
+};
+
+/** conexión al verificador de un selector */
+struct authverify_client {
+    fd_selector                s;
+    int                        fd;
+    uint32_t                   next_id;
+
+    struct authverify_waiter  *buckets[AUTHVERIFY_BUCKETS];
+
+    uint8_t                    out[AUTHVERIFY_OUT_SIZE];
+    size_t                     out_len;
+    uint8_t                    in[AUTHVERIFY_IN_SIZE];
+    size_t                     in_len;
+
+    struct cache_entry         cache[AUTHVERIFY_CACHE_SIZE];
+};
+
+/** la conexión del selector que atiende este hilo, NULL si no hay */
+static _Thread_local struct authverify_client *client;
+/** no se intenta conectar antes de este momento */
+static _Thread_local time_t retry_at;
+
+static time_t
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint32_t
+rd32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void
+wr32(uint8_t *p, const uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+void
+authverify_init(const char *path) {
+    enabled = false;
+    if(path == NULL || strlen(path) >= sizeof(verifier.sun_path)) {
+        return;
+    }
+    memset(&verifier, 0, sizeof(verifier));
+    verifier.sun_family = AF_UNIX;
+    strcpy(verifier.sun_path, path);
+    enabled = true;
+}
+
+bool
+authverify_enabled(void) {
+    return enabled;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CACHE
+////////////////////////////////////////////////////////////////////////////////
+
+/** FNV-1a de las credenciales */
+static uint32_t
+credentials_hash(const char *uname, const uint8_t ulen, const char *passwd, const uint8_t plen) {
+    uint32_t h = 2166136261u;
+    for(unsigned i = 0; i < ulen; i++) {
+        h = (h ^ (uint8_t) uname[i]) * 16777619u;
+    }
+    h = (h ^ 0xff) * 16777619u; // separa "ab"+"c" de "a"+"bc"
+    for(unsigned i = 0; i < plen; i++) {
+        h = (h ^ (uint8_t) passwd[i]) * 16777619u;
+    }
+    return h;
+}
+
+static struct cache_entry *
+cache_find(struct authverify_client *c, const uint32_t h, const char *uname, const uint8_t ulen,
+           const char *passwd, const uint8_t plen) {
+    struct cache_entry *e = c->cache + (h & (AUTHVERIFY_CACHE_SIZE - 1));
+    if(e->used && e->hash == h && e->ulen == ulen && e->plen == plen
+    && memcmp(e->uname, uname, ulen) == 0 && memcmp(e->passwd, passwd, plen) == 0
+    && e->expires > now()) {
+        return e;
+    }
+    return NULL;
+}
+
+/** guarda el resultado de `w' en el cache, pisando lo que haya en su lugar */
+static void
+cache_store(struct authverify_client *c, const struct authverify_waiter *w) {
+    const uint32_t h      = credentials_hash(w->uname, w->ulen, w->passwd, w->plen);
+    struct cache_entry *e = c->cache + (h & (AUTHVERIFY_CACHE_SIZE - 1));
+    e->used    = true;
+    e->granted = w->granted;
+    e->expires = now() + (w->granted ? AUTHVERIFY_CACHE_TTL : AUTHVERIFY_CACHE_NEGATIVE_TTL);
+    e->hash    = h;
+    e->ulen    = w->ulen;
+    e->plen    = w->plen;
+    memcpy(e->uname, w->uname, w->ulen);
+    memcpy(e->passwd, w->passwd, w->plen);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CONEXIÓN
+////////////////////////////////////////////////////////////////////////////////
+
+static void authverify_read  (struct selector_key *key);
+static void authverify_write (struct selector_key *key);
+static void authverify_close (struct selector_key *key);
+
+static const struct fd_handler verifier_handler = {
+    .handle_read  = authverify_read,
+    .handle_write = authverify_write,
+    .handle_close = authverify_close,
+};
+
+/** informa el resultado a quien espera en `w', que ya no está en la tabla */
+static void
+waiter_finish(struct authverify_waiter *w, const bool granted) {
+    w->pending = false;
+    w->done    = true;
+    w->granted = granted;
+
+    struct selector_key key = {
+        .s    = w->s,
+        .fd   = w->fd,
+        .data = w->data,
+    };
+    w->on_verified(&key);
+}
+
+/** saca a `w' de la tabla de pedidos en curso */
+static void
+waiter_remove(struct authverify_client *c, struct authverify_waiter *w) {
+    struct authverify_waiter **p = c->buckets + (w->id & (AUTHVERIFY_BUCKETS - 1));
+    for(; *p != NULL && *p != w; p = &(*p)->next)
+        ;
+    if(*p == w) {
+        *p = w->next;
+    }
+    w->next = NULL;
+}
+
+/**
+ * cierra la conexión al verificador y rechaza los pedidos en curso. Los
+ * callbacks se invocan con la conexión ya liberada.
+ */
+static void
+client_fail(struct authverify_client *c) {
+    struct authverify_waiter *failed = NULL;
+    for(unsigned i = 0; i < N(c->buckets); i++) {
+        while(c->buckets[i] != NULL) {
+            struct authverify_waiter *w = c->buckets[i];
+            c->buckets[i] = w->next;
+            w->next       = failed;
+            failed        = w;
+        }
+    }
+    retry_at = now() + AUTHVERIFY_RETRY;
+    selector_unregister_fd(c->s, c->fd); // libera `c' en su handle_close
+
+    while(failed != NULL) {
+        struct authverify_waiter *w = failed;
+        failed  = w->next;
+        w->next = NULL;
+        waiter_finish(w, false);
+    }
+}
+
+/** la conexión al verificador del selector `s', que se crea con el primer pedido */
+static struct authverify_client *
+client_get(fd_selector s) {
+    if(client != NULL) {
+        return client->s == s ? client : NULL;
+    }
+    if(now() < retry_at) {
+        return NULL;
+    }
+    struct authverify_client *c = calloc(1, sizeof(*c));
+    if(c == NULL) {
+        return NULL;
+    }
+    c->s  = s;
+    c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(c->fd == -1) {
+        goto fail;
+    }
+    // conectar a un socket Unix no queda en curso: si el verificador no
+    // tiene lugar en su cola de conexiones falla con EAGAIN
+    if(selector_fd_set_nio(c->fd) == -1
+    || connect(c->fd, (const struct sockaddr *) &verifier, sizeof(verifier)) == -1
+    || SELECTOR_SUCCESS != selector_register(s, c->fd, &verifier_handler, OP_READ, c)) {
+        goto fail;
+    }
+    client = c;
+    return c;
+
+fail:
+    retry_at = now() + AUTHVERIFY_RETRY;
+    if(c->fd != -1) {
+        close(c->fd);
+    }
+    free(c);
+    return NULL;
+}
+
+enum authverify_status
+authverify_check(struct authverify_waiter *w,
+                 const char *uname, const uint8_t ulen,
+                 const char *passwd, const uint8_t plen,
+                 const struct selector_key *key, authverify_callback on_verified) {
+    memset(w, 0, sizeof(*w));
+    w->done = true;
+
+    struct authverify_client *c = enabled ? client_get(key->s) : NULL;
+    if(c == NULL) {
+        return authverify_done;
+    }
+
+    const uint32_t h = credentials_hash(uname, ulen, passwd, plen);
+    const struct cache_entry *e = cache_find(c, h, uname, ulen, passwd, plen);
+    if(e != NULL) {
+        w->granted = e->granted;
+        return authverify_done;
+    }
+    if(c->out_len + AUTHVERIFY_MAX_REQUEST > sizeof(c->out)) {
+        return authverify_done; // el verificador no da abasto
+    }
+
+    w->s           = key->s;
+    w->fd          = key->fd;
+    w->data        = key->data;
+    w->on_verified = on_verified;
+    w->uname       = uname;
+    w->ulen        = ulen;
+    w->passwd      = passwd;
+    w->plen        = plen;
+    w->id          = c->next_id++;
+    w->pending     = true;
+    w->done        = false;
+
+    uint8_t *out = c->out + c->out_len;
+    wr32(out, w->id);
+    out[4] = ulen;
+    memcpy(out + 5, uname, ulen);
+    out[5 + ulen] = plen;
+    memcpy(out + 6 + ulen, passwd, plen);
+    c->out_len += 6 + ulen + plen;
+
+    struct authverify_waiter **bucket = c->buckets + (w->id & (AUTHVERIFY_BUCKETS - 1));
+    w->next = *bucket;
+    *bucket = w;
+
+    // se manda cuando el selector termine esta vuelta, junto con los demás
+    selector_set_interest(c->s, c->fd, OP_READ | OP_WRITE);
+    return authverify_pending;
+}
+
+bool
+authverify_ready(const struct authverify_waiter *w) {
+    return w->done;
+}
+
+void
+authverify_cancel(struct authverify_waiter *w) {
+    if(w->pending) {
+        // solo hay pedidos en curso mientras la conexión del hilo existe
+        if(client != NULL) {
+            waiter_remove(client, w);
+        }
+        w->pending = false;
+    }
+}
+
+static void
+authverify_write(struct selector_key *key) {
+    struct authverify_client *c = key->data;
+
+    const ssize_t n = send(key->fd, c->out, c->out_len, MSG_NOSIGNAL);
+    if(n == -1) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            client_fail(c);
+        }
+        return;
+    }
+    c->out_len -= (size_t) n;
+    memmove(c->out, c->out + n, c->out_len);
+    if(c->out_len == 0) {
+        selector_set_interest_key(key, OP_READ);
+    }
+}
+
+static void
+authverify_read(struct selector_key *key) {
+    struct authverify_client *c = key->data;
+
+    const ssize_t n = recv(key->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if(n <= 0) {
+        client_fail(c);
+        return;
+    }
+    c->in_len += (size_t) n;
+
+    size_t off = 0;
+    for(; c->in_len - off >= AUTHVERIFY_RESPONSE; off += AUTHVERIFY_RESPONSE) {
+        const uint32_t id = rd32(c->in + off);
+        struct authverify_waiter *w = c->buckets[id & (AUTHVERIFY_BUCKETS - 1)];
+        while(w != NULL && w->id != id) {
+            w = w->next;
+        }
+        if(w == NULL) {
+            continue; // de un pedido que se dejó de esperar
+        }
+        waiter_remove(c, w);
+        w->granted = c->in[off + 4] == 0x00;
+        cache_store(c, w);
+        waiter_finish(w, w->granted);
+    }
+    c->in_len -= off;
+    memmove(c->in, c->in + off, c->in_len);
+}
+
+static void
+authverify_close(struct selector_key *key) {
+    struct authverify_client *c = key->data;
+    close(key->fd);
+    if(client == c) {
+        client = NULL;
+    }
+    free(c);
+}
@@ -0,0 +1,172 @@
+/**
+ * bufpool.c - pool compartido de bloques para los buffers del COPY
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "../include/bufpool.h"
+
+/** cantidad de tamaños distintos: de RELAY_BUFFER_MIN_LIMIT a RELAY_BUFFER_MAX_LIMIT */
+#define BUFPOOL_CLASSES 13
+
+/** bloque libre: el enlace se guarda en el propio bloque */
+struct free_block {
+    struct free_block *next;
+};
+
+struct size_class {
+    pthread_mutex_t    mutex;
+    struct free_block *free;
+    size_t             count;
+};
+
+/**
+ * bloques libres propios de cada hilo. Un túnel toma y devuelve su bloque
+ * cada vez que vacía el buffer, así que la mayoría de las veces se resuelve
+ * acá sin tomar el mutex.
+ */
+static _Thread_local struct {
+    struct free_block *free;
+    size_t             count;
+} cache[BUFPOOL_CLASSES];
+
+static struct {
+    size_t            min, max;
+    struct size_class classes[BUFPOOL_CLASSES];
+} pool = {
+    .min = DEFAULT_RELAY_BUFFER_MIN,
+    .max = DEFAULT_RELAY_BUFFER_MAX,
+};
+
+/** índice de la lista que corresponde a `size', o -1 si no es un tamaño válido */
+static int
+size_class(size_t size) {
+    if(size < pool.min || size > pool.max || (size & (size - 1)) != 0) {
+        return -1;
+    }
+    int i = 0;
+    for(size_t s = RELAY_BUFFER_MIN_LIMIT; s < size; s <<= 1) {
+        i++;
+    }
+    return i < BUFPOOL_CLASSES ? i : -1;
+}
+
+/** bloques de `size' que retiene el cache de cada hilo */
+static size_t
+cache_limit(size_t size) {
+    return size >= BUFPOOL_THREAD_CACHED_BYTES ? 1 : BUFPOOL_THREAD_CACHED_BYTES / size;
+}
+
+/** agrega un bloque a la lista compartida, o lo libera si ya retiene demasiados */
+static void
+shared_put(struct size_class *c, struct free_block *b, size_t size) {
+    bool retained = false;
+
+    pthread_mutex_lock(&c->mutex);
+    if(c->count < BUFPOOL_CACHED_BYTES / size) {
+        b->next  = c->free;
+        c->free  = b;
+        c->count++;
+        retained = true;
+    }
+    pthread_mutex_unlock(&c->mutex);
+    if(!retained) {
+        free(b);
+    }
+}
+
+void
+bufpool_init(size_t min, size_t max) {
+    pool.min = min;
+    pool.max = max;
+    for(unsigned i = 0; i < BUFPOOL_CLASSES; i++) {
+        pthread_mutex_init(&pool.classes[i].mutex, NULL);
+        pool.classes[i].free  = NULL;
+        pool.classes[i].count = 0;
+    }
+}
+
+void
+bufpool_thread_flush(void) {
+    size_t size = RELAY_BUFFER_MIN_LIMIT;
+    for(unsigned i = 0; i < BUFPOOL_CLASSES; i++, size <<= 1) {
+        for(struct free_block *b = cache[i].free, *next; b != NULL; b = next) {
+            next = b->next;
+            shared_put(pool.classes + i, b, size);
+        }
+        cache[i].free  = NULL;
+        cache[i].count = 0;
+    }
+}
+
+void
+bufpool_destroy(void) {
+    bufpool_thread_flush();
+    for(unsigned i = 0; i < BUFPOOL_CLASSES; i++) {
+        struct size_class *c = pool.classes + i;
+        pthread_mutex_lock(&c->mutex);
+        for(struct free_block *b = c->free, *next; b != NULL; b = next) {
+            next = b->next;
+            free(b);
+        }
+        c->free  = NULL;
+        c->count = 0;
+        pthread_mutex_unlock(&c->mutex);
+        pthread_mutex_destroy(&c->mutex);
+    }
+}
+
+size_t
+bufpool_min(void) {
+    return pool.min;
+}
+
+size_t
+bufpool_max(void) {
+    return pool.max;
+}
+
+uint8_t *
+bufpool_get(size_t size) {
+    const int i = size_class(size);
+    struct free_block *b = NULL;
+
+    if(i == -1) {
+        return NULL;
+    }
+    if(cache[i].free != NULL) {
+        b             = cache[i].free;
+        cache[i].free = b->next;
+        cache[i].count--;
+    } else {
+        struct size_class *c = pool.classes + i;
+        pthread_mutex_lock(&c->mutex);
+        if(c->free != NULL) {
+            b       = c->free;
+            c->free = b->next;
+            c->count--;
+        }
+        pthread_mutex_unlock(&c->mutex);
+    }
+
+    return b != NULL ? (uint8_t *) b : malloc(size);
+}
+
+void
+bufpool_put(uint8_t *block, size_t size) {
+    const int i = size_class(size);
+    struct free_block *b = (struct free_block *) block;
+
+    if(block == NULL) {
+        // nada para hacer
+    } else if(i == -1) {
+        free(block);
+    } else if(cache[i].count < cache_limit(size)) {
+        b->next       = cache[i].free;
+        cache[i].free = b;
+        cache[i].count++;
+    } else {
+        shared_put(pool.classes + i, b, size);
+    }
+}
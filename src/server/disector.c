@@ -1,4 +1,7 @@
 #include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "../include/disector.h"
 
 #define TO_UPPER(c) ((c) >= 'a' ? (c) - ('a' - 'A') : (c))
@@ -47,17 +50,6 @@ user(const uint8_t c, struct disector_parser *p) {  // client request es case in
     return remaining_is_done(p, 1) ? disector_user_copy : disector_user;
 }
 
-// guarda el argumento de la keyword USER
-static enum disector_state
-user_copy(const uint8_t c, struct disector_parser *p) {
-    if (c == '\n') {
-        p->disector.user[p->i - 1] = 0; // reemplazamos el \r por 0 para imprimirlo luego
-        return disector_password;
-    }
-    p->disector.user[p->i++] = c;
-    return disector_user_copy;
-}
-
 // intenta matchear la keyword PASS
 static enum disector_state
 password(const uint8_t c, struct disector_parser *p) {
@@ -72,17 +64,6 @@ password(const uint8_t c, struct disector_parser *p) {
     return remaining_is_done(p, 2) ? disector_password_copy : disector_password;
 }
 
-// copia el argumento de la keyword PASS
-static enum disector_state
-password_copy(const uint8_t c, struct disector_parser *p) {
-    if (c == '\n') {
-        p->disector.pass[p->i - 1] = 0;
-        return disector_response;
-    }
-    p->disector.pass[p->i++] = c;
-    return disector_password_copy;
-}
-
 // intenta matchear una respuesta positiva al USER/PASS por parte del origin
 static enum disector_state
 response(const uint8_t c, struct disector_parser *p) {
@@ -106,18 +87,15 @@ disector_parser_feed(struct disector_parser *p, const uint8_t c) {
         case disector_user:
             next = user(c, p);
             break;
-        case disector_user_copy:
-            next = user_copy(c, p);
-            break;
         case disector_password:
             next = password(c, p);
             break;
-        case disector_password_copy:
-            next = password_copy(c, p);
-            break;
         case disector_response:
             next = response(c, p);
             break;
+        case disector_user_copy:
+        case disector_password_copy:
+            // los argumentos los copia arg_copy() de a líneas
         case disector_done:
         case disector_restart:
             // mantenemos el estado
@@ -133,17 +111,85 @@ disector_parser_feed(struct disector_parser *p, const uint8_t c) {
     return p->state = next;
 }
 
+/**
+ * busca el primer byte desde `ptr' que puede empezar la keyword USER (una U
+ * o una u); mientras se espera el comando cualquier otro byte solo reinicia
+ * el parser, así que se pueden saltear de a bloques. Retorna `end' si no hay.
+ */
+static const uint8_t *
+user_start(const uint8_t *ptr, const uint8_t *end) {
+#if defined(__SSE2__)
+    const __m128i lower = _mm_set1_epi8(0x20);
+    const __m128i u     = _mm_set1_epi8('u');
+
+    for (; end - ptr >= 16; ptr += 16) {
+        const __m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i *) ptr), lower);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, u)) != 0)
+            break; // el byte exacto lo encuentra el loop de abajo
+    }
+#endif
+    while (ptr < end && (*ptr | 0x20) != 'u')
+        ptr++;
+    return ptr;
+}
+
+/**
+ * copia en `dst' el argumento de USER o PASS hasta el fin de línea, de una
+ * vez en lugar de byte a byte. Lo que no entra en `dst' se descarta. Al
+ * llegar al \n termina el argumento (sin el \r) y pasa al estado `next'.
+ *
+ * @return el primer byte sin consumir
+ */
+static const uint8_t *
+arg_copy(struct disector_parser *p, char *dst, size_t size, enum disector_state next,
+         const uint8_t *ptr, const uint8_t *end) {
+    const uint8_t *nl  = memchr(ptr, '\n', end - ptr);
+    size_t len         = (nl == NULL ? end : nl) - ptr;
+    const size_t room  = size - 1 - p->i; // dejamos lugar para el 0 final
+
+    if (len > room)
+        len = room;
+    memcpy(dst + p->i, ptr, len);
+    p->i += len;
+    if (nl == NULL)
+        return end;
+
+    if (p->i > 0 && dst[p->i - 1] == '\r')
+        p->i--;
+    dst[p->i] = 0;
+    p->state  = next;
+    p->i      = 0;
+    return nl + 1;
+}
+
 extern enum disector_state
 disector_consume(struct disector_parser *p, uint8_t *ptr, size_t n) {
+    const uint8_t *c   = ptr;
+    const uint8_t *end = ptr + n;
     enum disector_state st = p->state;
 
-    for (size_t i = 0; i < n; i++) {
-        const uint8_t c = ptr[i];
-        st = disector_parser_feed(p, c);
+    while (c < end) {
+        switch (p->state) {
+            case disector_user:
+                if (p->i == 0 && (c = user_start(c, end)) == end)
+                    continue;
+                break;
+            case disector_user_copy:
+                c  = arg_copy(p, p->disector.user, sizeof(p->disector.user), disector_password, c, end);
+                st = p->state;
+                continue;
+            case disector_password_copy:
+                c  = arg_copy(p, p->disector.pass, sizeof(p->disector.pass), disector_response, c, end);
+                st = p->state;
+                continue;
+            default:
+                break;
+        }
+        st = disector_parser_feed(p, *c++);
         if (st == disector_restart)
             disector_parser_reset(p); // resetea y sigue sniffeando todo el contenido que manda el cliente, para no saltearse nada sin querer
-        else if (st == disector_incompatible)
-            break;
+        else if (st == disector_incompatible || st == disector_done)
+            break; // lo que sigue no cambia el resultado
     }
     return st;
 }
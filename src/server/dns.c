@@ -0,0 +1,1022 @@
+/**
+ * dns.c - resolver DNS stub no bloqueante, integrado al selector
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../include/dns.h"
+
+#define N(x) (sizeof(x)/sizeof((x)[0]))
+
+/** como MAXNS de resolv.h */
+#define DNS_MAX_NAMESERVERS     3
+/** valores por defecto de las options timeout (segundos) y attempts */
+#define DNS_DEFAULT_TIMEOUT     5
+#define DNS_DEFAULT_ATTEMPTS    2
+#define DNS_PORT                53
+
+/** no anunciamos EDNS0, por lo que las respuestas UDP no superan 512 bytes */
+#define DNS_UDP_SIZE            512
+#define DNS_HEADER_SIZE         12
+/** longitud máxima de un nombre en formato de etiquetas */
+#define DNS_MAX_NAME            255
+/** mensaje de una pregunta: header, nombre, tipo y clase */
+#define DNS_MAX_QUERY           (DNS_HEADER_SIZE + DNS_MAX_NAME + 4)
+/** cantidad de listas de la tabla de consultas por id, potencia de 2 */
+#define DNS_QUERY_BUCKETS       256
+/** consultas terminadas que cada cliente guarda para reusar */
+#define DNS_SPARE_QUERIES       256
+
+#define DNS_TYPE_A              1
+#define DNS_TYPE_CNAME          5
+#define DNS_TYPE_AAAA           28
+#define DNS_CLASS_IN            1
+
+#define DNS_FLAG_QR             0x8000
+#define DNS_FLAG_TC             0x0200
+#define DNS_FLAG_RD             0x0100
+#define DNS_RCODE(flags)        ((flags) & 0x000f)
+#define DNS_RCODE_NOERROR       0
+#define DNS_RCODE_NXDOMAIN      3
+
+struct dns_addr {
+    int family;
+    union {
+        struct in_addr  v4;
+        struct in6_addr v6;
+    } u;
+};
+
+struct dns_host {
+    char            name[DNS_MAX_NAME + 1];
+    struct dns_addr addr;
+};
+
+/** configuración leída por dns_init(), de solo lectura luego */
+static struct {
+    struct sockaddr_storage ns[DNS_MAX_NAMESERVERS];
+    socklen_t               ns_len[DNS_MAX_NAMESERVERS];
+    unsigned                nns;
+    /** espera de cada envío, en milisegundos */
+    unsigned                timeout;
+    /** rondas de envíos por cada nameserver */
+    unsigned                attempts;
+
+    struct dns_host        *hosts;
+    size_t                  nhosts;
+    size_t                  hosts_size;
+} conf = {
+    .timeout  = DNS_DEFAULT_TIMEOUT * 1000,
+    .attempts = DNS_DEFAULT_ATTEMPTS,
+};
+
+/** pregunta de una consulta (A o AAAA) */
+struct dns_question {
+    uint16_t type;
+    /** ya tiene una respuesta definitiva o se agotaron los reintentos */
+    bool     done;
+    /** en esta ronda se reenvió por TCP porque la respuesta llegó truncada */
+    bool     tcp;
+};
+
+struct dns_query {
+    struct dns_client  *client;
+    uint16_t            id;
+    /** nombre en formato de etiquetas y en minúsculas */
+    uint8_t             qname[DNS_MAX_NAME];
+    size_t              qname_len;
+    uint16_t            port;
+
+    dns_callback        cb;
+    void               *data;
+
+    struct dns_question questions[2];
+    /** preguntas respondidas con NOERROR o NXDOMAIN */
+    unsigned            answered;
+    bool                nxdomain;
+
+    /** rondas de envío realizadas y nameserver de la ronda actual */
+    unsigned            round;
+    unsigned            server;
+    /**
+     * socket UDP de la ronda, conectado a conf.ns[server]. Cada ronda usa uno
+     * nuevo para que el puerto de origen sea otro efímero al azar y no
+     * alcance con adivinar el id de 16 bits para inyectar una respuesta.
+     * Lleva también el timeout de la ronda, que sigue corriendo si alguna
+     * pregunta se reenvía por TCP.
+     */
+    int                 udp_fd;
+
+    struct dns_addr     addrs[DNS_MAX_ADDRS];
+    unsigned            naddrs;
+    uint32_t            ttl;
+
+    /** reintento por TCP de las respuestas truncadas */
+    int                 tcp_fd;
+    uint8_t             tcp_out[2 * (2 + DNS_MAX_QUERY)];
+    size_t              tcp_out_len;
+    uint8_t            *tcp_in;
+    size_t              tcp_in_len;
+
+    /** siguiente en la lista de la tabla por id */
+    struct dns_query   *bucket_next;
+    /** siguiente entre las consultas para reusar */
+    struct dns_query   *next;
+};
+
+/** cliente de un selector */
+struct dns_client {
+    fd_selector         s;
+    /**
+     * eventfd que nunca se activa. El selector no avisa que se destruye más
+     * que desregistrando sus fds, y los de las consultas van y vienen: al
+     * desregistrar este se liberan el cliente y sus consultas.
+     */
+    int                 close_fd;
+    uint32_t            rand;
+
+    /** consultas en curso, por id */
+    struct dns_query   *buckets[DNS_QUERY_BUCKETS];
+    /** consultas terminadas para reusar, enlazadas por `next' */
+    struct dns_query   *spare;
+    unsigned            nspare;
+
+    uint8_t             buf[DNS_UDP_SIZE];
+};
+
+/** el cliente del selector que atiende este hilo */
+static _Thread_local struct dns_client *client;
+
+static uint8_t
+lower(const uint8_t c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static uint16_t
+rd16(const uint8_t *p) {
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t
+rd32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void
+wr16(uint8_t *p, const uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CONFIGURACIÓN
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+nameserver_add(const char *s) {
+    if(conf.nns >= DNS_MAX_NAMESERVERS) {
+        return;
+    }
+    struct sockaddr_storage *ss = conf.ns + conf.nns;
+    memset(ss, 0, sizeof(*ss));
+
+    struct sockaddr_in  *in  = (struct sockaddr_in *)  ss;
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) ss;
+    if(inet_pton(AF_INET, s, &in->sin_addr) == 1) {
+        in->sin_family         = AF_INET;
+        in->sin_port           = htons(DNS_PORT);
+        conf.ns_len[conf.nns]  = sizeof(*in);
+    } else if(inet_pton(AF_INET6, s, &in6->sin6_addr) == 1) {
+        in6->sin6_family       = AF_INET6;
+        in6->sin6_port         = htons(DNS_PORT);
+        conf.ns_len[conf.nns]  = sizeof(*in6);
+    } else {
+        return; // p.e. direcciones con scope (fe80::1%eth0)
+    }
+    conf.nns++;
+}
+
+/** interpreta el valor de `option:n' si está en [min, max] */
+static void
+option_value(const char *s, unsigned *value, const long min, const long max) {
+    char *end;
+    const long n = strtol(s, &end, 10);
+    if(end != s && *end == 0 && n >= min && n <= max) {
+        *value = (unsigned)n;
+    }
+}
+
+static void
+parse_resolv_conf(const char *path) {
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        return;
+    }
+    char line[512];
+    while(fgets(line, sizeof(line), f) != NULL) {
+        char *save;
+        const char *key = strtok_r(line, " \t\r\n", &save);
+        if(key == NULL || *key == '#' || *key == ';') {
+            continue;
+        }
+        if(strcmp(key, "nameserver") == 0) {
+            const char *value = strtok_r(NULL, " \t\r\n", &save);
+            if(value != NULL) {
+                nameserver_add(value);
+            }
+        } else if(strcmp(key, "options") == 0) {
+            for(const char *o; (o = strtok_r(NULL, " \t\r\n", &save)) != NULL; ) {
+                if(strncmp(o, "timeout:", 8) == 0) {
+                    unsigned timeout = conf.timeout / 1000;
+                    option_value(o + 8, &timeout, 1, 30);
+                    conf.timeout = timeout * 1000;
+                } else if(strncmp(o, "attempts:", 9) == 0) {
+                    option_value(o + 9, &conf.attempts, 1, 5);
+                }
+            }
+        }
+    }
+    fclose(f);
+}
+
+static void
+host_add(const char *name, const struct dns_addr *addr) {
+    const size_t len = strlen(name);
+    if(len == 0 || len > DNS_MAX_NAME) {
+        return;
+    }
+    if(conf.nhosts == conf.hosts_size) {
+        const size_t size = conf.hosts_size == 0 ? 16 : conf.hosts_size * 2;
+        struct dns_host *tmp = realloc(conf.hosts, size * sizeof(*tmp));
+        if(tmp == NULL) {
+            return;
+        }
+        conf.hosts      = tmp;
+        conf.hosts_size = size;
+    }
+    struct dns_host *h = conf.hosts + conf.nhosts++;
+    for(size_t i = 0; i <= len; i++) {
+        h->name[i] = lower(name[i]);
+    }
+    h->addr = *addr;
+}
+
+static void
+parse_hosts(const char *path) {
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        return;
+    }
+    char line[1024];
+    while(fgets(line, sizeof(line), f) != NULL) {
+        char *comment = strchr(line, '#');
+        if(comment != NULL) {
+            *comment = 0;
+        }
+        char *save;
+        const char *ip = strtok_r(line, " \t\r\n", &save);
+        if(ip == NULL) {
+            continue;
+        }
+        struct dns_addr addr;
+        memset(&addr, 0, sizeof(addr));
+        if(inet_pton(AF_INET, ip, &addr.u.v4) == 1) {
+            addr.family = AF_INET;
+        } else if(inet_pton(AF_INET6, ip, &addr.u.v6) == 1) {
+            addr.family = AF_INET6;
+        } else {
+            continue;
+        }
+        for(const char *name; (name = strtok_r(NULL, " \t\r\n", &save)) != NULL; ) {
+            host_add(name, &addr);
+        }
+    }
+    fclose(f);
+}
+
+unsigned
+dns_init(void) {
+    parse_resolv_conf(DNS_RESOLV_CONF);
+    parse_hosts(DNS_HOSTS);
+    return conf.nns;
+}
+
+void
+dns_destroy(void) {
+    free(conf.hosts);
+    conf.hosts      = NULL;
+    conf.nhosts     = 0;
+    conf.hosts_size = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// RESULTADOS
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+addrs_add(struct dns_addr *addrs, unsigned *n, const int family, const void *raw) {
+    const size_t len = family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+    if(*n >= DNS_MAX_ADDRS) {
+        return;
+    }
+    for(unsigned i = 0; i < *n; i++) {
+        if(addrs[i].family == family && memcmp(&addrs[i].u, raw, len) == 0) {
+            return;
+        }
+    }
+    addrs[*n].family = family;
+    memcpy(&addrs[*n].u, raw, len);
+    (*n)++;
+}
+
+/**
+ * arma el resultado con las direcciones listas para connect(), primero las
+ * IPv4 y luego las IPv6, tal como las recorre request_connecting.
+ */
+static void
+result_fill(struct dns_result *res, const struct dns_addr *addrs, const unsigned n,
+            const uint16_t port) {
+    // IPv6 primero, como prefiere Happy Eyeballs (RFC 8305 sección 4)
+    static const int families[] = { AF_INET6, AF_INET };
+
+    res->n = 0;
+    for(unsigned f = 0; f < N(families); f++) {
+        for(unsigned i = 0; i < n; i++) {
+            if(addrs[i].family != families[f]) {
+                continue;
+            }
+            struct dns_result_addr *a = res->addrs + res->n++;
+            memset(&a->u, 0, sizeof(a->u));
+            if(families[f] == AF_INET) {
+                a->u.in.sin_family   = AF_INET;
+                a->u.in.sin_port     = htons(port);
+                a->u.in.sin_addr     = addrs[i].u.v4;
+                a->len               = sizeof(a->u.in);
+            } else {
+                a->u.in6.sin6_family = AF_INET6;
+                a->u.in6.sin6_port   = htons(port);
+                a->u.in6.sin6_addr   = addrs[i].u.v6;
+                a->len               = sizeof(a->u.in6);
+            }
+        }
+    }
+}
+
+int
+dns_hosts_lookup(const char *name, uint16_t port, struct dns_result *res) {
+    struct dns_addr addrs[DNS_MAX_ADDRS];
+    unsigned n = 0;
+
+    for(size_t i = 0; i < conf.nhosts; i++) {
+        if(strcasecmp(conf.hosts[i].name, name) == 0) {
+            addrs_add(addrs, &n, conf.hosts[i].addr.family, &conf.hosts[i].addr.u);
+        }
+    }
+    if(n == 0) {
+        return -1;
+    }
+    result_fill(res, addrs, n, port);
+    return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MENSAJES
+////////////////////////////////////////////////////////////////////////////////
+
+/** codifica `name' en formato de etiquetas. Retorna su longitud o -1 */
+static int
+encode_name(const char *name, uint8_t *out) {
+    size_t n = 0;
+    while(*name) {
+        const char *dot = strchr(name, '.');
+        const size_t l  = dot == NULL ? strlen(name) : (size_t)(dot - name);
+        if(l == 0 || l > 63 || n + l + 2 > DNS_MAX_NAME) {
+            return -1;
+        }
+        out[n++] = (uint8_t)l;
+        for(size_t i = 0; i < l; i++) {
+            out[n++] = lower(name[i]);
+        }
+        name += l;
+        if(*name == '.') {
+            name++;
+        }
+    }
+    if(n == 0) {
+        return -1;
+    }
+    out[n++] = 0;
+    return (int)n;
+}
+
+/**
+ * lee el nombre que empieza en `*off' siguiendo los punteros de compresión y
+ * lo deja en `out' en formato de etiquetas y en minúsculas. Avanza `*off'
+ * hasta después del nombre. Retorna su longitud o -1 si está mal formado.
+ */
+static int
+read_name(const uint8_t *msg, const size_t len, size_t *off, uint8_t *out) {
+    size_t   p      = *off;
+    size_t   n      = 0;
+    unsigned jumps  = 0;
+    bool     jumped = false;
+
+    while(true) {
+        if(p >= len) {
+            return -1;
+        }
+        const uint8_t l = msg[p];
+        if((l & 0xc0) == 0xc0) {
+            if(p + 1 >= len || ++jumps > 16) {
+                return -1;
+            }
+            if(!jumped) {
+                *off   = p + 2;
+                jumped = true;
+            }
+            p = (size_t)(l & 0x3f) << 8 | msg[p + 1];
+        } else if(l & 0xc0) {
+            return -1;
+        } else if(n + l + 1 > DNS_MAX_NAME || p + 1 + l > len) {
+            return -1;
+        } else {
+            out[n++] = l;
+            if(l == 0) {
+                if(!jumped) {
+                    *off = p + 1;
+                }
+                return (int)n;
+            }
+            for(size_t i = 0; i < l; i++) {
+                out[n++] = lower(msg[p + 1 + i]);
+            }
+            p += l + 1;
+        }
+    }
+}
+
+/** arma en `out' la pregunta de tipo `type'. Retorna su longitud */
+static size_t
+build_query(const struct dns_query *q, const uint16_t type, uint8_t *out) {
+    memset(out, 0, DNS_HEADER_SIZE);
+    wr16(out,     q->id);
+    wr16(out + 2, DNS_FLAG_RD);
+    wr16(out + 4, 1);
+    memcpy(out + DNS_HEADER_SIZE, q->qname, q->qname_len);
+    size_t n = DNS_HEADER_SIZE + q->qname_len;
+    wr16(out + n,     type);
+    wr16(out + n + 2, DNS_CLASS_IN);
+    return n + 4;
+}
+
+/** si `from' es el nameserver `i' de la configuración */
+static bool
+nameserver_is(const unsigned i, const struct sockaddr_storage *from) {
+    const struct sockaddr_storage *ns = conf.ns + i;
+    if(ns->ss_family != from->ss_family) {
+        return false;
+    }
+    if(ns->ss_family == AF_INET) {
+        const struct sockaddr_in *a = (const struct sockaddr_in *) ns;
+        const struct sockaddr_in *b = (const struct sockaddr_in *) from;
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+    const struct sockaddr_in6 *a = (const struct sockaddr_in6 *) ns;
+    const struct sockaddr_in6 *b = (const struct sockaddr_in6 *) from;
+    return a->sin6_port == b->sin6_port
+        && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CONSULTAS
+////////////////////////////////////////////////////////////////////////////////
+
+static void dns_udp_read   (struct selector_key *key);
+static void dns_udp_timeout(struct selector_key *key);
+static void dns_udp_close  (struct selector_key *key);
+static void dns_client_close(struct selector_key *key);
+static void dns_tcp_read   (struct selector_key *key);
+static void dns_tcp_write  (struct selector_key *key);
+static void dns_tcp_close  (struct selector_key *key);
+
+static const struct fd_handler udp_handler = {
+    .handle_read    = dns_udp_read,
+    .handle_timeout = dns_udp_timeout,
+    .handle_close   = dns_udp_close,
+};
+
+static const struct fd_handler client_handler = {
+    .handle_close   = dns_client_close,
+};
+
+static const struct fd_handler tcp_handler = {
+    .handle_read    = dns_tcp_read,
+    .handle_write   = dns_tcp_write,
+    .handle_close   = dns_tcp_close,
+};
+
+static struct dns_query *
+query_find(struct dns_client *c, const uint16_t id) {
+    struct dns_query *q = c->buckets[id & (DNS_QUERY_BUCKETS - 1)];
+    while(q != NULL && q->id != id) {
+        q = q->bucket_next;
+    }
+    return q;
+}
+
+/** id al azar que no esté en uso (xorshift32) */
+static uint16_t
+query_new_id(struct dns_client *c) {
+    uint16_t id;
+    do {
+        uint32_t x = c->rand;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        c->rand = x;
+        id = (uint16_t)(x >> 16);
+    } while(query_find(c, id) != NULL);
+    return id;
+}
+
+static void
+query_tcp_close(struct dns_query *q) {
+    for(unsigned i = 0; i < N(q->questions); i++) {
+        q->questions[i].tcp = false;
+    }
+    if(q->tcp_fd != -1) {
+        selector_unregister_fd(q->client->s, q->tcp_fd);
+        q->tcp_fd      = -1;
+        q->tcp_out_len = 0;
+        q->tcp_in_len  = 0;
+    }
+}
+
+static void
+query_udp_close(struct dns_query *q) {
+    if(q->udp_fd != -1) {
+        selector_unregister_fd(q->client->s, q->udp_fd);
+        q->udp_fd = -1;
+    }
+}
+
+/**
+ * abre el socket UDP de la ronda conectado al nameserver `q->server'. Al
+ * estar conectado el kernel descarta los datagramas de cualquier otra
+ * dirección. Retorna -1 si no se pudo.
+ */
+static int
+query_udp_open(struct dns_query *q) {
+    const struct sockaddr_storage *ns = conf.ns + q->server;
+    const int fd = socket(ns->ss_family, SOCK_DGRAM, IPPROTO_UDP);
+    if(fd == -1) {
+        return -1;
+    }
+    if(selector_fd_set_nio(fd) == -1
+       || connect(fd, (const struct sockaddr *)ns, conf.ns_len[q->server]) == -1
+       || SELECTOR_SUCCESS != selector_register(q->client->s, fd, &udp_handler, OP_READ, q)) {
+        close(fd);
+        return -1;
+    }
+    q->udp_fd = fd;
+    return 0;
+}
+
+static void
+query_free(struct dns_query *q) {
+    free(q->tcp_in);
+    free(q);
+}
+
+/** una consulta en cero, reusando una terminada si el cliente tiene */
+static struct dns_query *
+query_get(struct dns_client *c) {
+    struct dns_query *q = c->spare;
+    if(q == NULL) {
+        return calloc(1, sizeof(*q));
+    }
+    c->spare = q->next;
+    c->nspare--;
+    memset(q, 0, sizeof(*q));
+    return q;
+}
+
+/**
+ * devuelve una consulta terminada al cliente para no alocar una por nombre.
+ * El buffer del reintento por TCP (64KiB, y raro) no se guarda.
+ */
+static void
+query_put(struct dns_client *c, struct dns_query *q) {
+    free(q->tcp_in);
+    q->tcp_in = NULL;
+    if(c->nspare >= DNS_SPARE_QUERIES) {
+        free(q);
+        return;
+    }
+    q->next  = c->spare;
+    c->spare = q;
+    c->nspare++;
+}
+
+/** saca la consulta del cliente e informa el resultado */
+static void
+query_finish(struct dns_query *q) {
+    struct dns_client  *c = q->client;
+    struct dns_query  **p = c->buckets + (q->id & (DNS_QUERY_BUCKETS - 1));
+    for(; *p != q; p = &(*p)->bucket_next)
+        ;
+    *p = q->bucket_next;
+    query_udp_close(q);
+    query_tcp_close(q);
+
+    struct dns_result res;
+    int err;
+    if(q->naddrs > 0) {
+        result_fill(&res, q->addrs, q->naddrs, q->port);
+        err = 0;
+    } else if(q->nxdomain || q->answered == N(q->questions)) {
+        err = EAI_NONAME;
+    } else {
+        err = EAI_AGAIN;
+    }
+    q->cb(c->s, q->data, err, err == 0 ? &res : NULL, q->ttl);
+    query_put(c, q);
+}
+
+/**
+ * envía por UDP las preguntas pendientes desde un socket nuevo, que lleva el
+ * timeout de la ronda; las respuestas tardías de la ronda anterior se
+ * descartan con su socket. Retorna cuántas se enviaron.
+ */
+static unsigned
+query_send(struct dns_query *q) {
+    uint8_t msg[DNS_MAX_QUERY];
+    unsigned ret = 0;
+
+    query_udp_close(q);
+    const bool opened = query_udp_open(q) == 0;
+    for(unsigned i = 0; opened && i < N(q->questions); i++) {
+        if(q->questions[i].done) {
+            continue;
+        }
+        const size_t n = build_query(q, q->questions[i].type, msg);
+        if(send(q->udp_fd, msg, n, MSG_NOSIGNAL) != -1) {
+            ret++;
+        }
+    }
+    if(ret > 0) {
+        selector_set_timeout(q->client->s, q->udp_fd, conf.timeout);
+    }
+    return ret;
+}
+
+/**
+ * pasa a la siguiente ronda: próximo nameserver y nuevos envíos por UDP. Si
+ * no se pudo enviar nada no hay timeout que esperar y se pasa a la otra. Al
+ * agotar las rondas informa lo que se haya obtenido.
+ */
+static void
+query_retry(struct dns_query *q) {
+    query_tcp_close(q);
+    do {
+        q->round++;
+        if(q->round >= conf.attempts * conf.nns) {
+            query_finish(q);
+            return;
+        }
+        q->server = q->round % conf.nns;
+    } while(query_send(q) == 0);
+}
+
+/** reenvía la pregunta `i' por TCP. Retorna -1 si no se pudo */
+static int
+query_tcp(struct dns_query *q, const unsigned i) {
+    struct dns_client *c = q->client;
+
+    if(q->tcp_in == NULL && (q->tcp_in = malloc(2 + 0xffff)) == NULL) {
+        return -1;
+    }
+    if(q->tcp_fd == -1) {
+        const struct sockaddr_storage *ns = conf.ns + q->server;
+        const int fd = socket(ns->ss_family, SOCK_STREAM, IPPROTO_TCP);
+        if(fd == -1) {
+            return -1;
+        }
+        if(selector_fd_set_nio(fd) == -1
+           || (connect(fd, (const struct sockaddr *)ns, conf.ns_len[q->server]) == -1
+               && errno != EINPROGRESS)
+           || SELECTOR_SUCCESS != selector_register(c->s, fd, &tcp_handler, OP_WRITE, q)) {
+            close(fd);
+            return -1;
+        }
+        q->tcp_fd = fd;
+    }
+    uint8_t *out = q->tcp_out + q->tcp_out_len;
+    const size_t n = build_query(q, q->questions[i].type, out + 2);
+    wr16(out, (uint16_t)n);
+    q->tcp_out_len += n + 2;
+    q->questions[i].tcp = true;
+    selector_set_interest(c->s, q->tcp_fd, OP_READ | OP_WRITE);
+    return 0;
+}
+
+/** toma las direcciones de la respuesta siguiendo la cadena de CNAMEs */
+static void
+query_answers(struct dns_query *q, const uint8_t *msg, const size_t len,
+              size_t off, const uint16_t qtype) {
+    uint8_t name[DNS_MAX_NAME], owner[DNS_MAX_NAME];
+    size_t  name_len = q->qname_len;
+    memcpy(name, q->qname, name_len);
+
+    for(unsigned i = rd16(msg + 6); i > 0; i--) {
+        const int n = read_name(msg, len, &off, owner);
+        if(n < 0 || off + 10 > len) {
+            break;
+        }
+        const uint16_t type  = rd16(msg + off);
+        const uint16_t class = rd16(msg + off + 2);
+        const uint32_t ttl   = rd32(msg + off + 4);
+        const uint16_t rdlen = rd16(msg + off + 8);
+        off += 10;
+        if(off + rdlen > len) {
+            break;
+        }
+        if(class == DNS_CLASS_IN && (size_t)n == name_len && memcmp(owner, name, name_len) == 0) {
+            bool used = true;
+            if(type == DNS_TYPE_CNAME) {
+                size_t rdoff = off;
+                const int m  = read_name(msg, len, &rdoff, owner);
+                if(m < 0) {
+                    break;
+                }
+                memcpy(name, owner, m);
+                name_len = (size_t)m;
+            } else if(type == qtype && type == DNS_TYPE_A && rdlen == sizeof(struct in_addr)) {
+                addrs_add(q->addrs, &q->naddrs, AF_INET, msg + off);
+            } else if(type == qtype && type == DNS_TYPE_AAAA && rdlen == sizeof(struct in6_addr)) {
+                addrs_add(q->addrs, &q->naddrs, AF_INET6, msg + off);
+            } else {
+                used = false;
+            }
+            if(used && ttl < q->ttl) {
+                q->ttl = ttl;
+            }
+        }
+        off += rdlen;
+    }
+}
+
+/** procesa una respuesta (UDP o TCP) cuyo id corresponde a la consulta */
+static void
+query_response(struct dns_query *q, const uint8_t *msg, const size_t len, const bool tcp) {
+    const uint16_t flags = rd16(msg + 2);
+    uint8_t name[DNS_MAX_NAME];
+    size_t  off = DNS_HEADER_SIZE;
+
+    if(!(flags & DNS_FLAG_QR) || rd16(msg + 4) != 1) {
+        return;
+    }
+    const int n = read_name(msg, len, &off, name);
+    if(n < 0 || (size_t)n != q->qname_len || memcmp(name, q->qname, n) != 0
+       || off + 4 > len || rd16(msg + off + 2) != DNS_CLASS_IN) {
+        return;
+    }
+    const uint16_t qtype = rd16(msg + off);
+    off += 4;
+
+    unsigned i;
+    for(i = 0; i < N(q->questions); i++) {
+        if(q->questions[i].type == qtype && !q->questions[i].done) {
+            break;
+        }
+    }
+    if(i == N(q->questions) || (q->questions[i].tcp && !tcp)) {
+        return; // duplicada o tardía
+    }
+    // si no se puede reintentar por TCP, nos quedamos con lo que haya llegado
+    if((flags & DNS_FLAG_TC) && !tcp && query_tcp(q, i) == 0) {
+        return;
+    }
+
+    const unsigned rcode = DNS_RCODE(flags);
+    if(rcode == DNS_RCODE_NOERROR || rcode == DNS_RCODE_NXDOMAIN) {
+        q->nxdomain |= rcode == DNS_RCODE_NXDOMAIN;
+        query_answers(q, msg, len, off, qtype);
+        q->answered++;
+    } else if(q->round + 1 < conf.attempts * conf.nns) {
+        // SERVFAIL, REFUSED, ...: probamos con el siguiente nameserver
+        query_retry(q);
+        return;
+    }
+    q->questions[i].done = true;
+
+    // NXDOMAIN vale para ambos tipos, no hace falta esperar la otra respuesta
+    if(q->nxdomain || (q->questions[0].done && q->questions[1].done)) {
+        query_finish(q);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CLIENTE
+////////////////////////////////////////////////////////////////////////////////
+
+static void
+client_free(struct dns_client *c) {
+    // los sockets UDP y TCP siguen registrados y se cierran con su handle_close
+    for(unsigned i = 0; i < DNS_QUERY_BUCKETS; i++) {
+        for(struct dns_query *q = c->buckets[i], *next; q != NULL; q = next) {
+            next = q->bucket_next;
+            query_free(q);
+        }
+    }
+    for(struct dns_query *q = c->spare, *next; q != NULL; q = next) {
+        next = q->next;
+        query_free(q);
+    }
+    if(client == c) {
+        client = NULL;
+    }
+    free(c);
+}
+
+static uint32_t
+random_seed(void) {
+    uint32_t seed = 0;
+    FILE *f = fopen("/dev/urandom", "r");
+    if(f != NULL) {
+        if(fread(&seed, sizeof(seed), 1, f) != 1) {
+            seed = 0;
+        }
+        fclose(f);
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    seed ^= (uint32_t)ts.tv_nsec ^ (uint32_t)ts.tv_sec;
+    return seed == 0 ? 0x9e3779b9u : seed;
+}
+
+/** el cliente del selector `s', que se crea con la primera consulta */
+static struct dns_client *
+client_get(fd_selector s) {
+    if(client != NULL) {
+        return client->s == s ? client : NULL;
+    }
+    struct dns_client *c = calloc(1, sizeof(*c));
+    if(c == NULL) {
+        return NULL;
+    }
+    c->s        = s;
+    c->rand     = random_seed();
+    c->close_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(c->close_fd == -1) {
+        free(c);
+        return NULL;
+    }
+    if(SELECTOR_SUCCESS != selector_register(s, c->close_fd, &client_handler, OP_NOOP, c)) {
+        close(c->close_fd);
+        free(c);
+        return NULL;
+    }
+    client = c;
+    return c;
+}
+
+int
+dns_lookup(fd_selector s, const char *name, uint16_t port,
+           dns_callback cb, void *data) {
+    // sin dominios de búsqueda, los nombres sin puntos los resuelve el sistema
+    if(conf.nns == 0 || strchr(name, '.') == NULL) {
+        return -1;
+    }
+    struct dns_client *c = client_get(s);
+    if(c == NULL) {
+        return -1;
+    }
+    struct dns_query *q = query_get(c);
+    if(q == NULL) {
+        return -1;
+    }
+    const int len = encode_name(name, q->qname);
+    if(len < 0) {
+        query_put(c, q);
+        return -1;
+    }
+    q->qname_len = (size_t)len;
+    q->client    = c;
+    q->port      = port;
+    q->cb        = cb;
+    q->data      = data;
+    q->ttl       = UINT32_MAX;
+    q->udp_fd    = -1;
+    q->tcp_fd    = -1;
+    q->questions[0].type = DNS_TYPE_A;
+    q->questions[1].type = DNS_TYPE_AAAA;
+
+    q->id = query_new_id(c);
+    struct dns_query **bucket = c->buckets + (q->id & (DNS_QUERY_BUCKETS - 1));
+
+    if(query_send(q) == 0) {
+        query_udp_close(q);
+        query_put(c, q);
+        return -1;
+    }
+    q->bucket_next = *bucket;
+    *bucket        = q;
+    return 0;
+}
+
+/**
+ * lee un datagrama del socket de la consulta. Se lee de a uno porque la
+ * respuesta puede terminar la consulta y cerrar el socket; si quedan más,
+ * el selector vuelve a avisar.
+ */
+static void
+dns_udp_read(struct selector_key *key) {
+    struct dns_query  *q = key->data;
+    struct dns_client *c = q->client;
+    struct sockaddr_storage from;
+    socklen_t from_len = sizeof(from);
+
+    const ssize_t n = recvfrom(key->fd, c->buf, sizeof(c->buf), 0,
+                               (struct sockaddr *)&from, &from_len);
+    // el socket está conectado, pero no está de más confirmar el origen
+    if(n >= DNS_HEADER_SIZE && nameserver_is(q->server, &from)
+       && rd16(c->buf) == q->id) {
+        query_response(q, c->buf, (size_t)n, false);
+    }
+}
+
+/** venció la ronda sin que lleguen todas las respuestas */
+static void
+dns_udp_timeout(struct selector_key *key) {
+    query_retry(key->data);
+}
+
+static void
+dns_udp_close(struct selector_key *key) {
+    close(key->fd);
+}
+
+static void
+dns_client_close(struct selector_key *key) {
+    close(key->fd);
+    client_free(key->data);
+}
+
+static void
+dns_tcp_write(struct selector_key *key) {
+    struct dns_query *q = key->data;
+
+    const ssize_t n = send(key->fd, q->tcp_out, q->tcp_out_len, MSG_NOSIGNAL);
+    if(n == -1) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            query_retry(q);
+        }
+        return;
+    }
+    q->tcp_out_len -= (size_t)n;
+    memmove(q->tcp_out, q->tcp_out + n, q->tcp_out_len);
+    if(q->tcp_out_len == 0) {
+        selector_set_interest_key(key, OP_READ);
+    }
+}
+
+static void
+dns_tcp_read(struct selector_key *key) {
+    struct dns_query *q = key->data;
+
+    // primero los dos bytes de longitud y luego el mensaje
+    const size_t need = q->tcp_in_len < 2 ? 2 : 2 + (size_t)rd16(q->tcp_in);
+    const ssize_t n = recv(key->fd, q->tcp_in + q->tcp_in_len, need - q->tcp_in_len, 0);
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+    if(n <= 0) {
+        query_retry(q);
+    } else {
+        q->tcp_in_len += (size_t)n;
+        if(q->tcp_in_len >= 2 && q->tcp_in_len == 2 + (size_t)rd16(q->tcp_in)) {
+            const size_t len = q->tcp_in_len - 2;
+            q->tcp_in_len = 0;
+            if(len >= DNS_HEADER_SIZE && rd16(q->tcp_in + 2) == q->id) {
+                query_response(q, q->tcp_in + 2, len, true);
+            }
+        }
+    }
+}
+
+static void
+dns_tcp_close(struct selector_key *key) {
+    close(key->fd);
+}
@@ -0,0 +1,434 @@
+/**
+ * dnscache.c - cache de resoluciones de nombres con TTL y coalescencia
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "../include/dnscache.h"
+#include "../include/resolver.h"
+#include "../include/dns.h"
+
+/** cantidad de listas de la tabla de hash, potencia de 2 */
+#define DNSCACHE_BUCKETS 1024
+/** entradas descartadas que se guardan para reusar */
+#define DNSCACHE_SPARE_ENTRIES 256
+
+struct dnscache_entry {
+    char                    name[0xff + 1];
+    uint16_t                port;
+    uint32_t                hash;
+
+    /** la resolución terminó, y si `ok' `res' tiene al menos una dirección */
+    bool                    resolved;
+    bool                    ok;
+    struct dns_result       res;
+    /** momento (monotónico, en segundos) en el que deja de ser válida */
+    time_t                  expires;
+
+    /** referencias: la tabla, la resolución en curso y cada conexión */
+    unsigned                refs;
+    bool                    linked;
+
+    /** conexiones esperando la resolución */
+    struct dnscache_waiter *waiters;
+    /** siguiente en la lista de la tabla */
+    struct dnscache_entry  *next;
+};
+
+static struct {
+    pthread_mutex_t        mutex;
+    struct dnscache_entry *buckets[DNSCACHE_BUCKETS];
+    unsigned               count;
+    /** desde qué lista se desalojan entradas cuando la tabla está llena */
+    unsigned               evict_cursor;
+    /** entradas descartadas para reusar, enlazadas por `next' */
+    struct dnscache_entry *spare;
+    unsigned               nspare;
+
+    unsigned               ttl;
+    unsigned               negative_ttl;
+    bool                   native;
+} cache = {
+    .mutex        = PTHREAD_MUTEX_INITIALIZER,
+    .ttl          = DEFAULT_DNSCACHE_TTL,
+    .negative_ttl = DEFAULT_DNSCACHE_NEGATIVE_TTL,
+};
+
+static time_t
+now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static char
+lower(const char c) {
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/** FNV-1a del nombre (sin distinguir mayúsculas) y el puerto */
+static uint32_t
+hash(const char *name, const uint16_t port) {
+    uint32_t h = 2166136261u;
+    for(; *name; name++) {
+        h = (h ^ (uint8_t) lower(*name)) * 16777619u;
+    }
+    h = (h ^ (port >> 8))   * 16777619u;
+    h = (h ^ (port & 0xff)) * 16777619u;
+    return h;
+}
+
+static bool
+matches(const struct dnscache_entry *e, const uint32_t h, const char *name,
+        const uint16_t port) {
+    if(e->hash != h || e->port != port) {
+        return false;
+    }
+    const char *a = e->name;
+    for(; *a && lower(*name) == *a; a++, name++)
+        ;
+    return *a == 0 && *name == 0;
+}
+
+/** una entrada en cero, reusando una descartada si hay. Con el lock */
+static struct dnscache_entry *
+entry_new(void) {
+    struct dnscache_entry *e = cache.spare;
+    if(e == NULL) {
+        return calloc(1, sizeof(*e));
+    }
+    cache.spare = e->next;
+    cache.nspare--;
+    memset(e, 0, sizeof(*e));
+    return e;
+}
+
+/** descarta una entrada sin referencias. Con el lock */
+static void
+entry_free(struct dnscache_entry *e) {
+    if(cache.nspare >= DNSCACHE_SPARE_ENTRIES) {
+        free(e);
+        return;
+    }
+    e->next     = cache.spare;
+    cache.spare = e;
+    cache.nspare++;
+}
+
+static void
+entry_unref(struct dnscache_entry *e) {
+    if(--e->refs == 0) {
+        entry_free(e);
+    }
+}
+
+static void
+entry_unlink(struct dnscache_entry *e) {
+    struct dnscache_entry **p = cache.buckets + (e->hash & (DNSCACHE_BUCKETS - 1));
+    for(; *p != e; p = &(*p)->next)
+        ;
+    *p        = e->next;
+    e->next   = NULL;
+    e->linked = false;
+    cache.count--;
+    entry_unref(e);
+}
+
+/**
+ * hace lugar en la tabla: primero descarta todo lo vencido y si no alcanza
+ * desaloja entradas resueltas. Las que se están resolviendo se mantienen.
+ */
+static void
+make_room(const time_t t) {
+    for(unsigned i = 0; i < DNSCACHE_BUCKETS; i++) {
+        for(struct dnscache_entry *e = cache.buckets[i], *next; e != NULL; e = next) {
+            next = e->next;
+            if(e->resolved && e->expires <= t) {
+                entry_unlink(e);
+            }
+        }
+    }
+    for(unsigned n = 0; n < DNSCACHE_BUCKETS && cache.count >= DNSCACHE_MAX_ENTRIES; n++) {
+        const unsigned i   = cache.evict_cursor;
+        cache.evict_cursor = (i + 1) & (DNSCACHE_BUCKETS - 1);
+        for(struct dnscache_entry *e = cache.buckets[i], *next; e != NULL; e = next) {
+            next = e->next;
+            if(e->resolved) {
+                entry_unlink(e);
+            }
+        }
+    }
+}
+
+/** EJECUTADA POR UN HILO DEL POOL DE RESOLVERS */
+static void
+entry_resolve(void *data) {
+    struct dnscache_entry *e = data;
+    struct addrinfo hints = {
+        .ai_family      = AF_UNSPEC,    // allow IPv4 or IPv6
+        .ai_socktype    = SOCK_STREAM,  // datagram socket
+        .ai_flags       = AI_PASSIVE,   // for wildcard IP address
+        .ai_protocol    = 0,            // any protocol
+        .ai_canonname   = NULL,
+        .ai_addr        = NULL,
+        .ai_next        = NULL,
+    };
+    struct addrinfo *res = NULL;
+    struct dns_result result = { .n = 0 };
+
+    // sin servicio: el puerto se completa al copiar las direcciones
+    int err = getaddrinfo(e->name, NULL, &hints, &res);
+    if(err == 0) {
+        for(const struct addrinfo *ai = res; ai != NULL && result.n < DNS_MAX_ADDRS; ai = ai->ai_next) {
+            struct dns_result_addr *a = result.addrs + result.n;
+            if(ai->ai_family == AF_INET && ai->ai_addrlen == sizeof(a->u.in)) {
+                memcpy(&a->u.in, ai->ai_addr, sizeof(a->u.in));
+                a->u.in.sin_port = htons(e->port);
+            } else if(ai->ai_family == AF_INET6 && ai->ai_addrlen == sizeof(a->u.in6)) {
+                memcpy(&a->u.in6, ai->ai_addr, sizeof(a->u.in6));
+                a->u.in6.sin6_port = htons(e->port);
+            } else {
+                continue;
+            }
+            a->len = ai->ai_addrlen;
+            result.n++;
+        }
+        freeaddrinfo(res);
+        if(result.n == 0) {
+            err = EAI_NONAME;
+        }
+    }
+
+    pthread_mutex_lock(&cache.mutex);
+    e->res      = result;
+    e->ok       = err == 0;
+    e->resolved = true;
+    // solo la inexistencia del nombre es definitiva, el resto se reintenta
+    e->expires  = now() + (err == 0 ? cache.ttl
+                         : err == EAI_NONAME ? cache.negative_ttl : 0);
+    // con el lock: una espera que se libera (p.e. porque venció el
+    // timeout de su conexión) deja de ser válida apenas lo obtiene
+    for(struct dnscache_waiter *w = e->waiters; w != NULL; w = w->next) {
+        selector_notify_block(w->s, w->fd);
+    }
+    e->waiters  = NULL;
+    entry_unref(e);
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+/**
+ * EJECUTADA POR EL SELECTOR `s' al terminar una consulta de dns.c. Las
+ * esperas de ese selector continúan en el acto, sin pasar por
+ * selector_notify_block().
+ */
+static void
+entry_resolved(fd_selector s, void *data, int err, const struct dns_result *res, unsigned ttl) {
+    struct dnscache_entry *e = data;
+
+    pthread_mutex_lock(&cache.mutex);
+    if(err == 0) {
+        e->res  = *res;
+        e->ok   = true;
+    }
+    e->resolved = true;
+    e->expires  = now() + (err == 0 ? (ttl < cache.ttl ? ttl : cache.ttl)
+                         : err == EAI_NONAME ? cache.negative_ttl : 0);
+    // las esperas de otros selectores se notifican con el lock, ya que se
+    // pueden liberar en cualquier momento; las de `s' solo desde acá
+    struct dnscache_waiter *w = NULL;
+    for(struct dnscache_waiter *next, *p = e->waiters; p != NULL; p = next) {
+        next = p->next;
+        if(p->s == s) {
+            p->next = w;
+            w = p;
+        } else {
+            selector_notify_block(p->s, p->fd);
+        }
+    }
+    e->waiters  = NULL;
+    pthread_mutex_unlock(&cache.mutex);
+
+    // sin el lock: los handlers llaman a dnscache_*
+    for(struct dnscache_waiter *next; w != NULL; w = next) {
+        next = w->next;
+        struct selector_key key = {
+            .s    = w->s,
+            .fd   = w->fd,
+            .data = w->data,
+        };
+        w->on_resolved(&key);
+    }
+
+    pthread_mutex_lock(&cache.mutex);
+    entry_unref(e);
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+void
+dnscache_init(unsigned ttl, unsigned negative_ttl, bool native) {
+    pthread_mutex_lock(&cache.mutex);
+    cache.ttl          = ttl;
+    cache.negative_ttl = negative_ttl;
+    cache.native       = native;
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+void
+dnscache_destroy(void) {
+    pthread_mutex_lock(&cache.mutex);
+    for(unsigned i = 0; i < DNSCACHE_BUCKETS; i++) {
+        for(struct dnscache_entry *e = cache.buckets[i], *next; e != NULL; e = next) {
+            next = e->next;
+            free(e);
+        }
+        cache.buckets[i] = NULL;
+    }
+    for(struct dnscache_entry *e = cache.spare, *next; e != NULL; e = next) {
+        next = e->next;
+        free(e);
+    }
+    cache.spare  = NULL;
+    cache.nspare = 0;
+    cache.count  = 0;
+    pthread_mutex_unlock(&cache.mutex);
+}
+
+enum dnscache_status
+dnscache_resolve(struct dnscache_waiter *w, const char *name, uint16_t port,
+                 const struct selector_key *key, dnscache_callback on_resolved) {
+    enum dnscache_status ret = dnscache_error;
+    const uint32_t       h   = hash(name, port);
+    const time_t         t   = now();
+    bool                 start = false;
+
+    pthread_mutex_lock(&cache.mutex);
+
+    struct dnscache_entry **bucket = cache.buckets + (h & (DNSCACHE_BUCKETS - 1));
+    struct dnscache_entry  *e      = *bucket;
+    while(e != NULL && !matches(e, h, name, port)) {
+        e = e->next;
+    }
+    if(e != NULL && e->resolved && e->expires <= t) {
+        entry_unlink(e);
+        e = NULL;
+    }
+
+    if(e == NULL) {
+        if(cache.count >= DNSCACHE_MAX_ENTRIES) {
+            make_room(t);
+            if(cache.count >= DNSCACHE_MAX_ENTRIES) {
+                goto finally; // todo son resoluciones en curso
+            }
+        }
+        e = entry_new();
+        if(e == NULL) {
+            goto finally;
+        }
+        size_t i;
+        for(i = 0; i < sizeof(e->name) - 1 && name[i]; i++) {
+            e->name[i] = lower(name[i]);
+        }
+        e->name[i] = 0;
+        e->port    = port;
+        e->hash    = h;
+        e->refs    = 1; // la resolución en curso
+
+        if(cache.native && 0 == dns_hosts_lookup(e->name, port, &e->res)) {
+            e->ok       = true;
+            e->resolved = true;
+            e->expires  = t + cache.ttl;
+            e->refs     = 0;
+        } else {
+            start = true;
+        }
+        e->next   = *bucket;
+        *bucket   = e;
+        e->linked = true;
+        e->refs++;
+        cache.count++;
+    }
+
+    e->refs++;
+    w->entry = e;
+    w->s     = key->s;
+    w->fd    = key->fd;
+    w->data  = key->data;
+    w->on_resolved = on_resolved;
+    w->next  = NULL;
+    if(e->resolved) {
+        ret = dnscache_hit;
+    } else {
+        w->next    = e->waiters;
+        e->waiters = w;
+        ret        = dnscache_pending;
+    }
+
+finally:
+    pthread_mutex_unlock(&cache.mutex);
+
+    // la consulta se larga sin el lock: la entrada ya está en la tabla como
+    // en curso, así que otros selectores se suman como esperas. dns_lookup()
+    // nunca llama a entry_resolved antes de retornar.
+    if(start && !(cache.native && 0 == dns_lookup(key->s, e->name, port, entry_resolved, e))
+             && -1 == resolver_submit(entry_resolve, e)) {
+        pthread_mutex_lock(&cache.mutex);
+        e->resolved = true;
+        e->expires  = 0;
+        // las esperas que se sumaron mientras tanto son de otros selectores
+        for(struct dnscache_waiter **p = &e->waiters; *p != NULL; ) {
+            if(*p == w) {
+                *p = w->next;
+            } else {
+                selector_notify_block((*p)->s, (*p)->fd);
+                p = &(*p)->next;
+            }
+        }
+        e->waiters = NULL;
+        w->entry   = NULL;
+        entry_unref(e);     // la espera de `w'
+        entry_unlink(e);
+        entry_unref(e);     // la resolución que no empezó
+        pthread_mutex_unlock(&cache.mutex);
+        ret = dnscache_error;
+    }
+    return ret;
+}
+
+const struct dns_result *
+dnscache_result(const struct dnscache_waiter *w) {
+    return w->entry == NULL || !w->entry->ok ? NULL : &w->entry->res;
+}
+
+bool
+dnscache_ready(const struct dnscache_waiter *w) {
+    bool ret = false;
+    if(w->entry != NULL) {
+        pthread_mutex_lock(&cache.mutex);
+        ret = w->entry->resolved;
+        pthread_mutex_unlock(&cache.mutex);
+    }
+    return ret;
+}
+
+void
+dnscache_release(struct dnscache_waiter *w) {
+    struct dnscache_entry *e = w->entry;
+    if(e == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cache.mutex);
+    // si todavía esperaba la resolución, deja de esperarla
+    for(struct dnscache_waiter **p = &e->waiters; *p != NULL; p = &(*p)->next) {
+        if(*p == w) {
+            *p = w->next;
+            break;
+        }
+    }
+    entry_unref(e);
+    pthread_mutex_unlock(&cache.mutex);
+    w->entry = NULL;
+}
@@ -92,10 +92,38 @@ hello_parser_close(struct hello_parser *p) {
     /* no hay nada que liberar */
 }
 
+/**
+ * si el mensaje llegó entero lo parsea de una pasada, sin entregar los bytes
+ * de a uno. Retorna false (sin consumir nada) si falta algo o no es un hello
+ * de SOCKS5, para que lo resuelva el parser incremental.
+ */
+static bool
+hello_parse_whole(buffer *b, struct hello_parser *p) {
+    size_t n;
+    const uint8_t *ptr = buffer_read_ptr(b, &n);
+
+    if (n < 2 || ptr[0] != 0x05 || n < 2 + (size_t) ptr[1]) {
+        return false;
+    }
+    const uint8_t nmethods = ptr[1];
+    if (NULL != p->on_authentication_method) {
+        for (unsigned i = 0; i < nmethods; i++) {
+            p->on_authentication_method(p, ptr[2 + i]);
+        }
+    }
+    p->remaining = 0;
+    p->state     = hello_done;
+    buffer_read_adv(b, 2 + nmethods);
+    return true;
+}
+
 extern enum hello_state
 hello_consume(buffer *b, struct hello_parser *p, bool *errored) {
     enum hello_state st = p->state;
 
+    if (hello_version == st && hello_parse_whole(b, p)) {
+        return p->state;
+    }
     while (buffer_can_read(b))  {
         const uint8_t c = buffer_read(b);
         st = hello_parser_feed(p, c);
@@ -86,6 +86,11 @@ target(const uint8_t c, struct monitor_parser *p) {
                 case monitor_target_get_transfered:
                 case monitor_target_get_proxyusers:
                 case monitor_target_get_adminusers:
+                case monitor_target_get_dns_queue:
+                case monitor_target_get_dns_wait:
+                case monitor_target_get_slots_used:
+                case monitor_target_get_slots_allocated:
+                case monitor_target_get_iterations:
 					p->monitor->target.target_get = c;
                     next = monitor_done;
                     break;
@@ -101,6 +106,7 @@ target(const uint8_t c, struct monitor_parser *p) {
                 case monitor_target_config_delete_proxyuser:
                 case monitor_target_config_add_admin:
                 case monitor_target_config_delete_admin:
+                case monitor_target_config_reload_users:
 					p->monitor->target.target_config = c;
                     remaining_set(p, 2); // vamos a leer 2 bytes para el dlen
                     next = monitor_dlen;
@@ -112,6 +118,7 @@ target(const uint8_t c, struct monitor_parser *p) {
             break;
         default:
             // impossible
+            next = monitor_error;
             break;
     }
 
@@ -130,6 +137,7 @@ dlen(const uint8_t c, struct monitor_parser *p) {
         p->monitor->dlen = ntohs(*(uint16_t*)combinedlen); // Para evitar problemas de endianness armo el uint16 de dlen segun el endianness del sistema. (Suponiendo que me los manda en network order "bigendean")
         switch (p->monitor->target.target_config) {
             case monitor_target_config_pop3disector:
+            case monitor_target_config_reload_users:
                 next = monitor_data;
                 break;
             case monitor_target_config_add_proxyuser:
@@ -166,6 +174,10 @@ data(const uint8_t c, struct monitor_parser *p) {
             p->monitor->data.disector_data_params = c;
             next = monitor_done;
             break;
+
+        case monitor_target_config_reload_users:
+            next = monitor_done;
+            break;
         
         case monitor_target_config_add_proxyuser: 
             // Si el primer caracter es 0 directamente tiro error ya que el usuario no puede ser vacio
@@ -270,6 +282,10 @@ data(const uint8_t c, struct monitor_parser *p) {
             }
             
             break;
+
+        default:
+            next = monitor_error;
+            break;
     }
 
     return next;
@@ -8,9 +8,18 @@
 #include "../include/monitor.h"
 #include "../include/monitornio.h"
 #include "../include/socks5nio.h"
+#include "../include/users.h"
+#include "../include/resolver.h"
+#include "../include/netutils.h"
 
 #define N(x) (sizeof(x)/sizeof((x)[0]))
 
+/**
+ * el request se parsea a medida que llega, así que alcanza con un buffer
+ * chico. La respuesta solo se aloja aparte si no entra en él.
+ */
+#define RAW_BUFFER_SIZE 512
+
 struct monitor_st {
     buffer                       *rb, *wb;
     struct monitor               monitor;
@@ -26,9 +35,12 @@ struct connection {
     struct monitor_st             request;
 
     /** buffers para ser usados por read_buffer y write_buffer */
-    uint8_t raw_buff_a[0xffff], raw_buff_b[0xffff];
+    uint8_t raw_buff_a[RAW_BUFFER_SIZE], raw_buff_b[RAW_BUFFER_SIZE];
     buffer  read_buffer, write_buffer;
 
+    /** espacio de write_buffer si la respuesta no entra en raw_buff_b */
+    uint8_t *response;
+
     /** siguiente en la pool */
     struct connection *next;
 };
@@ -70,6 +82,9 @@ static void
 connection_destroy(struct connection *s) {
     if(s == NULL) return;
 
+    free(s->response);
+    s->response = NULL;
+
     if(pool_size < max_pool) { // agregamos a la pool
         s->next = pool;
         pool    = s;
@@ -119,9 +134,9 @@ void
 monitor_passive_accept(struct selector_key *key) {
     struct connection *state = NULL;
 
-    const int client = accept(key->fd, NULL, NULL);
+    const int client = accept_nio(key->fd, NULL, NULL);
 
-    if (client == -1 || selector_fd_set_nio(client) == -1)
+    if (client == -1)
         goto fail;
 
     // instancio estructura de estado
@@ -288,16 +303,60 @@ monitor_process(struct selector_key *key, struct monitor_st *d) {
                     d->status = monitor_status_succeeded;
                     break;
                 }
-                case monitor_target_get_proxyusers: {
-                    char usernames[MAX_USERS * 0xff];
-                    dlen = socksv5_get_users(usernames);
+                case monitor_target_get_dns_queue: {
+                    uint32_t dq = resolver_queue_depth();
+                    dlen = sizeof(dq);
                     data = malloc(dlen);
-                    memcpy(data, usernames, dlen);
+                    *((uint32_t*)data) = dq;
+                    numeric_data = true;
+                    d->status = monitor_status_succeeded;
+                    break;
+                }
+                case monitor_target_get_dns_wait: {
+                    uint32_t dw = resolver_wait_time();
+                    dlen = sizeof(dw);
+                    data = malloc(dlen);
+                    *((uint32_t*)data) = dw;
+                    numeric_data = true;
+                    d->status = monitor_status_succeeded;
+                    break;
+                }
+                case monitor_target_get_slots_used: {
+                    uint32_t su = socksv5_slots_used();
+                    dlen = sizeof(su);
+                    data = malloc(dlen);
+                    *((uint32_t*)data) = su;
+                    numeric_data = true;
+                    d->status = monitor_status_succeeded;
+                    break;
+                }
+                case monitor_target_get_slots_allocated: {
+                    uint32_t sa = socksv5_slots_allocated();
+                    dlen = sizeof(sa);
+                    data = malloc(dlen);
+                    *((uint32_t*)data) = sa;
+                    numeric_data = true;
+                    d->status = monitor_status_succeeded;
+                    break;
+                }
+                case monitor_target_get_iterations: {
+                    uint32_t it = socksv5_selector_iterations();
+                    dlen = sizeof(it);
+                    data = malloc(dlen);
+                    *((uint32_t*)data) = it;
+                    numeric_data = true;
+                    d->status = monitor_status_succeeded;
+                    break;
+                }
+                case monitor_target_get_proxyusers: {
+                    // la respuesta lleva hasta UINT16_MAX bytes de nombres
+                    data = malloc(UINT16_MAX);
+                    dlen = users_list((char *) data, UINT16_MAX);
                     d->status = monitor_status_succeeded;
                     break;
                 }
                 case monitor_target_get_adminusers: {
-                    char usernames[MAX_USERS * 0xff];
+                    char usernames[MAX_ADMINS * 0xff];
                     dlen = monitor_get_admins(usernames);
                     data = malloc(dlen);
                     memcpy(data, usernames, dlen);
@@ -319,12 +378,12 @@ monitor_process(struct selector_key *key, struct monitor_st *d) {
                     break;
                 }
                 case monitor_target_config_add_proxyuser: {
-                    error_response = socksv5_register_user(d->parser.monitor->data.add_proxy_user_param.user, d->parser.monitor->data.add_proxy_user_param.pass);
+                    error_response = users_add(d->parser.monitor->data.add_proxy_user_param.user, d->parser.monitor->data.add_proxy_user_param.pass);
                     d->status = monitor_status_succeeded;
                     break;
                 }
                 case monitor_target_config_delete_proxyuser: {
-                    error_response = socksv5_unregister_user(d->parser.monitor->data.user);
+                    error_response = users_remove(d->parser.monitor->data.user);
                     d->status = monitor_status_succeeded;
                     break;
                 }
@@ -338,6 +397,11 @@ monitor_process(struct selector_key *key, struct monitor_st *d) {
                     d->status = monitor_status_succeeded;
                     break;
                 }
+                case monitor_target_config_reload_users: {
+                    error_response = users_file_reload();
+                    d->status = monitor_status_succeeded;
+                    break;
+                }
                 default: {
                     d->status = monitor_status_invalid_target;
                     break;
@@ -354,6 +418,15 @@ finally:
     if (error_response != 0)
        d->status = monitor_status_invalid_data;
 
+    size_t space;
+    buffer_write_ptr(d->wb, &space);
+    if (space < (size_t) dlen + 3) {
+        struct connection *c = ATTACHMENT(key);
+        c->response = malloc((size_t) dlen + 3);
+        if (c->response == NULL)
+            abort();
+        buffer_init(d->wb, (size_t) dlen + 3, c->response);
+    }
     if (-1 == monitor_marshall(d->wb, d->status, dlen, data, numeric_data))
         abort(); // el buffer tiene que ser mas grande en la variable
 
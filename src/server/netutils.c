@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // accept4
 #include <stdbool.h>
 #include <errno.h>
 #include <string.h>
@@ -5,6 +6,7 @@
 
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 
 #include "../include/netutils.h"
 
@@ -54,6 +56,11 @@ sockaddr_to_human(char *buff, const size_t buffsize,
     return buff;
 }
 
+int
+accept_nio(const int fd, struct sockaddr *addr, socklen_t *addr_len) {
+    return accept4(fd, addr, addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
 int
 sock_blocking_write(const int fd, buffer *b) {
         int  ret = 0;
@@ -0,0 +1,64 @@
+/**
+ * relay.c - copia entre sockets con splice(2)
+ */
+#define _GNU_SOURCE // splice, pipe2, F_GETPIPE_SZ
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../include/relay.h"
+
+/** capacidad por defecto de un pipe en linux, si no la podemos consultar */
+#define RELAY_PIPE_DEFAULT_SIZE (16 * 4096)
+
+void
+relay_pipe_init(struct relay_pipe *p) {
+    p->fds[0] = -1;
+    p->fds[1] = -1;
+    p->len    = 0;
+    p->size   = 0;
+}
+
+int
+relay_pipe_open(struct relay_pipe *p) {
+    if(relay_pipe_is_open(p)) {
+        return 0;
+    }
+    if(-1 == pipe2(p->fds, O_NONBLOCK | O_CLOEXEC)) {
+        p->fds[0] = p->fds[1] = -1;
+        return -1;
+    }
+    const int size = fcntl(p->fds[0], F_GETPIPE_SZ);
+    p->size = size > 0 ? (size_t) size : RELAY_PIPE_DEFAULT_SIZE;
+    p->len  = 0;
+    return 0;
+}
+
+void
+relay_pipe_close(struct relay_pipe *p) {
+    if(relay_pipe_is_open(p)) {
+        close(p->fds[0]);
+        close(p->fds[1]);
+    }
+    relay_pipe_init(p);
+}
+
+ssize_t
+relay_pipe_fill(struct relay_pipe *p, int fd) {
+    const ssize_t n = splice(fd, NULL, p->fds[1], NULL, p->size - p->len,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n > 0) {
+        p->len += n;
+    }
+    return n;
+}
+
+ssize_t
+relay_pipe_drain(struct relay_pipe *p, int fd) {
+    const ssize_t n = splice(p->fds[0], NULL, fd, NULL, p->len,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if(n > 0) {
+        p->len -= n;
+    }
+    return n;
+}
@@ -75,8 +75,11 @@ atyp(const uint8_t c, struct request_parser *p) {
 
 static enum request_state
 dstaddr_fqdn(const uint8_t c, struct request_parser *p) {
+    if (c == 0) {
+        return request_error; // un nombre vacío no se puede resolver
+    }
     remaining_set(p, c);
-    p->request->dest_addr.fqdn[p->n - 1] = 0; //seteamos el 0 final del nombre para no tener que hacerlo despues
+    p->request->dest_addr.fqdn[p->n] = 0; //seteamos el 0 final del nombre para no tener que hacerlo despues
     return request_dstaddr;
 }
 
@@ -171,10 +174,63 @@ request_is_done(const enum request_state st, bool *errored) {
     return st >= request_done;
 }
 
+/**
+ * si el request llegó entero lo parsea de una pasada, copiando la dirección
+ * y el puerto directamente. Retorna false (sin consumir nada) si falta algo
+ * o el mensaje tiene un error, para que lo resuelva el parser incremental.
+ */
+static bool
+request_parse_whole(buffer *b, struct request_parser *p) {
+    size_t n;
+    const uint8_t *ptr = buffer_read_ptr(b, &n);
+    struct request *r  = p->request;
+    size_t len;
+
+    if (n < 5 || ptr[0] != 0x05) {
+        return false;
+    }
+    switch (ptr[3]) {
+        case socks_req_addrtype_ipv4:
+            len = 4 + sizeof(r->dest_addr.ipv4.sin_addr) + 2;
+            if (n < len)
+                return false;
+            memset(&r->dest_addr.ipv4, 0, sizeof(r->dest_addr.ipv4));
+            r->dest_addr.ipv4.sin_family = AF_INET;
+            memcpy(&r->dest_addr.ipv4.sin_addr, ptr + 4, sizeof(r->dest_addr.ipv4.sin_addr));
+            break;
+        case socks_req_addrtype_ipv6:
+            len = 4 + sizeof(r->dest_addr.ipv6.sin6_addr) + 2;
+            if (n < len)
+                return false;
+            memset(&r->dest_addr.ipv6, 0, sizeof(r->dest_addr.ipv6));
+            r->dest_addr.ipv6.sin6_family = AF_INET6;
+            memcpy(&r->dest_addr.ipv6.sin6_addr, ptr + 4, sizeof(r->dest_addr.ipv6.sin6_addr));
+            break;
+        case socks_req_addrtype_domain:
+            len = 5 + (size_t) ptr[4] + 2;
+            if (ptr[4] == 0 || n < len)
+                return false;
+            memcpy(r->dest_addr.fqdn, ptr + 5, ptr[4]);
+            r->dest_addr.fqdn[ptr[4]] = 0;
+            break;
+        default:
+            return false;
+    }
+    r->cmd            = ptr[1];
+    r->dest_addr_type = ptr[3];
+    memcpy(&r->dest_port, ptr + len - 2, sizeof(r->dest_port)); // ya en orden de red
+    p->state = request_done;
+    buffer_read_adv(b, len);
+    return true;
+}
+
 extern enum request_state
 request_consume(buffer *b, struct request_parser *p, bool *errored) {
     enum request_state st = p->state;
 
+    if (request_version == st && request_parse_whole(b, p)) {
+        return p->state;
+    }
     while (buffer_can_read(b)) {
         const uint8_t c = buffer_read(b);
         st = request_parser_feed(p, c); // cargamos 1 solo byte
@@ -0,0 +1,157 @@
+/**
+ * resolver.c - pool acotado de hilos para resoluciones de nombres
+ */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../include/resolver.h"
+
+struct resolver_job {
+    resolver_task       task;
+    void               *data;
+    /** momento en que se encoló, para medir la espera */
+    struct timespec     queued;
+};
+
+static struct {
+    pthread_mutex_t      mutex;
+    pthread_cond_t       cond;
+
+    pthread_t           *threads;
+    unsigned             nthreads;
+
+    /** cola circular de trabajos */
+    struct resolver_job *jobs;
+    unsigned             size;
+    unsigned             head;
+    unsigned             count;
+
+    bool                 stopping;
+
+    /** acumulado de espera de los trabajos que ya tomó un hilo */
+    uint64_t             wait_total_us;
+    uint64_t             wait_count;
+} pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond  = PTHREAD_COND_INITIALIZER,
+};
+
+static uint64_t
+elapsed_us(const struct timespec *from, const struct timespec *to) {
+    return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000
+         + (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+static void *
+resolver_run(void *data) {
+    struct resolver_job job;
+    struct timespec now;
+
+    pthread_mutex_lock(&pool.mutex);
+    while(true) {
+        while(pool.count == 0 && !pool.stopping) {
+            pthread_cond_wait(&pool.cond, &pool.mutex);
+        }
+        if(pool.stopping) {
+            break;
+        }
+        job        = pool.jobs[pool.head];
+        pool.head  = (pool.head + 1) % pool.size;
+        pool.count--;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        pool.wait_total_us += elapsed_us(&job.queued, &now);
+        pool.wait_count++;
+        pthread_mutex_unlock(&pool.mutex);
+
+        job.task(job.data);
+
+        pthread_mutex_lock(&pool.mutex);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return NULL;
+}
+
+int
+resolver_init(unsigned threads, unsigned queue_size) {
+    pool.jobs    = calloc(queue_size, sizeof(*pool.jobs));
+    pool.threads = calloc(threads, sizeof(*pool.threads));
+    if(pool.jobs == NULL || pool.threads == NULL) {
+        goto fail;
+    }
+    pool.size     = queue_size;
+    pool.head     = 0;
+    pool.count    = 0;
+    pool.stopping = false;
+
+    for(pool.nthreads = 0; pool.nthreads < threads; pool.nthreads++) {
+        if(0 != pthread_create(pool.threads + pool.nthreads, NULL,
+                               resolver_run, NULL)) {
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    resolver_destroy();
+    return -1;
+}
+
+void
+resolver_destroy(void) {
+    pthread_mutex_lock(&pool.mutex);
+    pool.stopping = true;
+    pool.count    = 0;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+
+    for(unsigned i = 0; i < pool.nthreads; i++) {
+        pthread_join(pool.threads[i], NULL);
+    }
+    pool.nthreads = 0;
+
+    free(pool.threads);
+    free(pool.jobs);
+    pool.threads = NULL;
+    pool.jobs    = NULL;
+    pool.size    = 0;
+}
+
+int
+resolver_submit(resolver_task task, void *data) {
+    int ret = -1;
+
+    pthread_mutex_lock(&pool.mutex);
+    if(!pool.stopping && pool.count < pool.size) {
+        struct resolver_job *job = pool.jobs
+                                 + (pool.head + pool.count) % pool.size;
+        job->task = task;
+        job->data = data;
+        clock_gettime(CLOCK_MONOTONIC, &job->queued);
+        pool.count++;
+        pthread_cond_signal(&pool.cond);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&pool.mutex);
+
+    return ret;
+}
+
+uint32_t
+resolver_queue_depth(void) {
+    pthread_mutex_lock(&pool.mutex);
+    const uint32_t ret = pool.count;
+    pthread_mutex_unlock(&pool.mutex);
+    return ret;
+}
+
+uint32_t
+resolver_wait_time(void) {
+    pthread_mutex_lock(&pool.mutex);
+    const uint64_t ret = pool.wait_count == 0 ? 0
+                       : pool.wait_total_us / pool.wait_count;
+    pthread_mutex_unlock(&pool.mutex);
+    return ret > UINT32_MAX ? UINT32_MAX : (uint32_t) ret;
+}
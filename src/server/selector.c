@@ -7,14 +7,19 @@
 #include <assert.h> // :)
 #include <errno.h>  // :)
 #include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
 
 #include <stdint.h> // SIZE_MAX
+#include <limits.h> // INT_MAX, CHAR_BIT
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
-#include <sys/signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include "../include/selector.h"
 
 #define N(x) (sizeof(x)/sizeof((x)[0]))
@@ -47,68 +52,97 @@ selector_error(const selector_status status) {
     return msg;
 }
 
-
-static void
-wake_handler(const int signal) {
-    // nada que hacer. está solo para interrumpir el select
+const char *
+selector_backend_name(const selector_backend backend) {
+    const char *msg;
+    switch(backend) {
+        case SELECTOR_BACKEND_SELECT:
+            msg = "select";
+            break;
+        case SELECTOR_BACKEND_EPOLL:
+            msg = "epoll";
+            break;
+        default:
+            msg = ERROR_DEFAULT_MSG;
+    }
+    return msg;
 }
 
-// señal a usar para las notificaciones de resolución
+
+// configuración con la que se instancian los selectores
 struct selector_init conf;
-static sigset_t emptyset, blockset;
 
 selector_status
 selector_init(const struct selector_init  *c) {
     memcpy(&conf, c, sizeof(conf));
-
-    // inicializamos el sistema de comunicación entre threads y el selector
-    // principal. La técnica se encuentra descripta en
-    // "The new pselect() system call" <https://lwn.net/Articles/176911/>
-    //  March 24, 2006
-    selector_status   ret = SELECTOR_SUCCESS;
-    struct sigaction act = {
-        .sa_handler = wake_handler,
-    };
-
-    // 0. calculamos mascara para evitar que se interrumpa antes de llegar al
-    //    select
-    sigemptyset(&blockset);
-    sigaddset  (&blockset, conf.signal);
-    if(-1 == sigprocmask(SIG_BLOCK, &blockset, NULL)) {
-        ret = SELECTOR_IO;
-        goto finally;
-    }
-
-    // 1. Registramos una función que atenderá la señal de interrupción
-    //    del selector.
-    //    Esta interrupción es útil en entornos multi-hilos.
-
-    if (sigaction(conf.signal, &act, 0)) {
-        ret = SELECTOR_IO;
-        goto finally;
-    }
-    sigemptyset(&emptyset);
-
-finally:
-    return ret;
+    return SELECTOR_SUCCESS;
 }
 
 selector_status
 selector_close(void) {
     // Nada para liberar.
-    // TODO(juan): podriamos reestablecer el handler de la señal.
     return SELECTOR_SUCCESS;
 }
 
+/**
+ * rueda jerárquica de timeouts: TIMER_LEVELS niveles de TIMER_SLOTS listas.
+ * El nivel l guarda los timeouts que vencen dentro de TIMER_SLOTS^(l+1)
+ * ticks, agrupados por bloques de TIMER_SLOTS^l ticks; cada vez que el
+ * nivel inferior da una vuelta se redistribuye el próximo bloque. Así
+ * programar, cancelar y despachar un timeout es O(1).
+ */
+#define TIMER_TICK_MS       10
+#define TIMER_LEVEL_BITS    6
+#define TIMER_SLOTS         (1 << TIMER_LEVEL_BITS)
+#define TIMER_SLOT_MASK     (TIMER_SLOTS - 1)
+#define TIMER_LEVELS        4
+/** ticks que abarca la rueda (unas 46 horas). Más lejos se acota */
+#define TIMER_MAX_TICKS     ((uint64_t) 1 << (TIMER_LEVEL_BITS * TIMER_LEVELS))
+
 // estructuras internas
 struct item {
    int                 fd;
    fd_interest         interest;
    const fd_handler   *handler;
    void *              data; // se espera que sea un struct socks5 * al parecer, ver ATTACHMENT
+   /** (solo epoll) si el fd se encuentra dado de alta en el epoll */
+   bool                in_epoll;
+   /** iteración del selector en la que se registró el fd */
+   unsigned long       epoch;
+   /** si tiene un timeout programado, en qué tick de la rueda vence */
+   bool                timer;
+   uint64_t            expires;
+   /** nivel de la rueda en el que está y vecinos en la lista de su slot */
+   unsigned            timer_level;
+   int                 timer_prev;
+   int                 timer_next;
+};
+
+/** evento listo para ser despachado */
+struct ready_event {
+    int         fd;
+    /** operaciones listas (OP_READ / OP_WRITE) */
+    fd_interest ops;
 };
 
-/* tarea bloqueante */
+/**
+ * capacidad de la cola de notificaciones de trabajos bloqueantes (potencia
+ * de 2). Cada conexión tiene a lo sumo un trabajo en curso, así que solo se
+ * llena con muchas resoluciones terminando a la vez.
+ */
+#define NOTIFY_QUEUE_SIZE   1024
+
+/**
+ * celda de la cola de notificaciones. `seq' indica de quién es: vale la
+ * posición en la que se puede encolar cuando está libre, y la siguiente
+ * cuando ya tiene un fd para el consumidor.
+ */
+struct notify_cell {
+    atomic_size_t seq;
+    int           fd;
+};
+
+/* tarea bloqueante, solo para las notificaciones que no entran en la cola */
 struct blocking_job {
     /** selector dueño de la resolucion */
     fd_selector  s;
@@ -129,11 +163,16 @@ static const int FD_UNUSED = -1;
 #define ITEM_USED(i) ( ( FD_UNUSED != (i)->fd) )
 
 struct fdselector {
+    /** multiplexor utilizado por este selector */
+    selector_backend backend;
+
     // almacenamos en una jump table donde la entrada es el file descriptor.
     // Asumimos que el espacio de file descriptors no va a ser esparso; pero
     // esto podría mejorarse utilizando otra estructura de datos
     struct item    *fds;
     size_t          fd_size;  // cantidad de elementos posibles de fds
+    /** cantidad máxima de elementos que puede tener fds según el backend */
+    size_t          fd_max_size;
 
     /** fd maximo para usar en select() */
     int max_fd;  // max(.fds[].fd)
@@ -148,28 +187,107 @@ struct fdselector {
     /** tambien select() puede cambiar el valor */
     struct timespec slave_t;
 
+    /** (solo epoll) descriptor del epoll y eventos retornados por el mismo */
+    int                 epoll_fd;
+    struct epoll_event *events;
+    int                 events_size;
+
+    /**
+     * eventos listos de la iteración actual, compactados para despachar
+     * solo los fds que tienen actividad.
+     */
+    struct ready_event *ready;
+    size_t              ready_size;
+    /**
+     * número de iteración. Los fds registrados durante el despacho tienen
+     * la iteración actual y se ignoran: su readiness no fue consultada.
+     */
+    unsigned long       epoch;
+
+    /**
+     * rueda de timeouts. Cada slot es una lista de fds enlazada por
+     * item->timer_prev / item->timer_next, -1 si está vacía.
+     */
+    int                 wheel[TIMER_LEVELS][TIMER_SLOTS];
+    /** próximo tick a despachar: los anteriores ya se despacharon */
+    uint64_t            wheel_tick;
+    /** cantidad de timeouts programados */
+    size_t              timers;
+    /** origen de los ticks (CLOCK_MONOTONIC) */
+    struct timespec     wheel_base;
+    /**
+     * milisegundos desde wheel_base al despertar de la última espera. Los
+     * timeouts que se programan durante la iteración se cuentan desde ahí.
+     */
+    uint64_t            now_ms;
+
     // notificaciónes entre blocking jobs y el selector
-    volatile pthread_t      selector_thread;
-    /** protege el acceso a resolutions jobs */
-    pthread_mutex_t         resolution_mutex;
     /**
-     * lista de trabajos blockeantes que finalizaron y que pueden ser
-     * notificados.
+     * eventfd registrado en el propio selector por el que otros hilos lo
+     * despiertan cuando está bloqueado esperando eventos.
      */
+    int                     wake_fd;
+    /**
+     * si ya hay un despertar pendiente en wake_fd. Las notificaciones que
+     * llegan mientras tanto no lo vuelven a escribir: se despachan todas
+     * juntas en la misma iteración.
+     */
+    atomic_bool             wake_pending;
+    /**
+     * trabajos bloqueantes que finalizaron y que pueden ser notificados.
+     * Es una cola sin locks de capacidad fija, con varios productores (los
+     * hilos que terminan los trabajos) y un único consumidor (el hilo del
+     * selector), con sus celdas preasignadas.
+     */
+    struct notify_cell     *notify;
+    /** próxima posición a encolar, compartida por los productores */
+    atomic_size_t           notify_tail;
+    /** próxima posición a desencolar, solo la usa el selector */
+    size_t                  notify_head;
+    /**
+     * notificaciones encoladas y todavía no despachadas. Es lo único que
+     * mira el selector en cada iteración si no hay ninguna.
+     */
+    atomic_size_t           notify_pending;
+    /** protege el acceso a resolution_jobs */
+    pthread_mutex_t         resolution_mutex;
+    /** notificaciones que no entraron en la cola por estar llena */
     struct blocking_job    *resolution_jobs;
 };
 
-/** cantidad máxima de file descriptors que la plataforma puede manejar */
+/** cantidad máxima de file descriptors que puede manejar select(2) */
 #define ITEMS_MAX_SIZE      FD_SETSIZE
 
-// en esta implementación el máximo está dado por el límite natural de select(2).
+/** cantidad máxima de eventos que retorna epoll_wait(2) por iteración */
+#define EPOLL_MAX_EVENTS    1024
+
+/**
+ * cantidad máxima de file descriptors que la plataforma puede manejar.
+ *
+ * Con select(2) está dado por su límite natural; con epoll(7) por el límite
+ * de descriptores abiertos del proceso.
+ */
+static size_t
+items_max_size(const selector_backend backend) {
+    size_t ret = ITEMS_MAX_SIZE;
+    struct rlimit rl;
+
+    if(SELECTOR_BACKEND_EPOLL == backend && 0 == getrlimit(RLIMIT_NOFILE, &rl)) {
+        if(rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > INT_MAX) {
+            ret = INT_MAX;
+        } else {
+            ret = rl.rlim_cur;
+        }
+    }
+    return ret;
+}
 
 /**
  * determina el tamaño a crecer, generando algo de slack para no tener
  * que realocar constantemente.
  */
 static
-size_t next_capacity(const size_t n) {
+size_t next_capacity(const size_t n, const size_t max) {
     unsigned bits = 0;
     size_t tmp = n;
     while(tmp != 0) {
@@ -179,8 +297,8 @@ size_t next_capacity(const size_t n) {
     tmp = 1UL << bits;
 
     assert(tmp >= n);
-    if(tmp > ITEMS_MAX_SIZE) {
-        tmp = ITEMS_MAX_SIZE;
+    if(tmp > max) {
+        tmp = max;
     }
 
     return tmp + 1;
@@ -204,20 +322,17 @@ items_init(fd_selector s, const size_t last) {
 }
 
 /**
- * calcula el fd maximo para ser utilizado en select()
+ * actualiza el fd maximo para ser utilizado en select() luego de que se
+ * liberó `fd'. Solo retrocede si se liberó el máximo, y cada paso hacia atrás
+ * se corresponde con un registro previo, por lo que es O(1) amortizado.
  */
-static int
-items_max_fd(fd_selector s) {
-    int max = 0;
-    for(int i = 0; i <= s->max_fd; i++) {
-        struct item *item = s->fds + i;
-        if(ITEM_USED(item)) {
-            if(item->fd > max) {
-                max = item->fd;
-            }
+static void
+items_max_fd_release(fd_selector s, const int fd) {
+    if(fd == s->max_fd) {
+        while(s->max_fd > 0 && !ITEM_USED(s->fds + s->max_fd)) {
+            s->max_fd--;
         }
     }
-    return max;
 }
 
 // borra el item de los fd_sets y los vuelve a setear segun sus intereses actuales
@@ -237,6 +352,57 @@ items_update_fdset_for_fd(fd_selector s, const struct item * item) {
     }
 }
 
+/**
+ * refleja en el epoll los intereses actuales del item.
+ *
+ * Los items sin interés se quitan del epoll: a diferencia de select(2),
+ * epoll(7) reporta EPOLLHUP/EPOLLERR aunque no se lo pida, y un fd sin
+ * intereses que fue cerrado por el otro extremo nos haría girar en vacío.
+ */
+static selector_status
+items_update_epoll_for_fd(fd_selector s, struct item *item, const int fd) {
+    selector_status ret = SELECTOR_SUCCESS;
+    struct epoll_event ev = {
+        .events  = 0,
+        .data.fd = fd,
+    };
+    int op;
+
+    if(ITEM_USED(item) && item->interest != OP_NOOP) {
+        if(item->interest & OP_READ) {
+            ev.events |= EPOLLIN;
+        }
+        if(item->interest & OP_WRITE) {
+            ev.events |= EPOLLOUT;
+        }
+        op = item->in_epoll ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    } else if(item->in_epoll) {
+        op = EPOLL_CTL_DEL;
+    } else {
+        goto finally;
+    }
+
+    if(-1 == epoll_ctl(s->epoll_fd, op, fd, &ev)) {
+        ret = SELECTOR_IO;
+    } else {
+        item->in_epoll = op != EPOLL_CTL_DEL;
+    }
+finally:
+    return ret;
+}
+
+/** actualiza las estructuras del backend según los intereses del item */
+static selector_status
+items_update_interest(fd_selector s, struct item *item, const int fd) {
+    selector_status ret = SELECTOR_SUCCESS;
+    if(SELECTOR_BACKEND_EPOLL == s->backend) {
+        ret = items_update_epoll_for_fd(s, item, fd);
+    } else {
+        items_update_fdset_for_fd(s, item);
+    }
+    return ret;
+}
+
 /**
  * garantizar cierta cantidad de elemenos en `fds'.
  * Se asegura de que `n' sea un número que la plataforma donde corremos lo
@@ -250,12 +416,12 @@ ensure_capacity(fd_selector s, const size_t n) {
     if(n < s->fd_size) {
         // nada para hacer, entra...
         ret = SELECTOR_SUCCESS;
-    } else if(n > ITEMS_MAX_SIZE) {
+    } else if(n > s->fd_max_size) {
         // me estás pidiendo más de lo que se puede.
         ret = SELECTOR_MAXFD;
     } else if(NULL == s->fds) {
         // primera vez.. alocamos
-        const size_t new_size = next_capacity(n);
+        const size_t new_size = next_capacity(n, s->fd_max_size);
 
         s->fds = calloc(new_size, element_size);
         if(NULL == s->fds) {
@@ -266,7 +432,7 @@ ensure_capacity(fd_selector s, const size_t n) {
         }
     } else {
         // hay que agrandar...
-        const size_t new_size = next_capacity(n);
+        const size_t new_size = next_capacity(n, s->fd_max_size);
         if (new_size > SIZE_MAX/element_size) { // ver MEM07-C
             ret = SELECTOR_ENOMEM;
         } else {
@@ -286,18 +452,95 @@ ensure_capacity(fd_selector s, const size_t n) {
     return ret;
 }
 
+/**
+ * vacía el eventfd. Las notificaciones que lo escribieron se despachan
+ * después, en handle_block_notifications.
+ */
+static void
+wake_read(struct selector_key *key) {
+    uint64_t n;
+    if(-1 == read(key->fd, &n, sizeof(n)) && errno != EAGAIN) {
+        perror("reading selector wakeup");
+    }
+    atomic_store_explicit(&key->s->wake_pending, false, memory_order_release);
+}
+
+static void
+wake_close(struct selector_key *key) {
+    close(key->fd);
+}
+
+static const struct fd_handler wake_handler = {
+    .handle_read  = wake_read,
+    .handle_close = wake_close,
+};
+
+/** crea el eventfd con el que se despierta al selector y lo registra */
+static selector_status
+wake_register(fd_selector s) {
+    selector_status ret;
+
+    s->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(-1 == s->wake_fd) {
+        ret = SELECTOR_IO;
+        goto finally;
+    }
+    ret = selector_register(s, s->wake_fd, &wake_handler, OP_READ, NULL);
+    if(SELECTOR_SUCCESS != ret) {
+        close(s->wake_fd);
+        s->wake_fd = -1;
+    }
+finally:
+    return ret;
+}
+
 fd_selector
 selector_new(const size_t initial_elements) {
     size_t size = sizeof(struct fdselector);
     fd_selector ret = malloc(size);
     if(ret != NULL) {
         memset(ret, 0x00, size);
+        ret->backend          = conf.backend;
+        ret->fd_max_size      = items_max_size(ret->backend);
+        ret->epoll_fd         = -1;
+        ret->wake_fd          = -1;
+        ret->ready_size       = SELECTOR_BACKEND_EPOLL == ret->backend
+                              ? EPOLL_MAX_EVENTS : ITEMS_MAX_SIZE;
+        ret->ready            = calloc(ret->ready_size, sizeof(*ret->ready));
         ret->master_t.tv_sec  = conf.select_timeout.tv_sec;
         ret->master_t.tv_nsec = conf.select_timeout.tv_nsec;
         assert(ret->max_fd == 0);
         ret->resolution_jobs  = 0;
+        ret->timers           = 0;
+        for(unsigned l = 0; l < TIMER_LEVELS; l++) {
+            for(unsigned i = 0; i < TIMER_SLOTS; i++) {
+                ret->wheel[l][i] = -1;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ret->wheel_base);
         pthread_mutex_init(&ret->resolution_mutex, 0);
-        if(0 != ensure_capacity(ret, initial_elements)) {
+        ret->notify           = malloc(NOTIFY_QUEUE_SIZE * sizeof(*ret->notify));
+        if(NULL == ret->notify) {
+            selector_destroy(ret);
+            return NULL;
+        }
+        for(size_t i = 0; i < NOTIFY_QUEUE_SIZE; i++) {
+            atomic_init(&ret->notify[i].seq, i);
+        }
+        atomic_init(&ret->notify_tail, 0);
+        atomic_init(&ret->notify_pending, 0);
+        atomic_init(&ret->wake_pending, false);
+        if(SELECTOR_BACKEND_EPOLL == ret->backend) {
+            ret->epoll_fd    = epoll_create1(EPOLL_CLOEXEC);
+            ret->events_size = EPOLL_MAX_EVENTS;
+            ret->events      = calloc(ret->events_size, sizeof(*ret->events));
+            if(-1 == ret->epoll_fd || NULL == ret->events || NULL == ret->ready) {
+                selector_destroy(ret);
+                return NULL;
+            }
+        }
+        if(NULL == ret->ready || 0 != ensure_capacity(ret, initial_elements)
+           || SELECTOR_SUCCESS != wake_register(ret)) {
             selector_destroy(ret);
             ret = NULL;
         }
@@ -326,11 +569,209 @@ selector_destroy(fd_selector s) {
             s->fds     = NULL;
             s->fd_size = 0;
         }
+        if(s->epoll_fd != -1) {
+            close(s->epoll_fd);
+        }
+        free(s->events);
+        free(s->ready);
+        free(s->notify);
         free(s);
     }
 }
 
-#define INVALID_FD(fd)  ((fd) < 0 || (fd) >= ITEMS_MAX_SIZE)
+#define INVALID_FD(s, fd)  ((fd) < 0 || (size_t)(fd) >= (s)->fd_max_size)
+
+/** milisegundos transcurridos desde el origen de la rueda */
+static uint64_t
+timers_clock(fd_selector s) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t ms = (int64_t)(now.tv_sec - s->wheel_base.tv_sec) * 1000
+                     + (now.tv_nsec - s->wheel_base.tv_nsec) / 1000000;
+    return ms < 0 ? 0 : (uint64_t) ms;
+}
+
+/** agrega al item en el slot que le corresponde según su vencimiento */
+static void
+timers_link(fd_selector s, struct item *item) {
+    if(item->expires < s->wheel_tick) {
+        item->expires = s->wheel_tick;
+    } else if(item->expires - s->wheel_tick >= TIMER_MAX_TICKS) {
+        item->expires = s->wheel_tick + TIMER_MAX_TICKS - 1;
+    }
+    const uint64_t delta = item->expires - s->wheel_tick;
+    unsigned level = 0;
+    while(level + 1 < TIMER_LEVELS
+          && delta >= (uint64_t) 1 << (TIMER_LEVEL_BITS * (level + 1))) {
+        level++;
+    }
+    int *head = &s->wheel[level][(item->expires >> (TIMER_LEVEL_BITS * level)) & TIMER_SLOT_MASK];
+
+    item->timer_level = level;
+    item->timer_prev  = -1;
+    item->timer_next  = *head;
+    if(*head != -1) {
+        s->fds[*head].timer_prev = item->fd;
+    }
+    *head = item->fd;
+}
+
+/** quita al item del slot en el que está */
+static void
+timers_unlink(fd_selector s, struct item *item) {
+    if(item->timer_prev != -1) {
+        s->fds[item->timer_prev].timer_next = item->timer_next;
+    } else {
+        const unsigned level = item->timer_level;
+        s->wheel[level][(item->expires >> (TIMER_LEVEL_BITS * level)) & TIMER_SLOT_MASK] = item->timer_next;
+    }
+    if(item->timer_next != -1) {
+        s->fds[item->timer_next].timer_prev = item->timer_prev;
+    }
+}
+
+/** quita al item de la rueda de timeouts, si estaba */
+static void
+timers_remove(fd_selector s, struct item *item) {
+    if(!item->timer) {
+        return;
+    }
+    timers_unlink(s, item);
+    item->timer = false;
+    s->timers--;
+}
+
+/**
+ * redistribuye en los niveles inferiores el slot del nivel `level' que
+ * corresponde al tick actual. Retorna el índice de dicho slot.
+ */
+static unsigned
+timers_cascade(fd_selector s, unsigned level) {
+    const unsigned idx = (s->wheel_tick >> (TIMER_LEVEL_BITS * level)) & TIMER_SLOT_MASK;
+    int fd = s->wheel[level][idx];
+
+    s->wheel[level][idx] = -1;
+    while(fd != -1) {
+        struct item *item = s->fds + fd;
+        fd = item->timer_next;
+        timers_link(s, item);
+    }
+    return idx;
+}
+
+/**
+ * primer tick en el que la rueda tiene algo para hacer: el vencimiento más
+ * próximo del nivel 0, o la redistribución de un slot ocupado de los
+ * niveles superiores.
+ */
+static uint64_t
+timers_next(fd_selector s) {
+    for(unsigned i = 0; i < TIMER_SLOTS; i++) {
+        if(s->wheel[0][(s->wheel_tick + i) & TIMER_SLOT_MASK] != -1) {
+            return s->wheel_tick + i;
+        }
+    }
+    uint64_t ret = UINT64_MAX;
+    for(unsigned level = 1; level < TIMER_LEVELS; level++) {
+        const unsigned shift = TIMER_LEVEL_BITS * level;
+        const uint64_t block = s->wheel_tick >> shift;
+        // el slot del bloque actual ya se redistribuyó: solo puede tener
+        // timeouts de la próxima vuelta
+        for(unsigned i = 1; i <= TIMER_SLOTS; i++) {
+            if(s->wheel[level][(block + i) & TIMER_SLOT_MASK] != -1) {
+                const uint64_t at = (block + i) << shift;
+                if(at < ret) {
+                    ret = at;
+                }
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+/**
+ * tiempo de bloqueo para la próxima espera: el timeout del selector acotado
+ * por el próximo movimiento de la rueda.
+ */
+static struct timespec
+timers_wait(fd_selector s) {
+    struct timespec ret = s->master_t;
+    const uint64_t next = s->timers == 0 ? UINT64_MAX : timers_next(s);
+    if(next != UINT64_MAX) {
+        const uint64_t at  = next * TIMER_TICK_MS;
+        const uint64_t now = timers_clock(s);
+        const uint64_t ms  = at > now ? at - now : 0;
+        if(ms < (uint64_t) ret.tv_sec * 1000 + ret.tv_nsec / 1000000) {
+            ret.tv_sec  = ms / 1000;
+            ret.tv_nsec = (ms % 1000) * 1000000;
+        }
+    }
+    return ret;
+}
+
+/**
+ * despacha los timeouts vencidos hasta el despertar de la última espera.
+ * Los handlers pueden programar o cancelar otros timeouts: los nuevos
+ * vencen en un tick posterior, por lo que no se despachan en esta pasada.
+ */
+static void
+handle_timeouts(fd_selector s) {
+    const uint64_t now_tick = s->now_ms / TIMER_TICK_MS;
+
+    while(s->wheel_tick <= now_tick) {
+        if(s->timers == 0) {
+            // nada programado: la rueda puede saltar hasta el presente
+            s->wheel_tick = now_tick + 1;
+            break;
+        }
+        const unsigned idx = s->wheel_tick & TIMER_SLOT_MASK;
+        if(idx == 0) {
+            for(unsigned level = 1; level < TIMER_LEVELS
+                                    && 0 == timers_cascade(s, level); level++) {
+                // el nivel siguiente se redistribuye cuando este da la vuelta
+            }
+        }
+        while(s->wheel[0][idx] != -1) {
+            struct item *item = s->fds + s->wheel[0][idx];
+            timers_remove(s, item);
+            if(item->handler->handle_timeout != NULL) {
+                struct selector_key key = {
+                    .s    = s,
+                    .fd   = item->fd,
+                    .data = item->data,
+                };
+                item->handler->handle_timeout(&key);
+            }
+        }
+        s->wheel_tick++;
+    }
+}
+
+selector_status
+selector_set_timeout(fd_selector s, int fd, unsigned ms) {
+    selector_status ret = SELECTOR_SUCCESS;
+
+    if(NULL == s || INVALID_FD(s, fd) || (size_t) fd >= s->fd_size) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+    struct item *item = s->fds + fd;
+    if(!ITEM_USED(item)) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+    timers_remove(s, item);
+    if(ms != 0) {
+        // redondeado hacia arriba: nunca vence antes de tiempo
+        item->expires = (s->now_ms + ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+        item->timer   = true;
+        timers_link(s, item);
+        s->timers++;
+    }
+finally:
+    return ret;
+}
 
 selector_status
 selector_register(fd_selector        s,
@@ -340,7 +781,7 @@ selector_register(fd_selector        s,
                      void *data) {
     selector_status ret = SELECTOR_SUCCESS;
     // 0. validación de argumentos
-    if(s == NULL || INVALID_FD(fd) || handler == NULL) {
+    if(s == NULL || INVALID_FD(s, fd) || handler == NULL) {
         ret = SELECTOR_IARGS;
         goto finally;
     }
@@ -363,12 +804,20 @@ selector_register(fd_selector        s,
         item->handler  = handler;
         item->interest = interest;
         item->data     = data;
+        item->in_epoll = false;
+        item->epoch    = s->epoch;
+        item->timer    = false;
+
+        ret = items_update_interest(s, item, fd);
+        if(SELECTOR_SUCCESS != ret) {
+            item_init(item);
+            goto finally;
+        }
 
         // actualizo colaterales
         if(fd > s->max_fd) {
             s->max_fd = fd;
         }
-        items_update_fdset_for_fd(s, item);
     }
 
 finally:
@@ -380,7 +829,7 @@ selector_unregister_fd(fd_selector       s,
                        const int         fd) {
     selector_status ret = SELECTOR_SUCCESS;
 
-    if(NULL == s || INVALID_FD(fd)) {
+    if(NULL == s || INVALID_FD(s, fd) || (size_t) fd >= s->fd_size) {
         ret = SELECTOR_IARGS;
         goto finally;
     }
@@ -391,6 +840,11 @@ selector_unregister_fd(fd_selector       s,
         goto finally;
     }
 
+    // lo quitamos del backend antes de que handle_close pueda cerrar el fd
+    item->interest = OP_NOOP;
+    items_update_interest(s, item, fd);
+    timers_remove(s, item);
+
     if(item->handler->handle_close != NULL) {
         struct selector_key key = {
             .s    = s,
@@ -398,14 +852,13 @@ selector_unregister_fd(fd_selector       s,
             .data = item->data,
         };
         item->handler->handle_close(&key);
+        // handle_close pudo registrar otro fd y hacer crecer s->fds
+        item = s->fds + fd;
     }
 
-    item->interest = OP_NOOP;
-    items_update_fdset_for_fd(s, item);
-
     memset(item, 0x00, sizeof(*item));
     item_init(item);
-    s->max_fd = items_max_fd(s);
+    items_max_fd_release(s, fd);
 
 finally:
     return ret;
@@ -415,7 +868,7 @@ selector_status
 selector_set_interest(fd_selector s, int fd, fd_interest i) {
     selector_status ret = SELECTOR_SUCCESS;
 
-    if(NULL == s || INVALID_FD(fd)) {
+    if(NULL == s || INVALID_FD(s, fd) || (size_t) fd >= s->fd_size) {
         ret = SELECTOR_IARGS;
         goto finally;
     }
@@ -424,8 +877,11 @@ selector_set_interest(fd_selector s, int fd, fd_interest i) {
         ret = SELECTOR_IARGS;
         goto finally;
     }
+    if(item->interest == i) {
+        goto finally; // nada cambia, evitamos la syscall en epoll
+    }
     item->interest = i;
-    items_update_fdset_for_fd(s, item);
+    ret = items_update_interest(s, item, fd);
 finally:
     return ret;
 }
@@ -434,7 +890,7 @@ selector_status
 selector_set_interest_key(struct selector_key *key, fd_interest i) {
     selector_status ret;
 
-    if(NULL == key || NULL == key->s || INVALID_FD(key->fd)) {
+    if(NULL == key || NULL == key->s || INVALID_FD(key->s, key->fd)) {
         ret = SELECTOR_IARGS;
     } else {
         ret = selector_set_interest(key->s, key->fd, i);
@@ -443,92 +899,313 @@ selector_set_interest_key(struct selector_key *key, fd_interest i) {
     return ret;
 }
 
+selector_status
+selector_set_handler(fd_selector s, int fd, const fd_handler *handler, void *data) {
+    selector_status ret = SELECTOR_SUCCESS;
+
+    if(NULL == s || NULL == handler || INVALID_FD(s, fd) || (size_t) fd >= s->fd_size) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+    struct item *item = s->fds + fd;
+    if(!ITEM_USED(item)) {
+        ret = SELECTOR_IARGS;
+        goto finally;
+    }
+    item->handler = handler;
+    item->data    = data;
+finally:
+    return ret;
+}
+
+/** cantidad de fds que representa cada palabra de un fd_set */
+#define FD_SET_WORD_BITS    (sizeof(unsigned long) * CHAR_BIT)
+#define FD_SET_WORDS        (sizeof(fd_set) / sizeof(unsigned long))
+
+/**
+ * compacta en s->ready los fds que select(2) marcó como listos.
+ *
+ * Recorre los fd_set de a palabras y solo inspecciona bit a bit aquellas
+ * que tienen algún fd listo, por lo que con pocos fds activos el costo no
+ * depende de max_fd.
+ */
+static size_t
+collect_ready_select(fd_selector s) {
+    const size_t words = (size_t)s->max_fd / FD_SET_WORD_BITS + 1;
+    size_t n = 0;
+
+    for(size_t w = 0; w < words && w < FD_SET_WORDS; w++) {
+        unsigned long r, wr;
+        memcpy(&r,  (char *)&s->slave_r + w * sizeof(r),  sizeof(r));
+        memcpy(&wr, (char *)&s->slave_w + w * sizeof(wr), sizeof(wr));
+        if(0 == (r | wr)) {
+            continue;
+        }
+        const int base = (int)(w * FD_SET_WORD_BITS);
+        for(int fd = base; fd < base + (int)FD_SET_WORD_BITS
+                           && fd <= s->max_fd; fd++) {
+            fd_interest ops = OP_NOOP;
+            if(FD_ISSET(fd, &s->slave_r)) {
+                ops |= OP_READ;
+            }
+            if(FD_ISSET(fd, &s->slave_w)) {
+                ops |= OP_WRITE;
+            }
+            if(OP_NOOP != ops) {
+                s->ready[n].fd  = fd;
+                s->ready[n].ops = ops;
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
 /**
- * se encarga de manejar los resultados del select.
+ * compacta en s->ready los eventos que retornó epoll_wait(2).
+ *
+ * EPOLLHUP y EPOLLERR se reportan como lectura y escritura, de la misma
+ * forma en que lo hace select(2), para que los handlers vean el error al
+ * operar sobre el fd.
+ */
+static size_t
+collect_ready_epoll(fd_selector s, const int nevents) {
+    size_t n = 0;
+
+    for(int i = 0; i < nevents; i++) {
+        const uint32_t events = s->events[i].events;
+        fd_interest ops = OP_NOOP;
+        if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            ops |= OP_READ;
+        }
+        if(events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+            ops |= OP_WRITE;
+        }
+        s->ready[n].fd  = s->events[i].data.fd;
+        s->ready[n].ops = ops;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * se encarga de despachar los eventos listos de la iteración.
  * se encuentra separado para facilitar el testing
  */
 static void
-handle_iteration(fd_selector s) {
-    int n = s->max_fd;
+handle_iteration(fd_selector s, const size_t nready) {
     struct selector_key key = {
         .s = s,
     };
 
-    for (int i = 0; i <= n; i++) {
-        struct item *item = s->fds + i;
-        if(ITEM_USED(item)) {
-            key.fd   = item->fd;
-            key.data = item->data;
-            if(FD_ISSET(item->fd, &s->slave_r)) {
-                if(OP_READ & item->interest) {
-                    if(0 == item->handler->handle_read) {
-                        assert(("OP_READ arrived but no handler. bug!" == 0));
-                    } else {
-                        item->handler->handle_read(&key);
-                    }
+    for(size_t i = 0; i < nready; i++) {
+        const struct ready_event *ev = s->ready + i;
+        struct item *item = s->fds + ev->fd;
+
+        // un handler previo pudo haber desregistrado el fd, o haberlo
+        // reutilizado para un registro nuevo cuyo estado no se consultó.
+        if(!ITEM_USED(item) || item->epoch == s->epoch) {
+            continue;
+        }
+        key.fd   = item->fd;
+        key.data = item->data;
+        if(ev->ops & OP_READ) {
+            if(OP_READ & item->interest) {
+                if(0 == item->handler->handle_read) {
+                    assert(("OP_READ arrived but no handler. bug!" == 0));
+                } else {
+                    item->handler->handle_read(&key);
                 }
             }
-            if(FD_ISSET(item->fd, &s->slave_w)) {
-                if(OP_WRITE & item->interest) {
-                    if(0 == item->handler->handle_write) {
-                        assert(("OP_WRITE arrived but no handler. bug!" == 0));
-                    } else {
-                        item->handler->handle_write(&key);
-                    }
+        }
+        if(ev->ops & OP_WRITE) {
+            // el handler de lectura puede haber registrado un fd que hizo
+            // crecer (realloc) s->fds, o desregistrado este fd y registrado
+            // otro con el mismo número en esta misma iteración
+            item = s->fds + ev->fd;
+            if(ITEM_USED(item) && item->epoch != s->epoch && (OP_WRITE & item->interest)) {
+                key.data = item->data;
+                if(0 == item->handler->handle_write) {
+                    assert(("OP_WRITE arrived but no handler. bug!" == 0));
+                } else {
+                    item->handler->handle_write(&key);
                 }
             }
         }
     }
 }
 
+/** despacha la notificación de que terminó el trabajo bloqueante de `fd' */
+static void
+notify_dispatch(fd_selector s, const int fd) {
+    // el fd pudo haberse cerrado y reusado desde que se pidió el trabajo
+    if(fd < 0 || (size_t) fd >= s->fd_size) {
+        return;
+    }
+    struct item *item = s->fds + fd;
+    if(ITEM_USED(item) && item->handler->handle_block != NULL) {
+        struct selector_key key = {
+            .s    = s,
+            .fd   = item->fd,
+            .data = item->data,
+        };
+        item->handler->handle_block(&key);
+    }
+}
+
+/**
+ * desencola una notificación de la cola sin locks.
+ *
+ * @return el fd notificado o -1 si la cola está vacía (o el productor que
+ *         tomó la próxima celda todavía no terminó de escribirla).
+ */
+static int
+notify_dequeue(fd_selector s) {
+    const size_t pos = s->notify_head;
+    struct notify_cell *cell = s->notify + (pos & (NOTIFY_QUEUE_SIZE - 1));
+
+    if(atomic_load_explicit(&cell->seq, memory_order_acquire) != pos + 1) {
+        return -1;
+    }
+    const int fd = cell->fd;
+    // la celda queda libre para la vuelta siguiente de la cola
+    atomic_store_explicit(&cell->seq, pos + NOTIFY_QUEUE_SIZE, memory_order_release);
+    s->notify_head = pos + 1;
+    return fd;
+}
+
+/**
+ * encola una notificación en la cola sin locks.
+ *
+ * @return false si la cola está llena.
+ */
+static bool
+notify_enqueue(fd_selector s, const int fd) {
+    size_t pos = atomic_load_explicit(&s->notify_tail, memory_order_relaxed);
+    struct notify_cell *cell;
+
+    while(true) {
+        cell = s->notify + (pos & (NOTIFY_QUEUE_SIZE - 1));
+        const size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        // diferencia con signo para que no importe que las posiciones den la vuelta
+        const intptr_t dif = (intptr_t) seq - (intptr_t) pos;
+        if(dif == 0) {
+            // libre: la reservamos si ningún otro productor se adelantó
+            if(atomic_compare_exchange_weak_explicit(&s->notify_tail, &pos, pos + 1,
+                                   memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if(dif < 0) {
+            return false; // el consumidor todavía no liberó esta celda
+        } else {
+            pos = atomic_load_explicit(&s->notify_tail, memory_order_relaxed);
+        }
+    }
+    cell->fd = fd;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
 // lanza el handler de todas las tareas bloqueantes que ya se hayan resuelto
 static void
 handle_block_notifications(fd_selector s) {
-    struct selector_key key = {
-        .s = s,
-    };
+    if(atomic_load_explicit(&s->notify_pending, memory_order_acquire) == 0) {
+        return;
+    }
+    size_t done = 0;
+    int fd;
+    while(-1 != (fd = notify_dequeue(s))) {
+        notify_dispatch(s, fd);
+        done++;
+    }
+
     pthread_mutex_lock(&s->resolution_mutex);
-    struct blocking_job *aux = s->resolution_jobs;
-    for(struct blocking_job *j = aux; j != NULL ; ) {
+    struct blocking_job *jobs = s->resolution_jobs;
+    s->resolution_jobs = NULL;
+    pthread_mutex_unlock(&s->resolution_mutex);
 
-        struct item *item = s->fds + j->fd;
-        if(ITEM_USED(item)) {
-            key.fd   = item->fd;
-            key.data = item->data;
-            item->handler->handle_block(&key);
-        }
-        
+    for(struct blocking_job *j = jobs, *aux; j != NULL ; ) {
+        notify_dispatch(s, j->fd);
+        done++;
         aux = j;
         j = j->next;
         free(aux);
     }
-    s->resolution_jobs = 0;
-    pthread_mutex_unlock(&s->resolution_mutex);
+    atomic_fetch_sub_explicit(&s->notify_pending, done, memory_order_relaxed);
 }
 
 
+selector_status
+selector_wakeup(fd_selector s) {
+    selector_status ret = SELECTOR_SUCCESS;
+
+    if(!atomic_exchange_explicit(&s->wake_pending, true, memory_order_acq_rel)) {
+        const uint64_t one = 1;
+        if(-1 == write(s->wake_fd, &one, sizeof(one)) && errno != EAGAIN) {
+            atomic_store_explicit(&s->wake_pending, false, memory_order_relaxed);
+            ret = SELECTOR_IO;
+        }
+    }
+    return ret;
+}
+
 selector_status
 selector_notify_block(fd_selector s, const int fd) {
     selector_status ret = SELECTOR_SUCCESS;
 
-    // TODO(juan): usar un pool
-    struct blocking_job *job = malloc(sizeof(*job));
-    if(job == NULL) {
-        ret = SELECTOR_ENOMEM;
-        goto finally;
+    // se cuenta antes de encolar: el selector puede verla pendiente antes de
+    // que esté en la cola, pero nunca despacharla sin que esté contada
+    atomic_fetch_add_explicit(&s->notify_pending, 1, memory_order_release);
+
+    if(!notify_enqueue(s, fd)) {
+        // cola llena: va a la lista con lock
+        struct blocking_job *job = malloc(sizeof(*job));
+        if(job == NULL) {
+            atomic_fetch_sub_explicit(&s->notify_pending, 1, memory_order_relaxed);
+            ret = SELECTOR_ENOMEM;
+            goto finally;
+        }
+        job->s  = s;
+        job->fd = fd;
+
+        pthread_mutex_lock(&s->resolution_mutex);
+        job->next = s->resolution_jobs;
+        s->resolution_jobs = job;
+        pthread_mutex_unlock(&s->resolution_mutex);
     }
-    job->s  = s;
-    job->fd = fd;
 
-    // encolamos en el selector los resultados
-    pthread_mutex_lock(&s->resolution_mutex);
-    job->next = s->resolution_jobs;
-    s->resolution_jobs = job;
-    pthread_mutex_unlock(&s->resolution_mutex);
+    ret = selector_wakeup(s);
+
+finally:
+    return ret;
+}
+
+/** variante de selector_select para el backend epoll */
+static selector_status
+selector_select_epoll(fd_selector s) {
+    selector_status ret = SELECTOR_SUCCESS;
 
-    // notificamos al hilo principal
-    pthread_kill(s->selector_thread, conf.signal);
+    const struct timespec wait = timers_wait(s);
+    const int timeout = wait.tv_sec * 1000 + wait.tv_nsec / 1000000;
 
+    int n = epoll_wait(s->epoll_fd, s->events, s->events_size, timeout);
+    s->now_ms = timers_clock(s);
+    if(-1 == n) {
+        switch(errno) {
+            case EAGAIN:
+            case EINTR:
+                // si una señal nos interrumpio. ok!
+                break;
+            default:
+                ret = SELECTOR_IO;
+                goto finally;
+        }
+    } else {
+        s->epoch++;
+        handle_iteration(s, collect_ready_epoll(s, n));
+    }
+    handle_block_notifications(s);
+    handle_timeouts(s);
 finally:
     return ret;
 }
@@ -537,14 +1214,17 @@ selector_status
 selector_select(fd_selector s) {
     selector_status ret = SELECTOR_SUCCESS;
 
+    if(SELECTOR_BACKEND_EPOLL == s->backend) {
+        return selector_select_epoll(s);
+    }
+
     memcpy(&s->slave_r, &s->master_r, sizeof(s->slave_r));
     memcpy(&s->slave_w, &s->master_w, sizeof(s->slave_w));
-    memcpy(&s->slave_t, &s->master_t, sizeof(s->slave_t));
-
-    s->selector_thread = pthread_self();
+    s->slave_t = timers_wait(s);
 
     int fds = pselect(s->max_fd + 1, &s->slave_r, &s->slave_w, 0, &s->slave_t,
-                      &emptyset);
+                      NULL);
+    s->now_ms = timers_clock(s);
     if(-1 == fds) {
         switch(errno) {
             case EAGAIN:
@@ -569,10 +1249,12 @@ selector_select(fd_selector s) {
 
         }
     } else {
-        handle_iteration(s);
+        s->epoch++;
+        handle_iteration(s, collect_ready_select(s));
     }
     if(ret == SELECTOR_SUCCESS) {
         handle_block_notifications(s);
+        handle_timeouts(s);
     }
 finally:
     return ret;
@@ -9,6 +9,7 @@
 #include <time.h>
 #include <unistd.h>  // close
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include <arpa/inet.h>
 
@@ -17,6 +18,11 @@
 #include "../include/auth.h"
 #include "../include/disector.h"
 #include "../include/buffer.h"
+#include "../include/relay.h"
+#include "../include/dnscache.h"
+#include "../include/bufpool.h"
+#include "../include/users.h"
+#include "../include/authverify.h"
 
 #include "../include/stm.h"
 #include "../include/socks5nio.h"
@@ -24,23 +30,87 @@
 
 #define N(x) (sizeof(x)/sizeof((x)[0]))
 
-#define RAW_BUFFER_SIZE 1024
+#define RAW_BUFFER_SIZE 512
 
-// Estadisticas del servidor proxy a ser consultadas por el protocolo de monitoreo
-uint32_t historic_connections = 0;
-uint32_t current_connections  = 0;
-uint32_t bytes_transferred    = 0;
+/**
+ * lecturas seguidas que llenan el buffer de un sentido del COPY para
+ * duplicarlo, y que ocupan menos de un cuarto para reducirlo a la mitad.
+ */
+#define COPY_GROW_READS   2
+#define COPY_SHRINK_READS 16
+
+/**
+ * Estadisticas del servidor proxy a ser consultadas por el protocolo de
+ * monitoreo. Cada worker escribe solo las suyas; el monitor las suma.
+ * Se alinean a una línea de cache para que los workers no se pisen.
+ */
+struct socks5_stats {
+    _Alignas(64)
+    atomic_uint_least32_t historic_connections;
+    atomic_uint_least32_t current_connections;
+    atomic_uint_least32_t bytes_transferred;
+    /** structs socks5 en uso y alocados en el slab del worker */
+    atomic_uint_least32_t slots_used;
+    atomic_uint_least32_t slots_allocated;
+    /** vueltas del selector del worker */
+    atomic_uint_least32_t selector_iterations;
+};
+
+static struct socks5_stats worker_stats[MAX_WORKERS];
+
+/** estadisticas del worker que corre en este hilo */
+static _Thread_local struct socks5_stats *stats = &worker_stats[0];
+
+#define STATS_ADD(field, n) \
+    atomic_fetch_add_explicit(&stats->field, (n), memory_order_relaxed)
+#define STATS_SUB(field, n) \
+    atomic_fetch_sub_explicit(&stats->field, (n), memory_order_relaxed)
 
 uint32_t socksv5_historic_connections() {
-    return historic_connections;
+    uint32_t ret = 0;
+    for(unsigned i = 0; i < MAX_WORKERS; i++)
+        ret += atomic_load_explicit(&worker_stats[i].historic_connections, memory_order_relaxed);
+    return ret;
 }
 
 uint32_t socksv5_current_connections() {
-    return current_connections;
+    uint32_t ret = 0;
+    for(unsigned i = 0; i < MAX_WORKERS; i++)
+        ret += atomic_load_explicit(&worker_stats[i].current_connections, memory_order_relaxed);
+    return ret;
 }
 
 uint32_t socksv5_bytes_transferred() {
-    return bytes_transferred;
+    uint32_t ret = 0;
+    for(unsigned i = 0; i < MAX_WORKERS; i++)
+        ret += atomic_load_explicit(&worker_stats[i].bytes_transferred, memory_order_relaxed);
+    return ret;
+}
+
+uint32_t socksv5_slots_used() {
+    uint32_t ret = 0;
+    for(unsigned i = 0; i < MAX_WORKERS; i++)
+        ret += atomic_load_explicit(&worker_stats[i].slots_used, memory_order_relaxed);
+    return ret;
+}
+
+uint32_t socksv5_slots_allocated() {
+    uint32_t ret = 0;
+    for(unsigned i = 0; i < MAX_WORKERS; i++)
+        ret += atomic_load_explicit(&worker_stats[i].slots_allocated, memory_order_relaxed);
+    return ret;
+}
+
+uint32_t socksv5_selector_iterations() {
+    uint32_t ret = 0;
+    for(unsigned i = 0; i < MAX_WORKERS; i++)
+        ret += atomic_load_explicit(&worker_stats[i].selector_iterations, memory_order_relaxed);
+    return ret;
+}
+
+void
+socksv5_selector_iteration(void) {
+    STATS_ADD(selector_iterations, 1);
 }
 
 /** maquina de estados general */
@@ -79,11 +149,24 @@ enum socks_v5state {
      *
      * Transiciones:
      *   - AUTH_READ            mientras el mensaje no este completo
+     *   - AUTH_VERIFY          si hay que consultar al verificador externo
      *   - AUTH_WRITE           cuando está completo
      *   - ERROR                ante cualquier error (IO/parseo)
     */
     AUTH_READ,
 
+    /**
+     * espera la respuesta del verificador externo de credenciales
+     *
+     * Intereses:
+     *     - OP_NOOP sobre client_fd. Espera que el verificador responda
+     *
+     * Transiciones:
+     *   - AUTH_WRITE           cuando llega la respuesta
+     *   - REQUEST_READ         si se aceptaron y el request ya llegó
+    */
+    AUTH_VERIFY,
+
     /**
      * informa al cliente si la autenticación fue exitosa o no.
      *
@@ -128,13 +211,18 @@ enum socks_v5state {
     REQUEST_RESOLV,
 
     /**
-     * Espera que se establezca la conexion al origin server
+     * Espera que se establezca la conexion al origin server. Si el nombre
+     * resolvió a varias direcciones se prueban en paralelo (Happy Eyeballs,
+     * RFC 8305): intercalando familias y escalonadas cada
+     * CONNECT_ATTEMPT_DELAY. La primera que conecta pasa a ser el origin_fd
+     * y el resto se cierran al salir del estado.
      * 
      * Intereses:
-     *     - OP_WRITE sobre origin_fd
+     *     - OP_WRITE sobre cada intento de conexion
      *     - OP_NOOP sobre client_fd
      *
      * Transiciones:
+     *   - REQUEST_CONNECTING   mientras queden intentos en curso
      *   - REQUEST_WRITE        se haya logrado o no establecer la conexion
     */
     REQUEST_CONNECTING,
@@ -158,8 +246,8 @@ enum socks_v5state {
      * copia bytes entre client_fd y origin_fd
      * 
      * Intereses: (tanto para client_fd como para origin_fd)
-     *     - OP_READ  si hay espacio libre para escribir en el buffer de lectura
-     *     - OP_WRITE si hay bytes para leer en el buffer de escritura
+     *     - OP_READ  si hay espacio libre para escribir en el buffer (o pipe) de lectura
+     *     - OP_WRITE si hay bytes para leer en el buffer (o pipe) de escritura
      *
      * Transiciones:
      *   - DONE    cuando no queda nada mas por copiar
@@ -181,6 +269,8 @@ struct hello_st {
     struct hello_parser   parser;
     /** el método de autenticación seleccionado */
     uint8_t               method;
+    /** si esta conexión debe autenticarse, según los usuarios al saludar */
+    bool                  auth_required;
 };
 
 /** usado por REQUEST_READ, REQUEST_WRITE, REQUEST_RESOLV */
@@ -215,9 +305,18 @@ struct auth_st {
 
     /** el resumen de la respuesta a enviar */
     enum auth_response_status  status;
+};
 
-    /** referencia al campo de struct socks5 */
-    char                       *uname;
+/** demora entre intentos de conexion sucesivos (RFC 8305 sección 5) */
+#define CONNECT_ATTEMPT_DELAY   250
+/** cantidad máxima de direcciones del origin server que se prueban */
+#define CONNECT_MAX_CANDIDATES  16
+
+/** dirección del origin server a probar, y su intento si está en curso */
+struct connect_candidate {
+    const struct sockaddr *addr;
+    socklen_t              addr_len;
+    int                    fd;
 };
 
 /** usado por REQUEST_CONNECTING */
@@ -226,6 +325,16 @@ struct connecting {
     int      *origin_fd;
     int      *client_fd;
     enum socks_response_status *status;
+
+    /** direcciones intercaladas por familia, en el orden en que se prueban */
+    struct connect_candidate    candidates[CONNECT_MAX_CANDIDATES];
+    unsigned                    ncandidates;
+    /** siguiente candidato a probar */
+    unsigned                    next;
+    /** intentos en curso */
+    unsigned                    pending;
+    /** intento que lleva el timeout para lanzar el siguiente, o -1 */
+    int                         timer_fd;
 };
 
 /** usado por COPY */
@@ -234,6 +343,18 @@ struct copy {
     int         *fd;
     /** el buffer que se utiliza para hacer la copia */
     buffer      *rb, *wb;
+    /** espacio del handshake que rb todavía usa para mandar lo que quedó, o NULL */
+    uint8_t     *raw;
+    /** pipes para copiar con splice(), cumplen el mismo rol que rb y wb */
+    struct relay_pipe *rp, *wp;
+    /** si lo leído de este extremo puede copiarse con splice() */
+    bool        splice;
+    /** el disector, que necesita ver los bytes mientras sea POP3; NULL si no */
+    struct disector_parser *dp;
+    /** tamaño del bloque a tomar del bufpool para rb */
+    size_t      rb_size;
+    /** lecturas seguidas que llenaron rb, y que ocuparon menos de un cuarto */
+    unsigned    full_reads, short_reads;
     // seria como el "intereses" de este extremo del copy, teniendo prendidos 1 o varios de los bits de OP_READ, OP_WRITE y OP_NOOP. Sirve para cerrar la escritura o la lectura.
     fd_interest duplex;
     struct copy *other; // el otro extremo del copy
@@ -241,97 +362,363 @@ struct copy {
 
 /*
  * Si bien cada estado tiene su propio struct que le da un alcance
- * acotado, disponemos de la siguiente estructura para hacer una única
+ * acotado, disponemos de las siguientes estructuras para hacer una única
  * alocación cuando recibimos la conexión.
  *
+ * El estado se divide en dos: struct socks5 tiene lo que usa el COPY, que
+ * es lo que se toca en cada evento de un túnel establecido, y struct
+ * socks5_handshake todo lo que solo hace falta hasta establecerlo (parsers,
+ * direcciones, la resolución DNS, los buffers chicos y el disector). El
+ * segundo se libera al entrar en COPY, o más tarde si el disector todavía
+ * necesita ver el tráfico, así que un túnel establecido ocupa unas pocas
+ * líneas de cache contiguas.
+ *
  * Se utiliza un contador de referencias (references) para saber cuando debemos
- * liberarlo finalmente, y un pool para reusar alocaciones previas.
+ * liberarlo finalmente, y un slab por worker para reusar alocaciones previas.
  */
-struct socks5 {
-    
+struct socks5_handshake {
     /** informacion del cliente */
-    int                           client_fd;
     struct sockaddr_storage       client_addr; // direccion IP
     socklen_t                     client_addr_len; // tamaño de IP (v4 o v6)
-    char                          *client_uname;
+    /** usuario con el que se autenticó, para los logs */
+    char                          client_uname[USERS_MAX_LEN + 1];
 
-    /** resolucion DNS de la direc del origin server */
-    struct addrinfo               *origin_resolution;
-    /** intento actual de la direccion del origin server */
-    struct addrinfo               *origin_resolution_current;
+    /** consulta de las credenciales al verificador externo */
+    struct authverify_waiter      verify;
+
+    /** resolucion DNS de la direc del origin server, pertenece al cache */
+    struct dnscache_waiter        dns;
+    const struct dns_result       *origin_resolution;
 
     /** informacion del origin server */
-    int                           origin_fd;
     struct sockaddr_storage       origin_addr;
     socklen_t                     origin_addr_len;
     int                           origin_domain;
     enum    socks_addr_type       dest_addr_type;
     union   socks_addr            dest_addr;
 
-    /** maquinas de estados */
-    struct state_machine          stm;
-
     /** estados para el client_fd */
     union {
         struct hello_st           hello;
         struct auth_st            auth;
         struct request_st         request;
-        struct copy               copy;
     } client;
 
     /** estados para el origin_fd */
     union {
         struct connecting         conn;
-        struct copy               copy;
     } orig;
 
     struct disector_parser        dp;
 
-    /** buffers para ser usados read_buffer, write_buffer */
+    /** espacio de read_buffer y write_buffer hasta llegar a COPY */
     // Los mismos se van reusando para todos los estados (van quedando limpios luego de cada transicion), y deberian tener al menos 10 bytes de tamaño para poder almacenar una request_marshall() completa.
     uint8_t raw_buff_a[RAW_BUFFER_SIZE], raw_buff_b[RAW_BUFFER_SIZE];
-    buffer read_buffer, write_buffer;
+};
+
+struct socks5_slab;
+
+struct socks5 {
+    /** extremos del túnel */
+    int                           client_fd;
+    int                           origin_fd;
+
+    /** estados del COPY para el client_fd y el origin_fd */
+    struct copy                   client_copy;
+    struct copy                   origin_copy;
+
+    /**
+     * buffers del COPY, en el sentido cliente -> origin y al revés. En COPY
+     * tienen un bloque del bufpool solo mientras tienen datos en vuelo.
+     */
+    buffer                        read_buffer, write_buffer;
+
+    /** pipes para el copy con splice(), en el mismo sentido que read_buffer y write_buffer */
+    struct relay_pipe             pipe_a, pipe_b;
+
+    /** maquinas de estados */
+    struct state_machine          stm;
 
     /** cantidad de referencias a este objeto. si es 1 se debe destruir. */
-    unsigned references;
+    unsigned                      references;
+
+    /** estado del handshake, NULL una vez liberado */
+    struct socks5_handshake       *hs;
 
-    struct socks5 *next; // siguiente en la pool
+    struct socks5_slab            *owner; // slab del que salió
 };
 
-/** Pool de structs socks5 para ser reusados */
-static const unsigned   max_pool = 50; // tamaño max
-static unsigned         pool_size = 0; // tamaño actual
-static struct socks5    *pool = 0;     // pool propiamente dicho
+/** alineación de los objetos del slab: cada uno empieza en su línea de cache */
+#define SLAB_ALIGN 64
 
-static const struct state_definition *socks5_describe_states(void);
+/** bloque de objetos alocado de una vez; los objetos siguen al encabezado */
+struct slab_block {
+    struct slab_block *next;
+};
 
-static struct socks5 *socks5_new(int client_fd) {
-    struct socks5 *ret;
+/** objeto libre: el enlace se guarda en el propio objeto */
+struct slab_free {
+    struct slab_free *next;
+};
 
-    if (pool == NULL) {
-        ret = malloc(sizeof(*ret));
-    } else {
-        ret = pool;
-        pool = pool->next;
-        ret->next = 0; // lo sacamos de la pool para retornarlo y usarlo
+/** objetos de un mismo tamaño, tomados y devueltos en O(1) */
+struct slab {
+    struct slab_block *blocks;
+    struct slab_free  *free;
+    /** tamaño de cada objeto, múltiplo de SLAB_ALIGN */
+    size_t             size;
+    unsigned           allocated, used;
+};
+
+/**
+ * Slab de estados de conexión de cada worker: una conexión vive siempre en
+ * el worker que la aceptó. Los objetos se alocan por bloques (el primero con
+ * los preasignados al iniciar, después de a SLAB_BLOCK_OBJECTS) que no se
+ * devuelven al heap hasta que termina el servidor, y los libres forman una
+ * lista, así que tomar y devolver uno es O(1). Hay uno para struct socks5,
+ * otro para struct socks5_handshake y otro para struct socks5_pending.
+ *
+ * Nunca hay más de `max' conexiones en uso, contando las pendientes. Al llegar al tope el worker deja
+ * de aceptar conexiones (saca el interés de lectura de sus sockets pasivos)
+ * hasta que se libere alguna.
+ */
+#define SLAB_BLOCK_OBJECTS 64
+
+/** milisegundos hasta reintentar aceptar luego de quedarse sin fds o memoria */
+#define ACCEPT_RETRY_DELAY 100
+
+struct socks5_slab {
+    struct slab         conns, handshakes, pendings;
+    unsigned            max;
+
+    /**
+     * sockets pasivos que dejaron de aceptar por llegar al tope o por
+     * quedarse sin descriptores o memoria
+     */
+    fd_selector         paused_s;
+    int                 paused[2];
+    unsigned            npaused;
+};
+
+static struct socks5_slab slabs[MAX_WORKERS];
+
+/**
+ * conexión aceptada que todavía no mandó nada. Recién cuando llega un primer
+ * byte que puede ser un hello SOCKS se toma un struct socks5 del slab, así
+ * que los port scanners y health checks que no mandan nada (o mandan otra
+ * cosa) solo ocupan esto.
+ */
+struct socks5_pending {
+    struct sockaddr_storage       client_addr;
+    socklen_t                     client_addr_len;
+    struct socks5_slab            *owner;
+};
+
+/** slab del worker que corre en este hilo */
+static _Thread_local struct socks5_slab *slab = &slabs[0];
+
+void
+socksv5_worker_init(const unsigned id) {
+    assert(id < MAX_WORKERS);
+    stats = &worker_stats[id];
+    slab  = &slabs[id];
+}
+
+/** agrega al slab un bloque de `n' objetos libres */
+static int
+slab_grow(struct slab *sl, unsigned n) {
+    uint8_t *b = aligned_alloc(SLAB_ALIGN, SLAB_ALIGN + n * sl->size);
+    if(b == NULL) {
+        return -1;
+    }
+    ((struct slab_block *) b)->next = sl->blocks;
+    sl->blocks = (struct slab_block *) b;
+    for(unsigned i = n; i > 0; i--) {
+        struct slab_free *o = (struct slab_free *) (b + SLAB_ALIGN + (i - 1) * sl->size);
+        o->next  = sl->free;
+        sl->free = o;
     }
+    sl->allocated += n;
+    return 0;
+}
 
-    if (ret == NULL)
+/** toma un objeto libre, agregando un bloque de hasta `n' si no hay */
+static void *
+slab_get(struct slab *sl, unsigned n) {
+    struct slab_free *ret = NULL;
+
+    if(sl->free == NULL && (n == 0 || -1 == slab_grow(sl, n))) {
         goto finally;
-    
+    }
+    ret      = sl->free;
+    sl->free = ret->next;
+    sl->used++;
+finally:
+    return ret;
+}
+
+static void
+slab_put(struct slab *sl, void *o) {
+    struct slab_free *f = o;
+    f->next  = sl->free;
+    sl->free = f;
+    sl->used--;
+}
+
+static void
+slab_destroy(struct slab *sl) {
+    struct slab_block *next, *b;
+    for(b = sl->blocks; b != NULL; b = next) {
+        next = b->next;
+        free(b);
+    }
+    sl->blocks    = NULL;
+    sl->free      = NULL;
+    sl->allocated = 0;
+    sl->used      = 0;
+}
+
+/** `size' redondeado a SLAB_ALIGN */
+#define SLAB_SIZE(size) (((size) + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN)
+
+int
+socksv5_pool_init(const unsigned workers, const unsigned prealloc, const unsigned max) {
+    assert(workers > 0 && workers <= MAX_WORKERS);
+    const unsigned worker_max      = (max + workers - 1) / workers;
+    const unsigned worker_prealloc = (prealloc + workers - 1) / workers;
+
+    for(unsigned i = 0; i < workers; i++) {
+        struct socks5_slab *sl = slabs + i;
+        sl->max             = worker_max;
+        sl->conns.size      = SLAB_SIZE(sizeof(struct socks5));
+        sl->handshakes.size = SLAB_SIZE(sizeof(struct socks5_handshake));
+        sl->pendings.size   = SLAB_SIZE(sizeof(struct socks5_pending));
+        const unsigned n = worker_prealloc < worker_max ? worker_prealloc : worker_max;
+        if(n > 0 && (-1 == slab_grow(&sl->conns, n) || -1 == slab_grow(&sl->handshakes, n))) {
+            return -1;
+        }
+        atomic_store_explicit(&worker_stats[i].slots_allocated, sl->conns.allocated, memory_order_relaxed);
+    }
+    return 0;
+}
+
+/** cantidad de objetos a agregar al slab `sl' del worker si se queda sin libres */
+static unsigned
+slab_block_objects(const struct slab *sl) {
+    const unsigned n = slab->max - sl->allocated;
+    return n > SLAB_BLOCK_OBJECTS ? SLAB_BLOCK_OBJECTS : n;
+}
+
+/** toma un struct socks5 y su handshake del slab del hilo, o NULL si se llegó al tope */
+static struct socks5 *
+slab_alloc(void) {
+    struct socks5 *ret = NULL;
+    struct socks5_handshake *hs = NULL;
+
+    if(slab->conns.used >= slab->max) {
+        goto finally;
+    }
+    ret = slab_get(&slab->conns, slab_block_objects(&slab->conns));
+    hs  = slab_get(&slab->handshakes, slab_block_objects(&slab->handshakes));
+    if(ret == NULL || hs == NULL) {
+        if(ret != NULL) {
+            slab_put(&slab->conns, ret);
+            ret = NULL;
+        }
+        if(hs != NULL) {
+            slab_put(&slab->handshakes, hs);
+        }
+        goto finally;
+    }
     memset(ret, 0x00, sizeof(*ret)); // inicializamos en 0 todo
+    memset(hs,  0x00, sizeof(*hs));
+    ret->hs    = hs;
+    ret->owner = slab;
+    STATS_ADD(slots_used, 1);
+    atomic_store_explicit(&stats->slots_allocated, slab->conns.allocated, memory_order_relaxed);
+finally:
+    return ret;
+}
+
+/** devuelve el handshake de `s' a su slab */
+static void
+socks5_handshake_free(struct socks5 *s) {
+    if(s->hs != NULL) {
+        dnscache_release(&s->hs->dns);
+        authverify_cancel(&s->hs->verify);
+        slab_put(&s->owner->handshakes, s->hs);
+        s->hs = NULL;
+    }
+}
+
+/** vuelve a aceptar en los sockets pasivos que se habían pausado */
+static void
+slab_resume_accept(struct socks5_slab *sl) {
+    for(unsigned i = 0; i < sl->npaused; i++) {
+        // falla si el selector ya se está destruyendo, no importa
+        selector_set_interest(sl->paused_s, sl->paused[i], OP_READ);
+    }
+    sl->npaused = 0;
+}
+
+/**
+ * devuelve un struct a su slab. Si el worker había dejado de aceptar
+ * conexiones por el tope, vuelve a hacerlo.
+ */
+static void
+slab_free(struct socks5 *s) {
+    struct socks5_slab *sl = s->owner;
+
+    socks5_handshake_free(s);
+    slab_put(&sl->conns, s);
+    atomic_fetch_sub_explicit(&worker_stats[sl - slabs].slots_used, 1, memory_order_relaxed);
+    slab_resume_accept(sl);
+}
+
+/**
+ * deja de aceptar en el socket pasivo `key' hasta que se libere un struct.
+ * Con `retry' se vuelve a intentar dentro de ACCEPT_RETRY_DELAY aunque no
+ * se libere ninguno, ya que lo que falta (descriptores, memoria) puede
+ * liberarse por fuera del worker.
+ */
+static void
+slab_pause_accept(struct selector_key *key, bool retry) {
+    bool paused = false;
+    for(unsigned i = 0; i < slab->npaused; i++) {
+        paused = paused || slab->paused[i] == key->fd;
+    }
+    if(!paused && slab->npaused < N(slab->paused)
+    && SELECTOR_SUCCESS == selector_set_interest_key(key, OP_NOOP)) {
+        slab->paused_s = key->s;
+        slab->paused[slab->npaused++] = key->fd;
+        paused = true;
+    }
+    if(paused && retry) {
+        selector_set_timeout(key->s, key->fd, ACCEPT_RETRY_DELAY);
+    }
+}
+
+static const struct state_definition *socks5_describe_states(void);
+
+static struct socks5 *socks5_new(int client_fd) {
+    struct socks5 *ret = slab_alloc();
+
+    if (ret == NULL)
+        goto finally;
 
     ret->origin_fd = -1;
     ret->client_fd = client_fd;
-    ret->client_addr_len = sizeof(ret->client_addr);
+    ret->hs->client_addr_len = sizeof(ret->hs->client_addr);
 
     ret->stm.initial = HELLO_READ;
     ret->stm.max_state = ERROR;
     ret->stm.states = socks5_describe_states();
     stm_init(&ret->stm);
 
-    buffer_init(&ret->read_buffer, N(ret->raw_buff_a), ret->raw_buff_a);
-    buffer_init(&ret->write_buffer, N(ret->raw_buff_b), ret->raw_buff_b);
+    buffer_init(&ret->read_buffer, N(ret->hs->raw_buff_a), ret->hs->raw_buff_a);
+    buffer_init(&ret->write_buffer, N(ret->hs->raw_buff_b), ret->hs->raw_buff_b);
+    relay_pipe_init(&ret->pipe_a);
+    relay_pipe_init(&ret->pipe_b);
 
     ret->references = 1;
 
@@ -339,19 +726,22 @@ finally:
     return ret;
 }
 
-/** realmente destruye */
+/**
+ * devuelve al bufpool el bloque de `b', si tiene uno, y lo deja sin espacio.
+ * Mientras dura el handshake los buffers usan el espacio propio del mismo.
+ */
 static void
-socks5_destroy_(struct socks5* s) {
-    if(s->origin_resolution != NULL) {
-        freeaddrinfo(s->origin_resolution);
-        s->origin_resolution = 0;
+copy_buffer_release(struct socks5 *s, buffer *b) {
+    if(b->data != NULL && (s->hs == NULL
+    || (b->data != s->hs->raw_buff_a && b->data != s->hs->raw_buff_b))) {
+        bufpool_put(b->data, b->limit - b->data);
     }
-    free(s);
+    memset(b, 0, sizeof(*b));
 }
 
 /**
  * destruye un  `struct socks5', tiene en cuenta las referencias
- * y el pool de objetos.
+ * y el slab de objetos.
  */
 static void
 socks5_destroy(struct socks5 *s) {
@@ -359,13 +749,11 @@ socks5_destroy(struct socks5 *s) {
         // nada para hacer
     } else if(s->references == 1) {
         if(s != NULL) {
-            if(pool_size < max_pool) {
-                s->next = pool;
-                pool    = s;
-                pool_size++;
-            } else {
-                socks5_destroy_(s);
-            }
+            copy_buffer_release(s, &s->read_buffer);
+            copy_buffer_release(s, &s->write_buffer);
+            relay_pipe_close(&s->pipe_a);
+            relay_pipe_close(&s->pipe_b);
+            slab_free(s);
         }
     } else {
         s->references -= 1;
@@ -374,10 +762,11 @@ socks5_destroy(struct socks5 *s) {
 
 void
 socksv5_pool_destroy(void) {
-    struct socks5 *next, *s;
-    for(s = pool; s != NULL ; s = next) {
-        next = s->next;
-        socks5_destroy_(s);
+    for(unsigned i = 0; i < MAX_WORKERS; i++) {
+        slab_destroy(&slabs[i].conns);
+        slab_destroy(&slabs[i].handshakes);
+        slab_destroy(&slabs[i].pendings);
+        memset(slabs + i, 0, sizeof(slabs[i]));
     }
 }
 
@@ -390,112 +779,234 @@ socksv5_pool_destroy(void) {
 static void socksv5_read   (struct selector_key *key);
 static void socksv5_write  (struct selector_key *key);
 static void socksv5_block  (struct selector_key *key);
+static void socksv5_timeout(struct selector_key *key);
 static void socksv5_close  (struct selector_key *key);
+static unsigned state_timeout(const unsigned state);
 // Los handlers particulares de cada estado se definen en los hooks del estado particular (struct state_definition), estos son los generales para los socket activos de los clientes
 static const struct fd_handler socks5_handler = {
     .handle_read   = socksv5_read,
     .handle_write  = socksv5_write,
     .handle_close  = socksv5_close,
     .handle_block  = socksv5_block,
+    .handle_timeout = socksv5_timeout,
 };
 
-/** Intenta aceptar la nueva conexión entrante*/
+/** primer byte de todo mensaje hello */
+#define SOCKS_VERSION 0x05
+
+static void socksv5_pending_read   (struct selector_key *key);
+static void socksv5_pending_reject (struct selector_key *key);
+static void socksv5_pending_close  (struct selector_key *key);
+/** handlers de una conexión aceptada que todavía no mandó su primer byte */
+static const struct fd_handler pending_handler = {
+    .handle_read    = socksv5_pending_read,
+    .handle_close   = socksv5_pending_close,
+    .handle_timeout = socksv5_pending_reject,
+};
+
+static unsigned accept_batch = DEFAULT_ACCEPT_BATCH;
+
 void
-socksv5_passive_accept(struct selector_key *key) {
-    struct sockaddr_storage       client_addr;
-    socklen_t                     client_addr_len = sizeof(client_addr);
-    struct socks5                *state           = NULL;
+socksv5_set_accept_batch(unsigned n) {
+    accept_batch = n;
+}
+
+/**
+ * acepta una conexión entrante.
+ *
+ * @return false si no hay que seguir aceptando en esta iteración
+ */
+static bool
+socksv5_accept_one(struct selector_key *key) {
+    struct socks5_pending *pending;
+
+    if(slab->conns.used + slab->pendings.used >= slab->max) {
+        // sin lugar para otra conexión: que espere en el backlog
+        slab_pause_accept(key, false);
+        return false;
+    }
+    pending = slab_get(&slab->pendings, slab_block_objects(&slab->pendings));
+    if(pending == NULL) {
+        slab_pause_accept(key, true);
+        return false;
+    }
+    pending->client_addr_len = sizeof(pending->client_addr);
+    pending->owner           = slab;
 
-    const int client = accept(key->fd, (struct sockaddr*) &client_addr,
-                                                          &client_addr_len);
+    const int client = accept_nio(key->fd, (struct sockaddr*) &pending->client_addr,
+                                                              &pending->client_addr_len);
     if(client == -1) {
-        goto fail;
+        slab_put(&slab->pendings, pending);
+        if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+            // el socket pasivo seguiría listo y el selector no se bloquearía
+            slab_pause_accept(key, true);
+        }
+        // EAGAIN: se vació la cola. El resto (p.e. ECONNABORTED) se reintenta la próxima vez
+        return false;
     }
-    if(selector_fd_set_nio(client) == -1) {
-        goto fail;
+
+    // el estado de la conexión se toma recién cuando llega el primer byte del hello
+    if(SELECTOR_SUCCESS != selector_register(key->s, client, &pending_handler,
+                                              OP_READ, pending)) {
+        close(client);
+        slab_put(&slab->pendings, pending);
+        return false;
     }
+    selector_set_timeout(key->s, client, state_timeout(HELLO_READ) * 1000);
+    return true;
+}
 
-    // instancio estructura de estado
-    state = socks5_new(client);
+/**
+ * el cliente de una conexión pendiente mandó algo. Se mira el primer byte
+ * sin consumirlo: si puede ser un hello SOCKS se instancia el estado de la
+ * conexión y el hello se procesa en el acto; si no, se la cierra sin tocar
+ * el slab de conexiones.
+ */
+static void
+socksv5_pending_read(struct selector_key *key) {
+    struct socks5_pending *pending = key->data;
+    struct socks5         *state   = NULL;
+    uint8_t                version;
+
+    const ssize_t n = recv(key->fd, &version, 1, MSG_PEEK);
+    if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if(n != 1 || version != SOCKS_VERSION) {
+        goto reject;
+    }
+    state = socks5_new(key->fd);
     if(state == NULL) {
-        // sin un estado, nos es imposible manejaro.
-        // tal vez deberiamos apagar accept() hasta que detectemos
-        // que se liberó alguna conexión.
-        goto fail;
+        goto reject;
     }
-    memcpy(&state->client_addr, &client_addr, client_addr_len);
-    state->client_addr_len = client_addr_len;
+    memcpy(&state->hs->client_addr, &pending->client_addr, pending->client_addr_len);
+    state->hs->client_addr_len = pending->client_addr_len;
 
-    // handlers default que avanzan la maquina de estados, nos registramos para lectura esperando el HELLO_READ.
+    // handlers default que avanzan la maquina de estados. El plazo del HELLO_READ sigue corriendo desde el accept.
     // Los handlers particulares de cada estado se definen en los hooks del estado particular (struct state_definition)
-    if(SELECTOR_SUCCESS != selector_register(key->s, client, &socks5_handler,
-                                              OP_READ, state)) {
-        goto fail;
+    if(SELECTOR_SUCCESS != selector_set_handler(key->s, key->fd, &socks5_handler, state)) {
+        socks5_destroy(state);
+        goto reject;
     }
-    return ;
-fail:
-    if(client != -1) {
-        close(client);
+    // el lugar en el tope lo ocupa ahora la conexión, no hace falta reanudar el accept
+    slab_put(&pending->owner->pendings, pending);
+    key->data = state;
+    socksv5_read(key);
+    return;
+
+reject:
+    socksv5_pending_reject(key);
+}
+
+/** cierra una conexión pendiente: no mandó nada a tiempo, o no habla SOCKS */
+static void
+socksv5_pending_reject(struct selector_key *key) {
+    const int fd = key->fd;
+    // handle_close devuelve el registro a su slab
+    selector_unregister_fd(key->s, fd);
+    close(fd);
+}
+
+static void
+socksv5_pending_close(struct selector_key *key) {
+    struct socks5_pending *pending = key->data;
+    struct socks5_slab    *sl      = pending->owner;
+
+    slab_put(&sl->pendings, pending);
+    slab_resume_accept(sl);
+}
+
+/** Acepta hasta accept_batch conexiones entrantes */
+void
+socksv5_passive_accept(struct selector_key *key) {
+    for(unsigned i = 0; i < accept_batch && socksv5_accept_one(key); i++) {
+        // siguiente conexión de la cola
     }
-    socks5_destroy(state);
+}
+
+void
+socksv5_passive_retry(struct selector_key *key) {
+    slab_resume_accept(slab);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 // HELLO
 ////////////////////////////////////////////////////////////////////////////////
 
-bool is_auth_on = true;
-size_t registered_users = 0;
-
 /** callback que utiliza el parser cada vez que lee un metodo nuevo para elegir alguno de ellos */
 static void
 on_hello_method(struct hello_parser *p, const uint8_t method) {
-    uint8_t *selected  = p->data;
+    struct hello_st *d = p->data;
 
-    if ((!is_auth_on && SOCKS_HELLO_NO_AUTHENTICATION_REQUIRED == method)
-    || (is_auth_on && SOCKS_HELLO_USERNAME_PASSWORD == method)) {
-       *selected = method; // escribe sobre struct hello_st method
+    if ((!d->auth_required && SOCKS_HELLO_NO_AUTHENTICATION_REQUIRED == method)
+    || (d->auth_required && SOCKS_HELLO_USERNAME_PASSWORD == method)) {
+       d->method = method;
     }
 }
 
 /** inicializa las variables de los estados HELLO_… */
 static void
 hello_read_init(const unsigned state, struct selector_key *key) {
-    struct hello_st *d = &ATTACHMENT(key)->client.hello;
+    struct hello_st *d = &ATTACHMENT(key)->hs->client.hello;
 
     d->rb                              = &(ATTACHMENT(key)->read_buffer);
     d->wb                              = &(ATTACHMENT(key)->write_buffer);
-    d->parser.data                     = &d->method;
+    d->parser.data                     = d;
     d->method                          = SOCKS_HELLO_NO_ACCEPTABLE_METHODS;
+    // se decide por conexión: los usuarios pueden cambiar con una recarga
+    d->auth_required                   = users_count() > 0 || authverify_enabled();
     d->parser.on_authentication_method = on_hello_method, hello_parser_init(&d->parser);
+}
+
+/**
+ * trae bytes del cliente al buffer de lectura del handshake. Si todavía
+ * quedan bytes sin consumir es porque el cliente mandó el mensaje junto con
+ * el anterior (pipelining): se procesan esos sin volver a leer del socket.
+ *
+ * Devuelve false si el cliente cerró la conexión o falló la lectura.
+ */
+static bool
+handshake_recv(struct selector_key *key, buffer *b) {
+    uint8_t *ptr;
+    size_t  count;
+    ssize_t n;
 
-    if (registered_users == 0)
-        is_auth_on = false; // turn off authentication method
+    if (buffer_can_read(b)) {
+        return true;
+    }
+    ptr = buffer_write_ptr(b, &count);
+    n = recv(key->fd, ptr, count, 0);
+    if (n <= 0) {
+        return false;
+    }
+    buffer_write_adv(b, n);
+    return true;
 }
 
 static unsigned
 hello_process(const struct hello_st* d);
 
+static unsigned
+hello_write(struct selector_key *key);
+
 /** lee todos los bytes del mensaje de tipo `hello' y inicia su proceso */
 static unsigned
 hello_read(struct selector_key *key) {
-    struct hello_st *d = &ATTACHMENT(key)->client.hello;
+    struct hello_st *d = &ATTACHMENT(key)->hs->client.hello;
     unsigned  ret      = HELLO_READ;
         bool  error    = false;
-     uint8_t *ptr;
-      size_t  count;
-     ssize_t  n;
 
-    ptr = buffer_write_ptr(d->rb, &count);
-    n = recv(key->fd, ptr, count, 0);
-    if(n > 0) {
-        buffer_write_adv(d->rb, n);
+    if(handshake_recv(key, d->rb)) {
         const enum hello_state st = hello_consume(d->rb, &d->parser, &error);
-        if(hello_is_done(st, 0)) {
-            if(SELECTOR_SUCCESS == selector_set_interest_key(key, OP_WRITE)) {
-                ret = hello_process(d);
-            } else {
-                ret = ERROR;
+        if(!error && hello_is_done(st, 0)) {
+            ret = hello_process(d);
+            if(HELLO_WRITE == ret) {
+                if(SOCKS_HELLO_NO_ACCEPTABLE_METHODS != d->method && buffer_can_read(d->rb)) {
+                    // el cliente ya mandó el mensaje siguiente: la respuesta sale junto con la suya
+                    ret = d->auth_required ? AUTH_READ : REQUEST_READ;
+                } else {
+                    ret = hello_write(key);
+                }
             }
         }
     } else {
@@ -519,13 +1030,18 @@ hello_process(const struct hello_st* d) {
 /** libera los recursos al salir de HELLO_READ */
 static void
 hello_read_close(const unsigned state, struct selector_key *key) {
-    struct hello_st *d = &ATTACHMENT(key)->client.hello;
+    struct hello_st *d = &ATTACHMENT(key)->hs->client.hello;
     hello_parser_close(&d->parser);
 }
 
+/**
+ * escribe la respuesta al mensaje `hello'. Se llama apenas se procesa el
+ * mensaje, sin esperar a que el selector avise que se puede escribir; solo si
+ * el socket no la acepta entera se espera a OP_WRITE.
+ */
 static unsigned
 hello_write(struct selector_key *key) { // key corresponde a un client_fd
-    struct hello_st *d = &ATTACHMENT(key)->client.hello;
+    struct hello_st *d = &ATTACHMENT(key)->hs->client.hello;
 
     unsigned ret       = HELLO_WRITE;
     uint8_t  *ptr;
@@ -533,22 +1049,24 @@ hello_write(struct selector_key *key) { // key corresponde a un client_fd
     ssize_t  n;
     
     ptr = buffer_read_ptr(d->wb, &count);
-    // esto deberia llamarse cuando el select lo despierta y sabe que se puede escribir al menos 1 byte, por eso no checkeamos el EWOULDBLOCK
     n = send(key->fd, ptr, count, MSG_NOSIGNAL);
     if (n == -1) {
-        ret = ERROR;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            ret = ERROR;
     } else {
         buffer_read_adv(d->wb, n);
         // si terminamos de mandar toda la response del HELLO, hacemos transicion HELLO_WRITE -> AUTH_READ o HELLO_WRITE -> REQUEST_READ
         if (!buffer_can_read(d->wb)) {
             if (SELECTOR_SUCCESS == selector_set_interest_key(key, OP_READ)) {
                 // en caso de que haya fallado el handshake del hello, el cliente es el que cerrara la conexion
-                ret = is_auth_on ? AUTH_READ : REQUEST_READ;
+                ret = d->auth_required ? AUTH_READ : REQUEST_READ;
             } else {
                 ret = ERROR;
             }
         }
     }
+    if (HELLO_WRITE == ret && SELECTOR_SUCCESS != selector_set_interest_key(key, OP_WRITE))
+        ret = ERROR;
 
     return ret;
 }
@@ -557,89 +1075,36 @@ hello_write(struct selector_key *key) { // key corresponde a un client_fd
 // AUTH
 ////////////////////////////////////////////////////////////////////////////////
 
-struct user {
-    char    uname[0xff];    // null terminated
-    char    passwd[0xff];   // null terminated
-};
-
-struct user users[MAX_USERS];
-
-int socksv5_register_user(char *uname, char *passwd) {
-    if (registered_users >= MAX_USERS)
-        return 1; // maximo numero de usuarios alcanzado
-    
-    for (size_t i = 0; i < registered_users; i++) {
-        if (strcmp(uname, users[i].uname) == 0)
-            return -1; // username ya existente
-    }
-
-    // insertamos al final (podrian insertarse en orden alfabetico para mas eficiencia pero al ser pocos es irrelevante)
-    strncpy(users[registered_users].uname, uname, 0xff);
-    strncpy(users[registered_users++].passwd, passwd, 0xff);
-    return 0;
-}
-
-int socksv5_unregister_user(char *uname) {
-    for (size_t i = 0; i < registered_users; i++) {
-        if (strcmp(uname, users[i].uname) == 0) {
-            // movemos los elementos para tapar el hueco que pudo haber quedado
-            if (i + 1 < registered_users)
-                memmove(&users[i], &users[i+1], sizeof(struct user) * (registered_users - (i + 1)));
-            registered_users--;
-            return 0;
-        }
-    }
-    return -1;  // usuario no encontrado
-}
-
-// entrega la lista de usuarios con formato <usuario>\0<usuario>
-uint16_t socksv5_get_users(char unames[MAX_USERS * 0xff]) {
-    uint16_t dlen = 0;
-    for (size_t i = 0; i < registered_users; i++) {
-        strcpy(unames + dlen, users[i].uname);
-        dlen += strlen(users[i].uname) + 1; // incluimos el \0
-    }
-    return dlen > 1 ? dlen - 1 : 0; // no pone el ultimo \0
-}
-
 /** inicializa las variables de los estados AUTH_ */
 static void
 auth_init(const unsigned state, struct selector_key *key) {
-    struct auth_st *d       = &ATTACHMENT(key)->client.auth;
+    struct auth_st *d       = &ATTACHMENT(key)->hs->client.auth;
     d->rb                   = &(ATTACHMENT(key)->read_buffer);
     d->wb                   = &(ATTACHMENT(key)->write_buffer);
     d->parser.auth          = &d->auth;
     d->status               = auth_status_failure;
     auth_parser_init(&d->parser);
-    d->uname                = ATTACHMENT(key)->client_uname;
 }
 
 static unsigned
 auth_process(struct selector_key *key, struct auth_st *d);
 
+static unsigned
+auth_write(struct selector_key *key);
+
 /** lee todos los bytes del mensaje de tipo 'auth' e inicia su proceso */
 static unsigned
 auth_read(struct selector_key *key) {
-    struct auth_st *d       = &ATTACHMENT(key)->client.auth;
+    struct auth_st *d       = &ATTACHMENT(key)->hs->client.auth;
 
     buffer *b            = d->rb;
     unsigned ret         = AUTH_READ;
     bool error           = false;
-    uint8_t *ptr;
-    size_t count;
-    ssize_t n;
 
-    ptr = buffer_write_ptr(b, &count);
-    n = recv(key->fd, ptr, count, 0);
-    if (n > 0) {
-        buffer_write_adv(b, n);
+    if (handshake_recv(key, b)) {
         int st = auth_consume(b, &d->parser, &error);
-        if (auth_is_done(st, 0)) {
-            if(SELECTOR_SUCCESS == selector_set_interest_key(key, OP_WRITE)) {
-                ret = auth_process(key, d);
-            } else {
-                ret = ERROR;
-            }
+        if (!error && auth_is_done(st, 0)) {
+            ret = auth_process(key, d);
         }
     } else {
         ret = ERROR;
@@ -648,30 +1113,65 @@ auth_read(struct selector_key *key) {
     return error ? ERROR : ret;
 }
 
+/** longitud de un campo de struct auth, que no termina en \0 si está lleno */
+static uint8_t
+auth_field_len(const char *field, const size_t size) {
+    const char *end = memchr(field, '\0', size);
+    return end == NULL ? size : (size_t) (end - field);
+}
+
+/**
+ * arma la respuesta de la autenticación y la manda, salvo que el request ya
+ * haya llegado: en ese caso sale junto con la suya.
+ */
 static unsigned
-auth_process(struct selector_key *key, struct auth_st *d) {
-    bool authenticated = false;
-    
-    for (size_t i = 0; i < registered_users; i++) {
-        if (strncmp(d->auth.uname, users[i].uname, 0xff) == 0 &&
-            strncmp(d->auth.passwd, users[i].passwd, 0xff) == 0) {
-            // sets client uname in struct socks5
-            ATTACHMENT(key)->client_uname = users[i].uname;
-            authenticated = true;
-            break;
-        }
+auth_reply(struct selector_key *key, struct auth_st *d, const bool authenticated) {
+    if (authenticated) {
+        // el estado de auth se pisa con el del request: copiamos el nombre para los logs
+        char *uname = ATTACHMENT(key)->hs->client_uname;
+        const size_t len = auth_field_len(d->auth.uname, sizeof(d->auth.uname));
+        memcpy(uname, d->auth.uname, len);
+        uname[len] = '\0';
     }
     d->status = authenticated ? auth_status_succeeded : auth_status_failure;
 
     if (-1 == auth_marshall(d->wb, d->status))
         abort();
 
-    return AUTH_WRITE;
+    if (d->status == auth_status_succeeded && buffer_can_read(d->rb))
+        return REQUEST_READ;
+    return auth_write(key);
+}
+
+/**
+ * verifica las credenciales: primero contra los usuarios locales y, si no
+ * están, contra el verificador externo si hay uno.
+ */
+static unsigned
+auth_process(struct selector_key *key, struct auth_st *d) {
+    const bool local = users_check(d->auth.uname, d->auth.passwd);
+    if (local || !authverify_enabled())
+        return auth_reply(key, d, local);
+
+    struct authverify_waiter *w = &ATTACHMENT(key)->hs->verify;
+    const uint8_t ulen = auth_field_len(d->auth.uname, sizeof(d->auth.uname));
+    const uint8_t plen = auth_field_len(d->auth.passwd, sizeof(d->auth.passwd));
+    if (authverify_pending == authverify_check(w, d->auth.uname, ulen, d->auth.passwd, plen, key, socksv5_block)) {
+        return SELECTOR_SUCCESS == selector_set_interest_key(key, OP_NOOP) ? AUTH_VERIFY : ERROR;
+    }
+    return auth_reply(key, d, w->granted);
+}
+
+/** llegó la respuesta del verificador. Se llama en el "on_block_ready" de AUTH_VERIFY */
+static unsigned
+auth_verify_done(struct selector_key *key) {
+    struct auth_st *d = &ATTACHMENT(key)->hs->client.auth;
+    return auth_reply(key, d, ATTACHMENT(key)->hs->verify.granted);
 }
 
 static unsigned
 auth_write(struct selector_key *key) {
-    struct auth_st *d       = &ATTACHMENT(key)->client.auth;
+    struct auth_st *d       = &ATTACHMENT(key)->hs->client.auth;
     
     unsigned ret = AUTH_WRITE;
     buffer *b    = d->wb;
@@ -682,7 +1182,8 @@ auth_write(struct selector_key *key) {
     ptr = buffer_read_ptr(b, &count);
     n = send(key->fd, ptr, count, MSG_NOSIGNAL);
     if (n == -1) {
-        ret = ERROR;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            ret = ERROR;
     } else {
         buffer_read_adv(b, n);
         if (!buffer_can_read(b)) {
@@ -699,6 +1200,8 @@ auth_write(struct selector_key *key) {
             
         }
     }
+    if (AUTH_WRITE == ret && SELECTOR_SUCCESS != selector_set_interest_key(key, OP_WRITE))
+        ret = ERROR;
 
     return ret;
 }
@@ -710,7 +1213,7 @@ auth_write(struct selector_key *key) {
 /** inicializa las variables de los estados REQUEST_ */
 static void
 request_init(const unsigned state, struct selector_key *key) {
-    struct request_st *d    = &ATTACHMENT(key)->client.request;
+    struct request_st *d    = &ATTACHMENT(key)->hs->client.request;
 
     d->rb                   = &(ATTACHMENT(key)->read_buffer);
     d->wb                   = &(ATTACHMENT(key)->write_buffer);
@@ -719,9 +1222,9 @@ request_init(const unsigned state, struct selector_key *key) {
     request_parser_init(&d->parser);
     d->client_fd            = &ATTACHMENT(key)->client_fd;
     d->origin_fd            = &ATTACHMENT(key)->origin_fd;
-    d->origin_addr          = &ATTACHMENT(key)->origin_addr;
-    d->origin_addr_len      = &ATTACHMENT(key)->origin_addr_len;
-    d->origin_domain        = &ATTACHMENT(key)->origin_domain;
+    d->origin_addr          = &ATTACHMENT(key)->hs->origin_addr;
+    d->origin_addr_len      = &ATTACHMENT(key)->hs->origin_addr_len;
+    d->origin_domain        = &ATTACHMENT(key)->hs->origin_domain;
 }
 
 static unsigned request_process(struct selector_key *key, struct request_st *d);
@@ -729,19 +1232,13 @@ static unsigned request_process(struct selector_key *key, struct request_st *d);
 /** lee todos los bytes del mensaje de tipo 'request' e inicia su proceso */
 static unsigned
 request_read(struct selector_key *key) {
-    struct request_st *d = &ATTACHMENT(key)->client.request;
+    struct request_st *d = &ATTACHMENT(key)->hs->client.request;
 
     buffer *b            = d->rb;
     unsigned ret         = REQUEST_READ;
     bool error           = false;
-    uint8_t *ptr;
-    size_t count;
-    ssize_t n;
 
-    ptr = buffer_write_ptr(b, &count);
-    n = recv(key->fd, ptr, count, 0);
-    if (n > 0) {
-        buffer_write_adv(b, n);
+    if (handshake_recv(key, b)) {
         int st = request_consume(b, &d->parser, &error);
         if (!error && request_is_done(st, NULL))
             ret = request_process(key, d);
@@ -755,8 +1252,8 @@ request_read(struct selector_key *key) {
 static unsigned
 request_connect(struct selector_key *key, struct request_st *d);
 
-static void *
-request_resolv_blocking(void *data);
+static unsigned
+request_resolv_done(struct selector_key *key);
 
 static unsigned
 request_error_write(struct selector_key *key, struct request_st *d, enum socks_response_status status) {
@@ -772,41 +1269,40 @@ request_error_write(struct selector_key *key, struct request_st *d, enum socks_r
 static unsigned
 request_process(struct selector_key *key, struct request_st *d) {
     unsigned ret;
-    pthread_t tid;
 
     switch (d->request.cmd) {
         case socks_req_cmd_connect:
             switch (d->request.dest_addr_type) {
                 case socks_req_addrtype_ipv4: {
-                    ATTACHMENT(key)->origin_domain = AF_INET;
+                    ATTACHMENT(key)->hs->origin_domain = AF_INET;
                     d->request.dest_addr.ipv4.sin_port = d->request.dest_port;
-                    ATTACHMENT(key)->origin_addr_len = sizeof(d->request.dest_addr.ipv4);
-                    memcpy(&ATTACHMENT(key)->origin_addr, &d->request.dest_addr, sizeof(d->request.dest_addr.ipv4));
+                    ATTACHMENT(key)->hs->origin_addr_len = sizeof(d->request.dest_addr.ipv4);
+                    memcpy(&ATTACHMENT(key)->hs->origin_addr, &d->request.dest_addr, sizeof(d->request.dest_addr.ipv4));
                     ret = request_connect(key, d);
                     break;
                 }
                 case socks_req_addrtype_ipv6: {
-                    ATTACHMENT(key)->origin_domain = AF_INET6;
+                    ATTACHMENT(key)->hs->origin_domain = AF_INET6;
                     d->request.dest_addr.ipv6.sin6_port = d->request.dest_port;
-                    ATTACHMENT(key)->origin_addr_len = sizeof(d->request.dest_addr.ipv6);
-                    memcpy(&ATTACHMENT(key)->origin_addr, &d->request.dest_addr, sizeof(d->request.dest_addr.ipv6));
+                    ATTACHMENT(key)->hs->origin_addr_len = sizeof(d->request.dest_addr.ipv6);
+                    memcpy(&ATTACHMENT(key)->hs->origin_addr, &d->request.dest_addr, sizeof(d->request.dest_addr.ipv6));
                     ret = request_connect(key, d);
                     break;
                 }
                 case socks_req_addrtype_domain: {
-                    struct selector_key *k = malloc(sizeof(*key));
-                    if (k == NULL) {
-                        ret = request_error_write(key, d, status_general_SOCKS_server_failure);
-                    } else {
-                        memcpy(k, key, sizeof(*key));
-                        // CREACION DE HILO PARA RESOLUCION DNS
-                        if (-1 == pthread_create(&tid, 0, request_resolv_blocking, k)) {
-                            ret = request_error_write(key, d, status_general_SOCKS_server_failure);
-                            free(k);
-                        } else {
+                    // la resolucion DNS sale del cache, o la hace el resolver nativo o un hilo del pool
+                    switch (dnscache_resolve(&ATTACHMENT(key)->hs->dns, d->request.dest_addr.fqdn, ntohs(d->request.dest_port), key, socksv5_block)) {
+                        case dnscache_hit:
+                            ret = request_resolv_done(key);
+                            break;
+                        case dnscache_pending:
                             ret = REQUEST_RESOLV;
                             selector_set_interest_key(key, OP_NOOP);
-                        }
+                            break;
+                        default:
+                            // cola llena, rechazamos en lugar de acumular esperas
+                            ret = request_error_write(key, d, status_general_SOCKS_server_failure);
+                            break;
                     }
                     break;
                 }
@@ -825,122 +1321,182 @@ request_process(struct selector_key *key, struct request_st *d) {
     return ret;
 }
 
-// EJECUTADA POR UN HILO APARTE, creado por request_process()
-static void *
-request_resolv_blocking(void *data) {
-    struct selector_key *key = (struct selector_key *) data;
-    struct socks5       *s   = ATTACHMENT(key);
-
-    pthread_detach(pthread_self());
-    s->origin_resolution = 0;
-    struct addrinfo hints = {
-        .ai_family      = AF_UNSPEC,    // allow IPv4 or IPv6
-        .ai_socktype    = SOCK_STREAM,  // datagram socket
-        .ai_flags       = AI_PASSIVE,   // for wildcard IP address
-        .ai_protocol    = 0,            // any protocol
-        .ai_canonname   = NULL,
-        .ai_addr        = NULL,
-        .ai_next        = NULL,
-    };
-
-    char buff[7];
-    snprintf(buff, sizeof(buff), "%d", ntohs(s->client.request.request.dest_port));
-
-    if (getaddrinfo(s->client.request.request.dest_addr.fqdn, buff, &hints, &s->origin_resolution) != 0) {
-        s->client.request.status = status_general_SOCKS_server_failure;
-        s->origin_resolution = 0;
-    }
-
-    selector_notify_block(key->s, key->fd);
-
-    free(data); // era una copia del estado original
-    return 0;    
-}
-
-/** procesa el resultado de la resolucion de nombres. se llama en el "on_block_ready" del state REQUEST_RESOLV. */
+/** procesa el resultado de la resolucion de nombres. se llama en el "on_block_ready" del state REQUEST_RESOLV (directamente desde el resolver nativo o por selector_notify_block), o si el nombre estaba en el cache. */
 static unsigned
 request_resolv_done(struct selector_key *key) {
-    struct request_st *d = &ATTACHMENT(key)->client.request;
+    struct request_st *d = &ATTACHMENT(key)->hs->client.request;
     struct socks5 *s     = ATTACHMENT(key);
 
-    if (s->origin_resolution == 0)
+    s->hs->origin_resolution = dnscache_result(&s->hs->dns);
+    if (s->hs->origin_resolution == 0)
         return request_error_write(key, d, status_host_unreachable);
 
-    s->origin_resolution_current = s->origin_resolution;
-    s->origin_domain = s->origin_resolution->ai_family;
-    s->origin_addr_len = s->origin_resolution->ai_addrlen;
-    memcpy(&s->origin_addr, s->origin_resolution->ai_addr, s->origin_resolution->ai_addrlen);
+    const struct dns_result_addr *first = s->hs->origin_resolution->addrs;
+    s->hs->origin_domain = first->u.sa.sa_family;
+    s->hs->origin_addr_len = first->len;
+    memcpy(&s->hs->origin_addr, &first->u, first->len);
     return request_connect(key, d);
 }
 
-// debe retornar un state
-// OJO: key puede ser tanto de un cliente como de un origin (esto ultimo si se re-llama esta funcion desde el request_connecting())
+/**
+ * venció el plazo de la resolución: se deja de esperarla. Si la
+ * notificación llega igual, socksv5_block la descarta.
+ */
 static unsigned
-request_connect(struct selector_key *key, struct request_st *d) {
-    bool error                        = false;
-    int *fd                           = d->origin_fd;
-    enum socks_response_status status = d->status;
+request_resolv_timeout(struct selector_key *key) {
+    struct socks5 *s = ATTACHMENT(key);
+    dnscache_release(&s->hs->dns);
+    return request_error_write(key, &s->hs->client.request, status_ttl_expired);
+}
 
-    // si ya habiamos asignado una vez el fd y estamos tratando de conectarnos con una IP diferente, cerramos el viejo y lo creamos devuelta
-    if (ATTACHMENT(key)->stm.current->state == REQUEST_CONNECTING) {
-        selector_unregister_fd(key->s, *fd);
-        close(*fd);
+/**
+ * arma la lista de candidatos intercalando las familias de la resolución,
+ * empezando por IPv6 si la hay (RFC 8305 sección 4) sin importar el orden en
+ * que las haya dejado el resolver. Sin
+ * resolución el único candidato es la dirección literal del request.
+ */
+static void
+connect_candidates(struct socks5 *s) {
+    struct connecting *c = &s->hs->orig.conn;
+    c->ncandidates = 0;
+
+    if(s->hs->origin_resolution == NULL) {
+        c->candidates[0].addr     = (const struct sockaddr *)&s->hs->origin_addr;
+        c->candidates[0].addr_len = s->hs->origin_addr_len;
+        c->ncandidates            = 1;
+    } else {
+        const struct dns_result *r = s->hs->origin_resolution;
+        int first = r->addrs[0].u.sa.sa_family;
+        for(unsigned i = 0; i < r->n; i++) {
+            if(r->addrs[i].u.sa.sa_family == AF_INET6) {
+                first = AF_INET6;
+                break;
+            }
+        }
+        // siguiente dirección de la primera familia y de la otra
+        unsigned a = 0, b = 0;
+        while(a < r->n && r->addrs[a].u.sa.sa_family != first) {
+            a++;
+        }
+        while(b < r->n && r->addrs[b].u.sa.sa_family == first) {
+            b++;
+        }
+        while((a < r->n || b < r->n) && c->ncandidates < CONNECT_MAX_CANDIDATES) {
+            unsigned *turns[] = { &a, &b };
+            for(unsigned i = 0; i < N(turns) && c->ncandidates < CONNECT_MAX_CANDIDATES; i++) {
+                unsigned k = *turns[i];
+                if(k >= r->n) {
+                    continue;
+                }
+                c->candidates[c->ncandidates].addr     = &r->addrs[k].u.sa;
+                c->candidates[c->ncandidates].addr_len = r->addrs[k].len;
+                c->ncandidates++;
+                // avanza a la siguiente dirección de la misma familia
+                do {
+                    k++;
+                } while(k < r->n && (r->addrs[k].u.sa.sa_family == first) != (i == 0));
+                *turns[i] = k;
+            }
+        }
+    }
+    for(unsigned i = 0; i < c->ncandidates; i++) {
+        c->candidates[i].fd = -1;
     }
+    c->next     = 0;
+    c->pending  = 0;
+    c->timer_fd = -1;
+}
 
-    *fd = socket(ATTACHMENT(key)->origin_domain, SOCK_STREAM, 0);
+/** abre un intento de conexion al candidato. Retorna 0 o el errno del fallo */
+static int
+connect_attempt(fd_selector sel, struct socks5 *s, struct connect_candidate *cand) {
+    int error = 0;
+    const int fd = socket(cand->addr->sa_family, SOCK_STREAM, 0);
 
-    if (*fd == -1) {
-        status = status_general_SOCKS_server_failure;
-        error = true;
-        goto finally;
+    if(fd == -1) {
+        return errno;
+    }
+    if(selector_fd_set_nio(fd) == -1) {
+        error = errno;
+    } else if(-1 == connect(fd, cand->addr, cand->addr_len) && errno != EINPROGRESS) {
+        error = errno;
+    } else if(SELECTOR_SUCCESS != selector_register(sel, fd, &socks5_handler, OP_WRITE, s)) {
+        // si conectó en el acto igual esperamos el OP_WRITE
+        error = ENOMEM;
+    }
+    if(error != 0) {
+        close(fd);
+    } else {
+        cand->fd = fd;
+        s->references += 1;
     }
+    return error;
+}
 
-    if (selector_fd_set_nio(*fd) == -1)
-        goto finally;
-    
-    if (-1 == connect(*fd, (const struct sockaddr *)&ATTACHMENT(key)->origin_addr, ATTACHMENT(key)->origin_addr_len)) {
-        if (errno == EINPROGRESS) {
-            // es lo esperable, hay que aguardar la conexion
-            // dejamos de escuchar del socket del cliente
-            selector_status st = selector_set_interest(key->s, ATTACHMENT(key)->client_fd, OP_NOOP);
-            if (SELECTOR_SUCCESS != st) {
-                error = true;
-                goto finally;
-            }
+/** cierra un intento de conexion que perdió o falló */
+static void
+connect_attempt_close(fd_selector sel, struct connecting *c, struct connect_candidate *cand) {
+    if(c->timer_fd == cand->fd) {
+        c->timer_fd = -1; // el timeout se cancela al desregistrar
+    }
+    selector_unregister_fd(sel, cand->fd);
+    close(cand->fd);
+    cand->fd = -1;
+    c->pending--;
+}
 
-            // esperamosla conexion en el nuevo socket
-            st = selector_register(key->s, *fd, &socks5_handler, OP_WRITE, key->data);
+/**
+ * lanza el intento con el siguiente candidato, salteando los que fallan en
+ * el acto (p.e. una familia sin ruta). Si quedan candidatos programa el
+ * lanzamiento del próximo dentro de CONNECT_ATTEMPT_DELAY.
+ *
+ * @return false si no se pudo lanzar ninguno.
+ */
+static bool
+connect_next(fd_selector sel, struct socks5 *s) {
+    struct connecting *c = &s->hs->orig.conn;
 
-            if (SELECTOR_SUCCESS != st) {
-                error = true;
-                goto finally;
+    if(c->timer_fd != -1) {
+        selector_set_timeout(sel, c->timer_fd, 0);
+        c->timer_fd = -1;
+    }
+    while(c->next < c->ncandidates) {
+        struct connect_candidate *cand = c->candidates + c->next++;
+        const int error = connect_attempt(sel, s, cand);
+        if(error == 0) {
+            c->pending++;
+            if(c->next < c->ncandidates
+               && SELECTOR_SUCCESS == selector_set_timeout(sel, cand->fd, CONNECT_ATTEMPT_DELAY)) {
+                c->timer_fd = cand->fd;
             }
-            ATTACHMENT(key)->references += 1;
-        } else {
-            status = errno_to_socks(errno);
-            error = true;
-            goto finally;
+            return true;
         }
-    } else {
-        // estamos conectados sin esperar, es imposible
-        abort();
+        s->hs->client.request.status = errno_to_socks(error);
     }
+    return false;
+}
 
-finally:
-    if (error) {
-        if (*fd != -1) {
-            close(*fd);
-            *fd = -1;
-        }
-        return request_error_write(key, d, status);
-    }
+// debe retornar un state. key es el del cliente
+static unsigned
+request_connect(struct selector_key *key, struct request_st *d) {
+    struct socks5 *s = ATTACHMENT(key);
+
+    connect_candidates(s);
+    d->status = status_general_SOCKS_server_failure;
 
+    // dejamos de escuchar del socket del cliente mientras conectamos
+    if(SELECTOR_SUCCESS != selector_set_interest(key->s, s->client_fd, OP_NOOP)) {
+        return request_error_write(key, d, status_general_SOCKS_server_failure);
+    }
+    if(!connect_next(key->s, s)) {
+        return request_error_write(key, d, d->status);
+    }
     return REQUEST_CONNECTING;
 }
 
 static void
 request_read_close(const unsigned state, struct selector_key *key) {
-    struct request_st *d = &ATTACHMENT(key)->client.request;
+    struct request_st *d = &ATTACHMENT(key)->hs->client.request;
     request_close(&d->parser);
 }
 
@@ -950,56 +1506,111 @@ request_read_close(const unsigned state, struct selector_key *key) {
 
 static void
 request_connecting_init(const unsigned state, struct selector_key *key) {
-    struct connecting *d = &ATTACHMENT(key)->orig.conn;
+    struct connecting *d = &ATTACHMENT(key)->hs->orig.conn;
     d->client_fd = &ATTACHMENT(key)->client_fd;
     d->origin_fd = &ATTACHMENT(key)->origin_fd;
-    d->status    = &ATTACHMENT(key)->client.request.status;
+    d->status    = &ATTACHMENT(key)->hs->client.request.status;
     d->wb        = &ATTACHMENT(key)->write_buffer;
 }
 
-/** la conexion ha sido establecida (o fallo) */
 static unsigned
-request_connecting(struct selector_key *key) { // key es un origin_fd
+request_write(struct selector_key *key);
+
+/** alguno de los intentos de conexion fue establecido (o falló) */
+static unsigned
+request_connecting(struct selector_key *key) { // key es un intento de conexion
     int error;
     socklen_t len = sizeof(error);
     struct socks5 *s     = ATTACHMENT(key);
-    struct connecting *d = &s->orig.conn;
+    struct connecting *d = &s->hs->orig.conn;
 
+    struct connect_candidate *cand = d->candidates;
+    struct connect_candidate *end  = d->candidates + d->ncandidates;
+    while(cand < end && cand->fd != key->fd) {
+        cand++;
+    }
+    assert(cand < end);
     if (getsockopt(key->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
-        *d->status = status_general_SOCKS_server_failure;
+        error = errno;
+    }
+
+    if (error == 0) {
+        // ganó: el resto de los intentos se cierran en request_connecting_close
+        if (d->timer_fd == key->fd) {
+            selector_set_timeout(key->s, key->fd, 0);
+            d->timer_fd = -1;
+        }
+        cand->fd = -1;
+        d->pending--;
+        *d->status    = status_succeeded;
+        *d->origin_fd = key->fd;
+        if (cand->addr != (const struct sockaddr *)&s->hs->origin_addr) {
+            s->hs->origin_domain   = cand->addr->sa_family;
+            s->hs->origin_addr_len = cand->addr_len;
+            memcpy(&s->hs->origin_addr, cand->addr, cand->addr_len);
+        }
     } else {
-        if (error == 0) {
-            *d->status = status_succeeded;
-            *d->origin_fd = key->fd;
-        } else if (s->client.request.request.dest_addr_type == socks_req_addrtype_domain && s->origin_resolution_current->ai_next != NULL) {
-            s->origin_resolution_current = s->origin_resolution_current->ai_next;
-            s->origin_domain = s->origin_resolution_current->ai_family;
-            s->origin_addr_len = s->origin_resolution_current->ai_addrlen;
-            memcpy(&s->origin_addr, s->origin_resolution_current->ai_addr, s->origin_resolution_current->ai_addrlen);
-            request_connect(key, &s->client.request);
+        *d->status = errno_to_socks(error);
+        connect_attempt_close(key->s, d, cand);
+        // no esperamos la demora: el siguiente candidato se prueba ya
+        if (connect_next(key->s, s) || d->pending > 0) {
             return REQUEST_CONNECTING;
-        } else {
-            *d->status = errno_to_socks(error);
         }
     }
 
-    if (s->client.request.request.dest_addr_type == socks_req_addrtype_domain) {
-        freeaddrinfo(s->origin_resolution);
-        s->origin_resolution = 0;
-        s->origin_resolution_current = 0;
+    if (s->hs->client.request.request.dest_addr_type == socks_req_addrtype_domain) {
+        dnscache_release(&s->hs->dns);
+        s->hs->origin_resolution = 0;
     }
 
-    if (-1 == request_marshall(s->client.request.wb, s->client.request.status)) {
-        s->client.request.status = status_general_SOCKS_server_failure;
+    if (-1 == request_marshall(s->hs->client.request.wb, s->hs->client.request.status)) {
+        s->hs->client.request.status = status_general_SOCKS_server_failure;
         abort();
     }
 
     selector_status ss = 0;
     ss |= selector_set_interest(key->s, *d->client_fd, OP_WRITE);
-    ss |= selector_set_interest_key(key, OP_NOOP);
+    if (*d->origin_fd != -1) {
+        ss |= selector_set_interest(key->s, *d->origin_fd, OP_NOOP);
+    }
+    if (SELECTOR_SUCCESS != ss) {
+        return ERROR;
+    }
+
+    // request_write() difiere en *d->status por lo que si falla pasara a estado de DONE/ERROR y sino a COPY.
+    // La respuesta se intenta mandar ya; si el cliente no tiene lugar queda esperando OP_WRITE
+    struct selector_key client_key = {
+        .s    = key->s,
+        .fd   = *d->client_fd,
+        .data = s,
+    };
+    return request_write(&client_key);
+}
+
+/**
+ * venció la demora del último intento: se lanza el siguiente en paralelo.
+ * Si el que venció es el plazo del estado, los intentos se cierran al salir.
+ */
+static unsigned
+request_connecting_timeout(struct selector_key *key) {
+    struct socks5 *s = ATTACHMENT(key);
+    if(key->fd == s->client_fd) {
+        return request_error_write(key, &s->hs->client.request, status_ttl_expired);
+    }
+    s->hs->orig.conn.timer_fd = -1;
+    connect_next(key->s, s);
+    return REQUEST_CONNECTING;
+}
 
-    // se llamara a request_write() en ambos casos, pero difieren en *d->status por lo que si falla pasara a estado de DONE/ERROR y sino a COPY
-    return SELECTOR_SUCCESS == ss ? REQUEST_WRITE : ERROR;
+/** cierra los intentos que perdieron (o que quedaron en curso ante un error) */
+static void
+request_connecting_close(const unsigned state, struct selector_key *key) {
+    struct connecting *d = &ATTACHMENT(key)->hs->orig.conn;
+    for (unsigned i = 0; i < d->next; i++) {
+        if (d->candidates[i].fd != -1) {
+            connect_attempt_close(key->s, d, d->candidates + i);
+        }
+    }
 }
 
 void log_request(enum socks_response_status status, const char *uname, struct request *request, const struct sockaddr *clientaddr, const struct sockaddr* originaddr);
@@ -1007,7 +1618,7 @@ void log_request(enum socks_response_status status, const char *uname, struct re
 /** escribe todos los bytes de la respuesta al mensaje 'request' */
 static unsigned
 request_write(struct selector_key *key) {
-    struct request_st *d = &ATTACHMENT(key)->client.request;
+    struct request_st *d = &ATTACHMENT(key)->hs->client.request;
 
     unsigned ret = REQUEST_WRITE;
     buffer *b    = d->wb;
@@ -1016,10 +1627,11 @@ request_write(struct selector_key *key) {
     ssize_t n;
 
     ptr = buffer_read_ptr(b, &count);
-    // si estamos aca es porque el select nos desperto y tiene que haber espacio para mandar al menos 1 byte (no puede bloquear)
+    // la primera vez se llama apenas se conecta con el origin, sin saber si hay lugar
     n = send(key->fd, ptr, count, MSG_NOSIGNAL);
     if (n == -1) {
-        ret = ERROR;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            ret = ERROR;
     } else {
         buffer_read_adv(b, n);
         if (!buffer_can_read(b)) {
@@ -1028,11 +1640,11 @@ request_write(struct selector_key *key) {
                 selector_set_interest(key->s, *d->client_fd, OP_READ);
                 selector_set_interest(key->s, *d->origin_fd, OP_READ);
                 // guardamos estos valores que necesitaremos luego para logear en la etapa posterior
-                memcpy(&ATTACHMENT(key)->dest_addr, &ATTACHMENT(key)->client.request.request.dest_addr, sizeof(union socks_addr));
-                ATTACHMENT(key)->dest_addr_type = ATTACHMENT(key)->client.request.request.dest_addr_type;
+                memcpy(&ATTACHMENT(key)->hs->dest_addr, &ATTACHMENT(key)->hs->client.request.request.dest_addr, sizeof(union socks_addr));
+                ATTACHMENT(key)->hs->dest_addr_type = ATTACHMENT(key)->hs->client.request.request.dest_addr_type;
                 // aumentamos los stats del servidor
-                historic_connections += 1;
-                current_connections  += 1;
+                STATS_ADD(historic_connections, 1);
+                STATS_ADD(current_connections, 1);
             } else {
                 ret = ERROR;
                 selector_set_interest(key->s, *d->client_fd, OP_NOOP);
@@ -1042,10 +1654,10 @@ request_write(struct selector_key *key) {
 
             log_request(
                 d->status,
-                ATTACHMENT(key)->client_uname,
-                &ATTACHMENT(key)->client.request.request,
-                (const struct sockaddr *) &ATTACHMENT(key)->client_addr,
-                (const struct sockaddr *) &ATTACHMENT(key)->origin_addr
+                ATTACHMENT(key)->hs->client_uname,
+                &ATTACHMENT(key)->hs->client.request.request,
+                (const struct sockaddr *) &ATTACHMENT(key)->hs->client_addr,
+                (const struct sockaddr *) &ATTACHMENT(key)->hs->origin_addr
             );
         }
     }
@@ -1058,39 +1670,184 @@ request_write(struct selector_key *key) {
 ////////////////////////////////////////////////////////////////////////////////
 
 bool is_disector_on = true;
+bool is_splice_on   = true;
 
 void
 socksv5_toggle_disector(bool to) {
     is_disector_on = to;
 }
 
+void
+socksv5_toggle_splice(bool to) {
+    is_splice_on = to;
+}
+
+/**
+ * toma del bufpool un bloque para el buffer de lectura de `d' si no tiene
+ * uno. El tamaño se ajusta según cómo vinieron las lecturas anteriores. Si
+ * no hay memoria el buffer queda sin espacio.
+ */
+static void
+copy_buffer_attach(struct copy *d) {
+    if(d->full_reads >= COPY_GROW_READS && d->rb_size < bufpool_max()) {
+        d->rb_size   *= 2;
+        d->full_reads = 0;
+    } else if(d->short_reads >= COPY_SHRINK_READS && d->rb_size > bufpool_min()) {
+        d->rb_size    /= 2;
+        d->short_reads = 0;
+    }
+    if(d->rb->data == NULL) {
+        uint8_t *block = bufpool_get(d->rb_size);
+        if(block != NULL) {
+            buffer_init(d->rb, d->rb_size, block);
+        }
+    }
+}
+
+/**
+ * devuelve el bloque del buffer de lectura de `d' si ya se mandó todo lo que
+ * tenía: un túnel sin datos en vuelo no retiene memoria del pool.
+ */
+static void
+copy_buffer_detach(struct copy *d) {
+    if(d->rb->data != NULL && !buffer_can_read(d->rb)) {
+        if(d->rb->data != d->raw) {
+            bufpool_put(d->rb->data, d->rb->limit - d->rb->data);
+        }
+        memset(d->rb, 0, sizeof(*d->rb));
+        d->raw = NULL;
+    }
+}
+
+/**
+ * pasa lo que quedó en el buffer de lectura de `d' al terminar el handshake
+ * a un bloque del bufpool. Si no hay memoria se sigue mandando desde el
+ * espacio del handshake, que entonces no se libera hasta vaciarlo.
+ */
+static void
+copy_buffer_leftover(struct copy *d, uint8_t *raw) {
+    size_t n;
+    const uint8_t *ptr = buffer_read_ptr(d->rb, &n);
+
+    d->raw = NULL;
+    if(n == 0) {
+        memset(d->rb, 0, sizeof(*d->rb));
+        return;
+    }
+    uint8_t *block = bufpool_get(d->rb_size);
+    if(block == NULL) {
+        d->raw = raw;
+        return;
+    }
+    assert(n <= d->rb_size);
+    memcpy(block, ptr, n);
+    buffer_init(d->rb, d->rb_size, block);
+    buffer_write_adv(d->rb, n);
+}
+
+/**
+ * libera el estado del handshake de `s' si el COPY ya no lo necesita: ni el
+ * disector ni los buffers lo usan. Si el disector se apagó, este túnel deja
+ * de mirar los bytes aunque se vuelva a prender.
+ */
+static void
+copy_handshake_done(struct socks5 *s) {
+    if(!is_disector_on) {
+        s->client_copy.dp = NULL;
+        s->origin_copy.dp = NULL;
+    }
+    if(s->hs != NULL && s->client_copy.dp == NULL
+    && s->client_copy.raw == NULL && s->origin_copy.raw == NULL) {
+        socks5_handshake_free(s);
+    }
+}
+
+static fd_interest
+copy_compute_interests(fd_selector s, struct copy *d);
+
 static void
 copy_init(const unsigned state, struct selector_key *key) {
-    struct copy *d = &ATTACHMENT(key)->client.copy;
+    struct socks5 *s = ATTACHMENT(key);
+    // el disector ve los bytes solo si estaba prendido al establecer el túnel
+    struct disector_parser *dp = is_disector_on ? &s->hs->dp : NULL;
+
+    struct copy *d = &ATTACHMENT(key)->client_copy;
     d->fd          = &ATTACHMENT(key)->client_fd;
     d->rb          = &ATTACHMENT(key)->read_buffer;
     d->wb          = &ATTACHMENT(key)->write_buffer;
+    d->rp          = &ATTACHMENT(key)->pipe_a;
+    d->wp          = &ATTACHMENT(key)->pipe_b;
+    d->splice      = is_splice_on;
+    d->dp          = dp;
     d->duplex      = OP_READ | OP_WRITE;
-    d->other       = &ATTACHMENT(key)->orig.copy;
+    d->other       = &ATTACHMENT(key)->origin_copy;
 
-    d              = &ATTACHMENT(key)->orig.copy;
+    d              = &ATTACHMENT(key)->origin_copy;
     d->fd          = &ATTACHMENT(key)->origin_fd;
     d->rb          = &ATTACHMENT(key)->write_buffer;
     d->wb          = &ATTACHMENT(key)->read_buffer;
+    d->rp          = &ATTACHMENT(key)->pipe_b;
+    d->wp          = &ATTACHMENT(key)->pipe_a;
+    d->splice      = is_splice_on;
+    d->dp          = dp;
     d->duplex      = OP_READ | OP_WRITE;
-    d->other       = &ATTACHMENT(key)->client.copy;
+    d->other       = &ATTACHMENT(key)->client_copy;
+
+    // cada lectura toma un bloque del pool mientras tenga datos en vuelo
+    d->rb_size        = bufpool_min();
+    d->other->rb_size = bufpool_min();
+    copy_buffer_leftover(d->other, s->hs->raw_buff_a);
+    copy_buffer_leftover(d, s->hs->raw_buff_b);
+    // el cliente pudo haber mandado datos junto con el request: no van a volver a despertar al selector
+    if(buffer_can_read(d->wb))
+        copy_compute_interests(key->s, d);
 
     // init disector
-    disector_parser_init(&ATTACHMENT(key)->dp);
+    if(dp != NULL)
+        disector_parser_init(dp);
+    copy_handshake_done(s);
+}
+
+/** el disector todavía necesita ver los bytes de este túnel */
+static bool
+copy_dissecting(struct copy *d) {
+    return d->dp != NULL && is_disector_on && d->dp->state != disector_incompatible;
+}
+
+/**
+ * decide si lo que se lee de este extremo se copia con splice(). Solo se
+ * puede si el disector no necesita ver los bytes y el buffer ya se vació,
+ * para no desordenarlos; y una vez en el pipe se sigue por ahí hasta vaciarlo.
+ * El pipe se abre la primera vez que hace falta.
+ */
+static bool
+copy_splice_read(struct copy *d) {
+    if (relay_pipe_can_drain(d->rp))
+        return true;
+    if (!d->splice || buffer_can_read(d->rb) || copy_dissecting(d))
+        return false;
+    if (-1 == relay_pipe_open(d->rp)) {
+        d->splice = false; // ej: sin descriptores, seguimos con el buffer
+        return false;
+    }
+    return true;
+}
+
+/** quedan bytes por mandar hacia este extremo */
+static bool
+copy_pending_write(struct copy *d) {
+    return buffer_can_read(d->wb) || relay_pipe_can_drain(d->wp);
 }
 
 /** actualiza los intereses en el selector segun el estado del copy */
 static fd_interest
 copy_compute_interests(fd_selector s, struct copy *d) {
     fd_interest ret = OP_NOOP;
-    if ((d->duplex & OP_READ) && buffer_can_write(d->rb))
+    if ((d->duplex & OP_READ)
+    && (copy_splice_read(d) ? relay_pipe_can_fill(d->rp)
+                            : d->rb->data == NULL || buffer_can_write(d->rb)))
         ret |= OP_READ;
-    if ((d->duplex & OP_WRITE) && buffer_can_read(d->wb))
+    if ((d->duplex & OP_WRITE) && copy_pending_write(d))
         ret |= OP_WRITE;
     if (SELECTOR_SUCCESS != selector_set_interest(s, *d->fd, ret))
         abort();
@@ -1103,7 +1860,7 @@ copy_compute_interests(fd_selector s, struct copy *d) {
 static struct copy *
 copy_ptr(struct selector_key *key) {
     // agarramos cualquiera de los extremos del copy
-    struct copy *d = &ATTACHMENT(key)->client.copy;
+    struct copy *d = &ATTACHMENT(key)->client_copy;
 
     if (*d->fd == key->fd) {
         // ok, agarramos el correcto
@@ -1114,6 +1871,8 @@ copy_ptr(struct selector_key *key) {
     return d;
 }
 
+static void copy_send(struct selector_key *key, struct copy *d);
+
 /** lee bytes de un socket y los encola para ser escritos en otro socket */
 static unsigned
 copy_r(struct selector_key *key) {
@@ -1126,25 +1885,50 @@ copy_r(struct selector_key *key) {
     buffer *b   = d->rb;
     unsigned ret = COPY;
 
-    uint8_t *ptr = buffer_write_ptr(b, &size);
-    n = recv(key->fd, ptr, size, 0);
-    if (n <= 0) {
+    if (copy_splice_read(d)) {
+        n = relay_pipe_fill(d->rp, key->fd);
+    } else {
+        copy_buffer_attach(d);
+        if (b->data == NULL) {
+            n     = -1;
+            errno = ENOMEM; // sin memoria para leer, se corta este sentido
+        } else {
+            uint8_t *ptr = buffer_write_ptr(b, &size);
+            n = recv(key->fd, ptr, size, 0);
+            if (n > 0) {
+                buffer_write_adv(b, n);
+                // un túnel que llena el buffer lo necesita más grande, uno que apenas lo usa no
+                d->full_reads  = (size_t) n == size ? d->full_reads + 1 : 0;
+                d->short_reads = (size_t) n < size / 4 ? d->short_reads + 1 : 0;
+            }
+        }
+        copy_buffer_detach(d);
+        copy_handshake_done(ATTACHMENT(key));
+    }
+    if (n > 0 && (d->other->duplex & OP_WRITE)) {
+        // el otro extremo casi siempre tiene lugar: se manda en el acto en
+        // lugar de esperar a que el selector lo reporte en otra iteración
+        copy_send(key, d->other);
+    }
+    if (n == -1 && errno == EAGAIN) {
+        // nada para leer todavia
+    } else if (n <= 0) {
         shutdown(*d->fd, SHUT_RD); // no leeremos mas de ahi
         d->duplex &= ~OP_READ;
-        if (*d->other->fd != -1) {
+        // si quedan bytes encolados para el otro extremo, copy_w() lo cerrara al terminar de mandarlos
+        if (*d->other->fd != -1 && !copy_pending_write(d->other)) {
             shutdown(*d->other->fd, SHUT_WR);
             d->other->duplex &= ~OP_WRITE;
         }
-    } else {
-        buffer_write_adv(b, n);
     }
 
     copy_compute_interests(key->s, d);
     copy_compute_interests(key->s, d->other);
 
-    if (d->duplex == OP_NOOP) {
+    // el envío en el acto pudo haber cerrado el otro extremo
+    if (d->duplex == OP_NOOP || d->other->duplex == OP_NOOP) {
         ret = DONE;
-        current_connections -= 1;
+        STATS_SUB(current_connections, 1);
     }
 
     return ret;
@@ -1152,22 +1936,31 @@ copy_r(struct selector_key *key) {
 
 void log_credentials(const char *user, const char *pass, const char *uname, enum socks_addr_type addr_type, union socks_addr *addr, const struct sockaddr* originaddr);
 
-/** escribe bytes encolados */
-static unsigned
-copy_w(struct selector_key *key) {
-    struct copy *d = copy_ptr(key);
-    assert(*d->fd == key->fd);
-
-    struct disector_parser *dp = &ATTACHMENT(key)->dp;
+/**
+ * intenta mandar por el extremo de `d' lo que tiene encolado, sin
+ * bloquearse. Lo llama copy_w() cuando el selector lo reporta listo, y
+ * copy_r() en el acto luego de leer.
+ */
+static void
+copy_send(struct selector_key *key, struct copy *d) {
+    struct disector_parser *dp = d->dp;
+    const int fd = *d->fd;
 
     size_t size;
     ssize_t n;
     buffer *b = d->wb;
-    unsigned ret = COPY;
 
-    uint8_t *ptr = buffer_read_ptr(b, &size);
-    n = send(key->fd, ptr, size, MSG_NOSIGNAL);
-    if (n == -1) {
+    uint8_t *ptr = NULL;
+    // lo que quedo en el buffer se manda antes que lo que haya en el pipe
+    if (buffer_can_read(b)) {
+        ptr = buffer_read_ptr(b, &size);
+        n = send(fd, ptr, size, MSG_NOSIGNAL);
+    } else {
+        n = relay_pipe_drain(d->wp, fd);
+    }
+    if (n == -1 && errno == EAGAIN) {
+        // el socket no tiene lugar todavia
+    } else if (n == -1) {
         shutdown(*d->fd, SHUT_WR);
         d->duplex &= ~OP_WRITE;
         if (*d->other->fd != -1) {
@@ -1176,36 +1969,193 @@ copy_w(struct selector_key *key) {
         }
     } else {
         // si estamos esperando el usuario y pass, miramos lo que escribe cliente sobre origin, y si estamos esperando la response o que se inicie una conexion POP3, al reves
-        if (is_disector_on && dp->state != disector_incompatible
-        && ((dp->state < disector_response && dp->state >= disector_user && key->fd == ATTACHMENT(key)->origin_fd)
-        || ((dp->state == disector_response || dp->state == disector_wait_pop) && key->fd == ATTACHMENT(key)->client_fd))) {
+        if (ptr != NULL && copy_dissecting(d)
+        && ((dp->state < disector_response && dp->state >= disector_user && fd == ATTACHMENT(key)->origin_fd)
+        || ((dp->state == disector_response || dp->state == disector_wait_pop) && fd == ATTACHMENT(key)->client_fd))) {
             const enum disector_state st = disector_consume(dp, ptr, n);
             if (st == disector_done) {
                 log_credentials(dp->disector.user,
                     dp->disector.pass,
-                    ATTACHMENT(key)->client_uname,
-                    ATTACHMENT(key)->dest_addr_type,
-                    &ATTACHMENT(key)->dest_addr,
-                    (const struct sockaddr *) &ATTACHMENT(key)->origin_addr
+                    ATTACHMENT(key)->hs->client_uname,
+                    ATTACHMENT(key)->hs->dest_addr_type,
+                    &ATTACHMENT(key)->hs->dest_addr,
+                    (const struct sockaddr *) &ATTACHMENT(key)->hs->origin_addr
                 );
                 disector_parser_reset(dp);
+            } else if (st == disector_incompatible) {
+                // no es POP3: ya no hace falta el estado del handshake
+                d->dp        = NULL;
+                d->other->dp = NULL;
             }
         }
-        buffer_read_adv(b, n);
-        bytes_transferred += n;
+        if (ptr != NULL) {
+            buffer_read_adv(b, n);
+            copy_buffer_detach(d->other);
+            copy_handshake_done(ATTACHMENT(key));
+        }
+        STATS_ADD(bytes_transferred, n);
+
+        // el otro extremo ya no nos manda nada y terminamos de vaciar lo que habia mandado
+        if (!(d->other->duplex & OP_READ) && !copy_pending_write(d)) {
+            shutdown(*d->fd, SHUT_WR);
+            d->duplex &= ~OP_WRITE;
+        }
     }
+}
+
+/** escribe bytes encolados */
+static unsigned
+copy_w(struct selector_key *key) {
+    struct copy *d = copy_ptr(key);
+    assert(*d->fd == key->fd);
+
+    unsigned ret = COPY;
+
+    copy_send(key, d);
 
     copy_compute_interests(key->s, d);
     copy_compute_interests(key->s, d->other);
 
     if (d->duplex == OP_NOOP) {
         ret = DONE;
-        current_connections -= 1;
+        STATS_SUB(current_connections, 1);
     }
 
     return ret;
 }
 
+/** el túnel estuvo `idle' segundos sin tráfico en ningún sentido */
+static unsigned
+copy_timeout(struct selector_key *key) {
+    STATS_SUB(current_connections, 1);
+    return DONE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// TIMEOUTS
+////////////////////////////////////////////////////////////////////////////////
+
+static struct socks5_timeouts timeouts = {
+    .hello   = DEFAULT_HELLO_TIMEOUT,
+    .auth    = DEFAULT_AUTH_TIMEOUT,
+    .request = DEFAULT_REQUEST_TIMEOUT,
+    .resolve = DEFAULT_RESOLVE_TIMEOUT,
+    .connect = DEFAULT_CONNECT_TIMEOUT,
+    .idle    = DEFAULT_IDLE_TIMEOUT,
+};
+
+void
+socksv5_set_timeouts(const struct socks5_timeouts *t) {
+    timeouts = *t;
+}
+
+/**
+ * segundos que puede pasar la conexión en `state', 0 si no tiene límite.
+ * La escritura de cada respuesta comparte el plazo del mensaje que responde.
+ */
+static unsigned
+state_timeout(const unsigned state) {
+    unsigned ret = 0;
+    switch(state) {
+        case HELLO_READ:
+        case HELLO_WRITE:
+            ret = timeouts.hello;
+            break;
+        case AUTH_READ:
+        case AUTH_VERIFY:
+        case AUTH_WRITE:
+            ret = timeouts.auth;
+            break;
+        case REQUEST_READ:
+        case REQUEST_WRITE:
+            ret = timeouts.request;
+            break;
+        case REQUEST_RESOLV:
+            ret = timeouts.resolve;
+            break;
+        case REQUEST_CONNECTING:
+            ret = timeouts.connect;
+            break;
+        case COPY:
+            ret = timeouts.idle;
+            break;
+    }
+    return ret;
+}
+
+/**
+ * programa en el fd del cliente el plazo del estado al que se llegó. El de
+ * COPY se reprograma con cada evento del túnel, por lo que solo vence si no
+ * hay tráfico. Un cliente que manda el handshake de a un byte no lo extiende.
+ */
+static void
+socks5_deadline(struct selector_key *key, const unsigned from, const unsigned to) {
+    if(from != to || COPY == to) {
+        selector_set_timeout(key->s, ATTACHMENT(key)->client_fd, state_timeout(to) * 1000);
+    }
+}
+
+/**
+ * manda las respuestas del handshake que quedaron encoladas porque el cliente
+ * adelantó el mensaje siguiente, cuando ese mensaje todavía no llegó entero.
+ * Si el socket no las acepta todas se espera a OP_WRITE sin dejar de leer.
+ */
+static unsigned
+handshake_flush(struct selector_key *key) {
+    struct socks5 *s     = ATTACHMENT(key);
+    const unsigned state = stm_state(&s->stm);
+    buffer *b            = &s->write_buffer;
+    uint8_t *ptr;
+    size_t count;
+    ssize_t n;
+
+    ptr = buffer_read_ptr(b, &count);
+    n = send(key->fd, ptr, count, MSG_NOSIGNAL);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return ERROR;
+    } else {
+        buffer_read_adv(b, n);
+    }
+    const fd_interest interest = buffer_can_read(b) ? OP_READ | OP_WRITE : OP_READ;
+
+    return SELECTOR_SUCCESS == selector_set_interest_key(key, interest) ? state : ERROR;
+}
+
+/**
+ * true si el cliente mandó (parte de) el mensaje que espera el estado de
+ * lectura st junto con el anterior, y hay que procesarlo sin esperar al
+ * selector porque esos bytes ya no van a volver a despertarlo.
+ */
+static bool
+handshake_pipelined(struct selector_key *key, const unsigned st) {
+    return (AUTH_READ == st || REQUEST_READ == st)
+        && buffer_can_read(&ATTACHMENT(key)->read_buffer);
+}
+
+/**
+ * procesa los mensajes del handshake que el cliente adelantó y manda las
+ * respuestas que quedaron encoladas, a partir del estado `st'.
+ */
+static unsigned
+handshake_drain(struct selector_key *key, unsigned st) {
+    struct state_machine *stm = &ATTACHMENT(key)->stm;
+
+    while(handshake_pipelined(key, st)) {
+        st = stm_handler_read(stm, key);
+    }
+    if((AUTH_READ == st || REQUEST_READ == st) && buffer_can_read(&ATTACHMENT(key)->write_buffer)) {
+        st = handshake_flush(key);
+    }
+    return st;
+}
+
+/** venció el plazo de un estado del handshake */
+static unsigned
+handshake_timeout(struct selector_key *key) {
+    return ERROR;
+}
+
 /** definición de handlers para cada estado */
 static const struct state_definition client_statbl[] = {
     {
@@ -1213,44 +2163,61 @@ static const struct state_definition client_statbl[] = {
         .on_arrival       = hello_read_init,
         .on_departure     = hello_read_close,
         .on_read_ready    = hello_read,
+        .on_timeout       = handshake_timeout,
     },
     {
         .state            = HELLO_WRITE,
         .on_write_ready   = hello_write,
+        .on_timeout       = handshake_timeout,
     },
     {
         .state            = AUTH_READ,
         .on_arrival       = auth_init,
         .on_read_ready    = auth_read,
+        .on_write_ready   = handshake_flush,
+        .on_timeout       = handshake_timeout,
+    },
+    {
+        .state            = AUTH_VERIFY,
+        .on_block_ready   = auth_verify_done,
+        .on_timeout       = handshake_timeout,
     },
     {
         .state            = AUTH_WRITE,
         .on_write_ready   = auth_write,
+        .on_timeout       = handshake_timeout,
     },
     {
         .state            = REQUEST_READ,
         .on_arrival       = request_init,
         .on_departure     = request_read_close,
         .on_read_ready    = request_read,
+        .on_write_ready   = handshake_flush,
+        .on_timeout       = handshake_timeout,
     },
     {
         .state            = REQUEST_RESOLV,
         .on_block_ready   = request_resolv_done,
+        .on_timeout       = request_resolv_timeout,
     },
     {
         .state            = REQUEST_CONNECTING,
         .on_arrival       = request_connecting_init,
+        .on_departure     = request_connecting_close,
         .on_write_ready   = request_connecting,
+        .on_timeout       = request_connecting_timeout,
     },
     {
         .state            = REQUEST_WRITE,
         .on_write_ready   = request_write,
+        .on_timeout       = handshake_timeout,
     },
     {
         .state            = COPY,
         .on_arrival       = copy_init,
         .on_read_ready    = copy_r,
         .on_write_ready   = copy_w,
+        .on_timeout       = copy_timeout,
     },
     {
         .state            = DONE,
@@ -1274,30 +2241,59 @@ socksv5_done(struct selector_key* key);
 static void
 socksv5_read(struct selector_key *key) {
     struct state_machine *stm   = &ATTACHMENT(key)->stm;
-    const enum socks_v5state st = stm_handler_read(stm, key);
+    const unsigned from         = stm_state(stm);
+    const enum socks_v5state st = handshake_drain(key, stm_handler_read(stm, key));
 
     if(ERROR == st || DONE == st) {
         socksv5_done(key);
+    } else {
+        socks5_deadline(key, from, st);
     }
 }
 
 static void
 socksv5_write(struct selector_key *key) {
     struct state_machine *stm   = &ATTACHMENT(key)->stm;
+    const unsigned from         = stm_state(stm);
     const enum socks_v5state st = stm_handler_write(stm, key);
 
     if(ERROR == st || DONE == st) {
         socksv5_done(key);
+    } else {
+        socks5_deadline(key, from, st);
     }
 }
 
 static void
 socksv5_block(struct selector_key *key) {
     struct state_machine *stm   = &ATTACHMENT(key)->stm;
-    const enum socks_v5state st = stm_handler_block(stm, key);
+    const unsigned from         = stm_state(stm);
+
+    // notificación para una conexión anterior con el mismo fd, o para una
+    // resolución que ya se dejó de esperar
+    if((REQUEST_RESOLV != from || !dnscache_ready(&ATTACHMENT(key)->hs->dns))
+    && (AUTH_VERIFY != from || !authverify_ready(&ATTACHMENT(key)->hs->verify))) {
+        return;
+    }
+    const enum socks_v5state st = handshake_drain(key, stm_handler_block(stm, key));
 
     if(ERROR == st || DONE == st) {
         socksv5_done(key);
+    } else {
+        socks5_deadline(key, from, st);
+    }
+}
+
+static void
+socksv5_timeout(struct selector_key *key) {
+    struct state_machine *stm   = &ATTACHMENT(key)->stm;
+    const unsigned from         = stm_state(stm);
+    const enum socks_v5state st = stm_handler_timeout(stm, key);
+
+    if(ERROR == st || DONE == st) {
+        socksv5_done(key);
+    } else {
+        socks5_deadline(key, from, st);
     }
 }
 
@@ -1325,9 +2321,10 @@ socksv5_done(struct selector_key* key) {
 // ISO-8601 date
 static void log_current_local_date(char *buf) {
     time_t rawtime;
-    struct tm *ptm;
-    // time retorna la cant de segundos since Epoch, localtime devuelve un struct tm en localtime
-    if ((rawtime = time(NULL)) != -1 && (ptm = localtime(&rawtime)) != NULL) {
+    struct tm tm, *ptm;
+    // time retorna la cant de segundos since Epoch, localtime_r devuelve un struct tm en localtime.
+    // localtime() además de no ser reentrante vuelve a mirar TZ (y aloca) en cada llamada
+    if ((rawtime = time(NULL)) != -1 && (ptm = localtime_r(&rawtime, &tm)) != NULL) {
         if (strftime(buf, 50, "%FT%T", ptm) > 0) {
             printf("%s", buf);
             printf("%s", ptm->__tm_zone); //indica el offset local con respecto a UTC
@@ -1358,7 +2355,7 @@ void log_request(enum socks_response_status status, const char *uname, struct re
     putchar('\t');
 
     // username del cliente
-    printf("%s", is_auth_on ? uname : "<anonymous>");
+    printf("%s", uname[0] != '\0' ? uname : "<anonymous>");
     putchar('\t');
 
     // tipo de registro
@@ -1386,7 +2383,7 @@ void log_credentials(const char *user, const char *pass, const char *uname, enum
     putchar('\t');
 
     // username del cliente
-    printf("%s", is_auth_on ? uname : "<anonymous>");
+    printf("%s", uname[0] != '\0' ? uname : "<anonymous>");
     putchar('\t');
 
     // tipo de registro
@@ -93,6 +93,18 @@ stm_handler_block(struct state_machine *stm, struct selector_key *key) {
     return ret;
 }
 
+unsigned
+stm_handler_timeout(struct state_machine *stm, struct selector_key *key) {
+    handle_first(stm, key);
+    if(stm->current->on_timeout == 0) {
+        return stm->current->state;
+    }
+    const unsigned int ret = stm->current->on_timeout(key);
+    jump(stm, ret, key);
+
+    return ret;
+}
+
 void
 stm_handler_close(struct state_machine *stm, struct selector_key *key) {
     if(stm->current != NULL && stm->current->on_departure != NULL) {
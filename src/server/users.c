@@ -0,0 +1,465 @@
+/**
+ * users.c - usuarios habilitados a usar el proxy, en tablas de hash
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "../include/users.h"
+
+/** cantidad de listas con la que arranca una tabla, potencia de 2 */
+#define USERS_MIN_BUCKETS 64
+
+struct user {
+    /** siguiente en la lista de la tabla */
+    struct user *next;
+    uint32_t     hash;
+    uint8_t      ulen;
+    uint8_t      plen;
+    /** <usuario>\0<contraseña>\0 */
+    char         data[];
+};
+
+struct users_table {
+    /** nbuckets listas, potencia de 2; NULL hasta el primer usuario */
+    struct user **buckets;
+    size_t        nbuckets;
+    size_t        count;
+};
+
+/** protege a `runtime' y al puntero `file' */
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** usuarios agregados con -u y desde el monitor */
+static struct users_table runtime;
+
+/**
+ * usuarios del archivo. Una vez publicada la tabla no se modifica: al
+ * recargar se arma otra y se reemplaza el puntero.
+ */
+static struct users_table *file;
+
+/** hilo que recarga el archivo cada vez que se lo piden */
+static struct {
+    const char  *path;
+    pthread_t    thread;
+    sem_t        pending;
+    atomic_bool  stop;
+    bool         running;
+} reloader;
+
+/** longitud de `s', hasta USERS_MAX_LEN */
+static size_t
+bounded_len(const char *s) {
+    size_t len = 0;
+    while(len < USERS_MAX_LEN && s[len] != '\0') {
+        len++;
+    }
+    return len;
+}
+
+/** FNV-1a del nombre */
+static uint32_t
+hash(const char *uname, const size_t len) {
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t) uname[i]) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * enlace que apunta al usuario `uname' en su lista de `t', o al final de la
+ * lista si no existe. NULL si la tabla todavía no tiene listas.
+ */
+static struct user **
+find(const struct users_table *t, const char *uname, const size_t len, const uint32_t h) {
+    if(t == NULL || t->nbuckets == 0) {
+        return NULL;
+    }
+    struct user **p = t->buckets + (h & (t->nbuckets - 1));
+    while(*p != NULL && ((*p)->hash != h || (*p)->ulen != len || memcmp((*p)->data, uname, len) != 0)) {
+        p = &(*p)->next;
+    }
+    return p;
+}
+
+static struct user *
+lookup(const struct users_table *t, const char *uname, const size_t len, const uint32_t h) {
+    struct user **p = find(t, uname, len, h);
+    return p == NULL ? NULL : *p;
+}
+
+/**
+ * duplica la cantidad de listas de `t' (o crea las primeras). Si no hay
+ * memoria la tabla sigue con las que tiene, con listas más largas.
+ */
+static void
+grow(struct users_table *t) {
+    const size_t n = t->nbuckets == 0 ? USERS_MIN_BUCKETS : t->nbuckets * 2;
+    struct user **buckets = calloc(n, sizeof(*buckets));
+    if(buckets == NULL) {
+        return;
+    }
+    for(size_t i = 0; i < t->nbuckets; i++) {
+        for(struct user *u = t->buckets[i], *next; u != NULL; u = next) {
+            next = u->next;
+            struct user **b = buckets + (u->hash & (n - 1));
+            u->next = *b;
+            *b      = u;
+        }
+    }
+    free(t->buckets);
+    t->buckets  = buckets;
+    t->nbuckets = n;
+}
+
+/**
+ * agrega a `t' un usuario que no está en ella.
+ *
+ * @return 0 si se agregó, 1 si no hay memoria.
+ */
+static int
+insert(struct users_table *t, const char *uname, const size_t ulen,
+       const uint32_t h, const char *passwd) {
+    if(t->count >= t->nbuckets) {
+        grow(t);
+        if(t->nbuckets == 0) {
+            return 1;
+        }
+    }
+    const size_t plen = bounded_len(passwd);
+    struct user *u    = malloc(sizeof(*u) + ulen + plen + 2);
+    if(u == NULL) {
+        return 1;
+    }
+    u->hash = h;
+    u->ulen = ulen;
+    u->plen = plen;
+    memcpy(u->data, uname, ulen);
+    u->data[ulen] = '\0';
+    memcpy(u->data + ulen + 1, passwd, plen);
+    u->data[ulen + 1 + plen] = '\0';
+
+    struct user **b = t->buckets + (h & (t->nbuckets - 1));
+    u->next = *b;
+    *b      = u;
+    t->count++;
+    return 0;
+}
+
+/** libera los usuarios y las listas de `t' */
+static void
+table_clear(struct users_table *t) {
+    for(size_t i = 0; i < t->nbuckets; i++) {
+        for(struct user *u = t->buckets[i], *next; u != NULL; u = next) {
+            next = u->next;
+            free(u);
+        }
+    }
+    free(t->buckets);
+    t->buckets  = NULL;
+    t->nbuckets = 0;
+    t->count    = 0;
+}
+
+/**
+ * compara la contraseña de `u' con `passwd' recorriendo siempre
+ * USERS_MAX_LEN + 1 bytes, para que el tiempo no dependa de cuántos
+ * caracteres coinciden.
+ */
+static bool
+passwd_equals(const struct user *u, const char *passwd) {
+    const char *stored = u == NULL ? "" : u->data + u->ulen + 1;
+    const size_t slen  = u == NULL ? 0  : u->plen;
+    const size_t len   = bounded_len(passwd);
+    unsigned diff      = slen ^ len;
+    for(size_t i = 0; i <= USERS_MAX_LEN; i++) {
+        const uint8_t a = i < slen ? (uint8_t) stored[i] : 0;
+        const uint8_t b = i < len  ? (uint8_t) passwd[i] : 0;
+        diff |= a ^ b;
+    }
+    return diff == 0;
+}
+
+int
+users_add(const char *uname, const char *passwd) {
+    const size_t len = bounded_len(uname);
+    const uint32_t h = hash(uname, len);
+    int ret          = 0;
+
+    pthread_rwlock_wrlock(&lock);
+    if(runtime.count + (file == NULL ? 0 : file->count) >= MAX_USERS) {
+        ret = 1;
+        goto finally;
+    }
+    if(lookup(&runtime, uname, len, h) != NULL || lookup(file, uname, len, h) != NULL) {
+        ret = -1;
+        goto finally;
+    }
+    ret = insert(&runtime, uname, len, h, passwd);
+finally:
+    pthread_rwlock_unlock(&lock);
+    return ret;
+}
+
+int
+users_remove(const char *uname) {
+    const size_t len = bounded_len(uname);
+    const uint32_t h = hash(uname, len);
+    int ret          = -1;
+
+    pthread_rwlock_wrlock(&lock);
+    struct user **p = find(&runtime, uname, len, h);
+    if(p != NULL && *p != NULL) {
+        struct user *u = *p;
+        *p = u->next;
+        free(u);
+        runtime.count--;
+        ret = 0;
+    }
+    pthread_rwlock_unlock(&lock);
+    return ret;
+}
+
+bool
+users_check(const char *uname, const char *passwd) {
+    const size_t len = bounded_len(uname);
+    const uint32_t h = hash(uname, len);
+
+    pthread_rwlock_rdlock(&lock);
+    const struct user *u = lookup(&runtime, uname, len, h);
+    if(u == NULL) {
+        u = lookup(file, uname, len, h);
+    }
+    // sin el usuario se compara igual, para tardar lo mismo
+    const bool ok = passwd_equals(u, passwd) && u != NULL;
+    pthread_rwlock_unlock(&lock);
+
+    return ok;
+}
+
+size_t
+users_count(void) {
+    pthread_rwlock_rdlock(&lock);
+    const size_t ret = runtime.count + (file == NULL ? 0 : file->count);
+    pthread_rwlock_unlock(&lock);
+    return ret;
+}
+
+/**
+ * copia en `buf' los nombres de `t' que no están en `skip', a partir del
+ * byte `*n', y avanza `*n'.
+ *
+ * @return false si no entraron todos.
+ */
+static bool
+list(const struct users_table *t, const struct users_table *skip,
+     char *buf, const size_t size, size_t *n) {
+    for(size_t i = 0; t != NULL && i < t->nbuckets; i++) {
+        for(const struct user *u = t->buckets[i]; u != NULL; u = u->next) {
+            if(lookup(skip, u->data, u->ulen, u->hash) != NULL) {
+                continue;
+            }
+            const size_t len = u->ulen + 1; // incluimos el \0
+            if(*n + len > size) {
+                return false;
+            }
+            memcpy(buf + *n, u->data, len);
+            *n += len;
+        }
+    }
+    return true;
+}
+
+size_t
+users_list(char *buf, size_t size) {
+    size_t n = 0;
+
+    pthread_rwlock_rdlock(&lock);
+    if(list(&runtime, NULL, buf, size, &n)) {
+        list(file, &runtime, buf, size, &n);
+    }
+    pthread_rwlock_unlock(&lock);
+
+    return n > 0 ? n - 1 : 0; // no cuenta el ultimo \0
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// ARCHIVO DE USUARIOS
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * lee `path' en una tabla nueva. Las líneas inválidas o repetidas se
+ * informan y se saltean.
+ *
+ * @return la tabla, o NULL si no se pudo leer el archivo o no hay memoria.
+ */
+static struct users_table *
+table_load(const char *path) {
+    // <usuario>:<contraseña>\n, con espacio para detectar líneas largas
+    char line[2 * USERS_MAX_LEN + 4];
+    unsigned lineno = 0;
+    bool ok         = false;
+
+    struct users_table *t = calloc(1, sizeof(*t));
+    FILE *f               = fopen(path, "r");
+    if(f == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        goto finally;
+    }
+    if(t == NULL) {
+        goto finally;
+    }
+
+    while(fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        size_t n = strlen(line);
+        if(n > 0 && line[n - 1] == '\n') {
+            line[--n] = '\0';
+        } else if(!feof(f)) {
+            fprintf(stderr, "%s:%u: line too long\n", path, lineno);
+            int c;
+            while((c = fgetc(f)) != EOF && c != '\n')
+                ;
+            continue;
+        }
+        if(n > 0 && line[n - 1] == '\r') {
+            line[--n] = '\0';
+        }
+        if(n == 0 || line[0] == '#') {
+            continue;
+        }
+
+        char *passwd = strchr(line, ':');
+        if(passwd == NULL || passwd == line
+        || passwd - line > USERS_MAX_LEN || strlen(passwd + 1) > USERS_MAX_LEN) {
+            fprintf(stderr, "%s:%u: expected <user>:<pass>\n", path, lineno);
+            continue;
+        }
+        const size_t len = passwd - line;
+        *passwd++ = '\0';
+
+        const uint32_t h = hash(line, len);
+        if(lookup(t, line, len, h) != NULL) {
+            fprintf(stderr, "%s:%u: user %s already exists\n", path, lineno, line);
+            continue;
+        }
+        if(t->count >= MAX_USERS) {
+            fprintf(stderr, "%s: maximum number of users reached\n", path);
+            break;
+        }
+        if(insert(t, line, len, h, passwd) != 0) {
+            goto finally;
+        }
+    }
+    ok = !ferror(f);
+
+finally:
+    if(f != NULL) {
+        fclose(f);
+    }
+    if(!ok && t != NULL) {
+        table_clear(t);
+        free(t);
+        t = NULL;
+    }
+    return t;
+}
+
+/** publica `t' como la tabla del archivo y libera la anterior */
+static void
+file_swap(struct users_table *t) {
+    pthread_rwlock_wrlock(&lock);
+    struct users_table *old = file;
+    file = t;
+    pthread_rwlock_unlock(&lock);
+
+    if(old != NULL) {
+        table_clear(old);
+        free(old);
+    }
+}
+
+static void *
+reloader_run(void *arg) {
+    while(true) {
+        while(sem_wait(&reloader.pending) == -1 && errno == EINTR)
+            ;
+        if(atomic_load(&reloader.stop)) {
+            break;
+        }
+        // los pedidos que llegaron mientras tanto se atienden con esta lectura
+        while(sem_trywait(&reloader.pending) == 0)
+            ;
+
+        struct users_table *t = table_load(reloader.path);
+        if(t == NULL) {
+            fprintf(stderr, "Users: unable to reload %s, keeping previous users\n", reloader.path);
+            continue;
+        }
+        if(t->count == 0 && file != NULL && file->count > 0) {
+            // un archivo vacío o a medio escribir dejaría al proxy sin usuarios
+            fprintf(stderr, "Users: %s has no users, keeping previous users\n", reloader.path);
+            table_clear(t);
+            free(t);
+            continue;
+        }
+        const size_t n = t->count;
+        file_swap(t);
+        printf("Users: loaded %zu users from %s\n", n, reloader.path);
+    }
+    return NULL;
+}
+
+int
+users_file_init(const char *path) {
+    struct users_table *t = table_load(path);
+    if(t == NULL) {
+        return -1;
+    }
+    printf("Users: loaded %zu users from %s\n", t->count, path);
+    file_swap(t);
+
+    if(sem_init(&reloader.pending, 0, 0) == -1) {
+        return -1;
+    }
+    reloader.path = path;
+    atomic_store(&reloader.stop, false);
+    if(pthread_create(&reloader.thread, NULL, reloader_run, NULL) != 0) {
+        sem_destroy(&reloader.pending);
+        return -1;
+    }
+    reloader.running = true;
+    return 0;
+}
+
+int
+users_file_reload(void) {
+    if(!reloader.running) {
+        return -1;
+    }
+    sem_post(&reloader.pending);
+    return 0;
+}
+
+void
+users_destroy(void) {
+    if(reloader.running) {
+        atomic_store(&reloader.stop, true);
+        sem_post(&reloader.pending);
+        pthread_join(reloader.thread, NULL);
+        sem_destroy(&reloader.pending);
+        reloader.running = false;
+    }
+    file_swap(NULL);
+
+    pthread_rwlock_wrlock(&lock);
+    table_clear(&runtime);
+    pthread_rwlock_unlock(&lock);
+}